@@ -0,0 +1,662 @@
+#include "aot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "textbuffer.h"
+#include "value.h"
+#include "vm.h"
+
+// Everything the generated file needs to declare before the function bodies.
+typedef struct Program
+{
+    FunctionObj **functions;
+    char **names;
+    bool *isValue;
+    int functionCount;
+    int functionCapacity;
+    StringObj **globals;
+    int globalCount;
+    int globalCapacity;
+    bool needsPrint;
+    bool needsCallValue;
+    bool isSupported;
+} Program;
+
+static int findFunction(Program *program, FunctionObj *function)
+{
+    for (int i = 0; i < program->functionCount; i++)
+    {
+        if (program->functions[i] == function)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static char *nameFunction(FunctionObj *function, int index)
+{
+    if (index == 0)
+    {
+        char *name = malloc(sizeof("lox_script"));
+        strcpy(name, "lox_script");
+        return name;
+    }
+    int length = snprintf(NULL, 0, "lox_%s_%d", function->name->chars, index);
+    char *name = malloc(length + 1);
+    snprintf(name, length + 1, "lox_%s_%d", function->name->chars, index);
+    return name;
+}
+
+// Functions are found through the constants they are declared in, starting at the script.
+static void collectFunctions(Program *program, FunctionObj *function)
+{
+    if (findFunction(program, function) != -1)
+    {
+        return;
+    }
+
+    if (program->functionCapacity < program->functionCount + 1)
+    {
+        int oldCapacity = program->functionCapacity;
+        program->functionCapacity = GROW_CAPACITY(oldCapacity);
+        program->functions = GROW_ARRAY(FunctionObj *, program->functions, oldCapacity, program->functionCapacity);
+        program->names = GROW_ARRAY(char *, program->names, oldCapacity, program->functionCapacity);
+        program->isValue = GROW_ARRAY(bool, program->isValue, oldCapacity, program->functionCapacity);
+    }
+    int index = program->functionCount++;
+    program->functions[index] = function;
+    program->names[index] = nameFunction(function, index);
+    program->isValue[index] = false;
+
+    ValueArray *constants = &function->bytecode->constants;
+    for (uint32_t i = 0; i < constants->count; i++)
+    {
+        if (isFunctionObj(constants->constants[i]))
+        {
+            collectFunctions(program, unwrapFunctionObj(constants->constants[i]));
+        }
+    }
+}
+
+static int findGlobal(Program *program, StringObj *name)
+{
+    for (int i = 0; i < program->globalCount; i++)
+    {
+        if (strcmp(program->globals[i]->chars, name->chars) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void addGlobal(Program *program, StringObj *name)
+{
+    if (findGlobal(program, name) != -1)
+    {
+        return;
+    }
+
+    if (program->globalCapacity < program->globalCount + 1)
+    {
+        int oldCapacity = program->globalCapacity;
+        program->globalCapacity = GROW_CAPACITY(oldCapacity);
+        program->globals = GROW_ARRAY(StringObj *, program->globals, oldCapacity, program->globalCapacity);
+    }
+    program->globals[program->globalCount++] = name;
+}
+
+static bool isGlobal(OpCode opCode)
+{
+    return opCode == OP_VAR_GLOBAL_DECL || opCode == OP_VAR_GLOBAL_ASSIGN || opCode == OP_VAR_GLOBAL_EXPRESSION || opCode == OP_VAR_GLOBAL_DECL_LONG || opCode == OP_VAR_GLOBAL_ASSIGN_LONG || opCode == OP_VAR_GLOBAL_EXPRESSION_LONG;
+}
+
+static bool isConstant(OpCode opCode)
+{
+    return opCode == OP_CONSTANT || opCode == OP_CONSTANT_LONG;
+}
+
+static bool isDirectCall(OpCode opCode)
+{
+    return opCode == OP_CALL_DIRECT || opCode == OP_CALL_DIRECT_LONG;
+}
+
+static bool isDirectTailCall(OpCode opCode)
+{
+    return opCode == OP_TAIL_CALL_DIRECT || opCode == OP_TAIL_CALL_DIRECT_LONG;
+}
+
+// Bytecode instructions and the superinstructions built from them have C equivalents.
+// Trace instructions and OP_STACK_PEEK, which the VM does not run either, do not, and
+// neither does any op code added later until emitInstruction learns it.
+static bool hasCFor(OpCode opCode)
+{
+    return isConstant(opCode) || isGlobal(opCode) || isJumpOpCode(opCode) || isCallOpCode(opCode) || opCode == OP_RETURN || opCode == OP_NEGATE || opCode == OP_ADD || opCode == OP_SUB || opCode == OP_MULT || opCode == OP_DIV || opCode == OP_LESS_THAN || opCode == OP_LESS_THAN_EQUALS || opCode == OP_EQUAL || opCode == OP_OR || opCode == OP_TRUE || opCode == OP_FALSE || opCode == OP_STRING || opCode == OP_PRINT || opCode == OP_POP || opCode == OP_VAR_DECL || opCode == OP_VAR_ASSIGN || opCode == OP_VAR_ASSIGN_LONG || opCode == OP_VAR_EXPRESSION || opCode == OP_VAR_EXPRESSION_LONG || opCode == OP_LOCAL_ADD_CONSTANT || opCode == OP_LOCAL_INCREMENT || opCode == OP_LOCAL_LESS_THAN_CONSTANT || opCode == OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT;
+}
+
+static void scanFunction(Program *program, FunctionObj *function)
+{
+    Instruction *code = getDecodedCode(function);
+    for (int i = 0; i < function->decodedCount; i++)
+    {
+        OpCode opCode = code[i].opCode;
+        if (!hasCFor(opCode))
+        {
+            program->isSupported = false;
+        }
+        else if (isGlobal(opCode))
+        {
+            addGlobal(program, code[i].as.name);
+        }
+        else if (isConstant(opCode) && isFunctionObj(code[i].as.constant))
+        {
+            program->isValue[findFunction(program, unwrapFunctionObj(code[i].as.constant))] = true;
+        }
+        else if (opCode == OP_CALL || opCode == OP_TAIL_CALL)
+        {
+            program->needsCallValue = true;
+        }
+        else if (opCode == OP_PRINT)
+        {
+            program->needsPrint = true;
+        }
+    }
+}
+
+static int getArgumentCount(Instruction *instruction)
+{
+    OpCode opCode = instruction->opCode;
+    if (opCode == OP_CALL || opCode == OP_TAIL_CALL)
+    {
+        return instruction->as.argumentCount;
+    }
+    else if (isDirectCall(opCode) || isDirectTailCall(opCode))
+    {
+        return instruction->as.callee->arity;
+    }
+    return 0;
+}
+
+// Stack height before each instruction, counting the arguments. The compiler keeps every
+// statement's stack balanced, so walking straight through gives the same height at a
+// jump target as at the jumps to it.
+static int *computeHeights(FunctionObj *function, int *maxHeight)
+{
+    Instruction *code = function->decoded;
+    int *heights = malloc(sizeof(int) * function->decodedCount);
+    int height = function->arity;
+    *maxHeight = height;
+
+    for (int i = 0; i < function->decodedCount; i++)
+    {
+        heights[i] = height;
+        height += getStackEffectFor(code[i].opCode, getArgumentCount(&code[i]));
+        if (height > *maxHeight)
+        {
+            *maxHeight = height;
+        }
+    }
+    return heights;
+}
+
+static Instruction *getJumpTarget(Instruction *instruction)
+{
+    if (instruction->opCode == OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT)
+    {
+        return instruction->as.local.target;
+    }
+    return isJumpOpCode(instruction->opCode) ? instruction->as.target : NULL;
+}
+
+static void emitString(TextBuffer *source, const char *chars)
+{
+    appendText(source, "\"");
+    for (const unsigned char *c = (const unsigned char *)chars; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            appendText(source, "\\%c", *c);
+        }
+        else if (*c >= ' ' && *c <= '~')
+        {
+            appendText(source, "%c", *c);
+        }
+        else
+        {
+            appendText(source, "\\%03o", *c);
+        }
+    }
+    appendText(source, "\"");
+}
+
+static void emitValue(TextBuffer *source, Program *program, Value value)
+{
+    if (isNumber(value))
+    {
+        double number = unwrapNumber(value);
+        if (isnan(number))
+        {
+            appendText(source, "wrapNumber(NAN)");
+        }
+        else if (isinf(number))
+        {
+            appendText(source, "wrapNumber(%sINFINITY)", number < 0 ? "-" : "");
+        }
+        else
+        {
+            appendText(source, "wrapNumber(%.17g)", number);
+        }
+    }
+    else if (isBool(value))
+    {
+        appendText(source, "wrapBool(%s)", unwrapBool(value) ? "true" : "false");
+    }
+    else if (isStringObj(value))
+    {
+        appendText(source, "wrapString(");
+        emitString(source, ((StringObj *)unwrapObject(value))->chars);
+        appendText(source, ")");
+    }
+    else if (isFunctionObj(value))
+    {
+        appendText(source, "wrapObject((Obj *)&%s_value)", program->names[findFunction(program, unwrapFunctionObj(value))]);
+    }
+    else
+    {
+        appendText(source, "nil()");
+    }
+}
+
+static void emitArguments(TextBuffer *source, int first, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        appendText(source, i == 0 ? "s%d" : ", s%d", first + i);
+    }
+}
+
+static void emitDynamicCall(TextBuffer *source, int height, int argumentCount)
+{
+    int callee = height - argumentCount - 1;
+    appendText(source, "callValue(s%d, %d, ", callee, argumentCount);
+    if (argumentCount == 0)
+    {
+        appendText(source, "NULL)");
+    }
+    else
+    {
+        appendText(source, "(Value[]){");
+        emitArguments(source, callee + 1, argumentCount);
+        appendText(source, "})");
+    }
+}
+
+static void emitNumberOperator(TextBuffer *source, int height, const char *operator)
+{
+    appendText(source, "    s%d = wrapNumber(unwrapNumber(s%d) %s unwrapNumber(s%d));\n", height - 2, height - 2, operator, height - 1);
+}
+
+static void emitComparison(TextBuffer *source, int height, const char *operator)
+{
+    appendText(source, "    s%d = wrapBool(unwrapNumber(s%d) %s unwrapNumber(s%d));\n", height - 2, height - 2, operator, height - 1);
+}
+
+static void emitInstruction(TextBuffer *source, Program *program, FunctionObj *function, Instruction *instruction, int height)
+{
+    OpCode opCode = instruction->opCode;
+    int target = getJumpTarget(instruction) == NULL ? -1 : (int)(getJumpTarget(instruction) - function->decoded);
+
+    if (isConstant(opCode))
+    {
+        appendText(source, "    s%d = ", height);
+        emitValue(source, program, instruction->as.constant);
+        appendText(source, ";\n");
+    }
+    else if (opCode == OP_NEGATE)
+    {
+        appendText(source, "    s%d = negate(s%d);\n", height - 1, height - 1);
+    }
+    else if (opCode == OP_ADD)
+    {
+        appendText(source, "    s%d = add(s%d, s%d);\n", height - 2, height - 2, height - 1);
+    }
+    else if (opCode == OP_SUB)
+    {
+        emitNumberOperator(source, height, "-");
+    }
+    else if (opCode == OP_MULT)
+    {
+        emitNumberOperator(source, height, "*");
+    }
+    else if (opCode == OP_DIV)
+    {
+        emitNumberOperator(source, height, "/");
+    }
+    else if (opCode == OP_LESS_THAN)
+    {
+        emitComparison(source, height, "<");
+    }
+    else if (opCode == OP_LESS_THAN_EQUALS)
+    {
+        emitComparison(source, height, "<=");
+    }
+    else if (opCode == OP_EQUAL)
+    {
+        appendText(source, "    s%d = wrapBool(equals(s%d, s%d));\n", height - 2, height - 2, height - 1);
+    }
+    else if (opCode == OP_OR)
+    {
+        appendText(source, "    s%d = wrapBool(unwrapBool(s%d) || unwrapBool(s%d));\n", height - 2, height - 2, height - 1);
+    }
+    else if (opCode == OP_TRUE || opCode == OP_FALSE)
+    {
+        appendText(source, "    s%d = wrapBool(%s);\n", height, opCode == OP_TRUE ? "true" : "false");
+    }
+    else if (opCode == OP_STRING)
+    {
+        appendText(source, "    s%d = wrapString(", height);
+        emitString(source, instruction->as.chars);
+        appendText(source, ");\n");
+    }
+    else if (opCode == OP_PRINT)
+    {
+        appendText(source, "    printValue(s%d);\n", height - 1);
+    }
+    else if (opCode == OP_VAR_DECL)
+    {
+        appendText(source, "    s%d = nil();\n", height);
+    }
+    else if (opCode == OP_VAR_ASSIGN || opCode == OP_VAR_ASSIGN_LONG)
+    {
+        appendText(source, "    s%d = s%d;\n", instruction->as.slot, height - 1);
+    }
+    else if (opCode == OP_VAR_EXPRESSION || opCode == OP_VAR_EXPRESSION_LONG)
+    {
+        appendText(source, "    s%d = s%d;\n", height, instruction->as.slot);
+    }
+    else if (opCode == OP_VAR_GLOBAL_DECL || opCode == OP_VAR_GLOBAL_DECL_LONG)
+    {
+        appendText(source, "    hashMapPut(&globals, global%d, nil());\n", findGlobal(program, instruction->as.name));
+    }
+    else if (opCode == OP_VAR_GLOBAL_ASSIGN || opCode == OP_VAR_GLOBAL_ASSIGN_LONG)
+    {
+        appendText(source, "    hashMapPut(&globals, global%d, s%d);\n", findGlobal(program, instruction->as.name), height - 1);
+    }
+    else if (opCode == OP_VAR_GLOBAL_EXPRESSION || opCode == OP_VAR_GLOBAL_EXPRESSION_LONG)
+    {
+        appendText(source, "    s%d = hashMapGet(&globals, global%d);\n", height, findGlobal(program, instruction->as.name));
+    }
+    else if (opCode == OP_JUMP || opCode == OP_JUMP_LONG || opCode == OP_LOOP)
+    {
+        appendText(source, "    goto L%d;\n", target);
+    }
+    else if (opCode == OP_JUMP_IF_FALSE || opCode == OP_JUMP_IF_FALSE_LONG || opCode == OP_JUMP_IF_FALSE_PEEK || opCode == OP_JUMP_IF_FALSE_PEEK_LONG)
+    {
+        appendText(source, "    if (!unwrapBool(s%d)) goto L%d;\n", height - 1, target);
+    }
+    else if (opCode == OP_JUMP_IF_TRUE_PEEK || opCode == OP_JUMP_IF_TRUE_PEEK_LONG || opCode == OP_LOOP_IF_TRUE || opCode == OP_LOOP_IF_TRUE_LONG)
+    {
+        appendText(source, "    if (unwrapBool(s%d)) goto L%d;\n", height - 1, target);
+    }
+    else if (opCode == OP_CALL)
+    {
+        appendText(source, "    s%d = ", height - instruction->as.argumentCount - 1);
+        emitDynamicCall(source, height, instruction->as.argumentCount);
+        appendText(source, ";\n");
+    }
+    else if (opCode == OP_TAIL_CALL)
+    {
+        appendText(source, "    return ");
+        emitDynamicCall(source, height, instruction->as.argumentCount);
+        appendText(source, ";\n");
+    }
+    else if (isDirectCall(opCode))
+    {
+        FunctionObj *callee = instruction->as.callee;
+        appendText(source, "    s%d = %s(", height - callee->arity, program->names[findFunction(program, callee)]);
+        emitArguments(source, height - callee->arity, callee->arity);
+        appendText(source, ");\n");
+    }
+    else if (isDirectTailCall(opCode) && instruction->as.callee == function)
+    {
+        // The arguments sit above the parameters, so they can be copied down in order.
+        for (int i = 0; i < function->arity; i++)
+        {
+            appendText(source, "    s%d = s%d;\n", i, height - function->arity + i);
+        }
+        appendText(source, "    goto start;\n");
+    }
+    else if (isDirectTailCall(opCode))
+    {
+        FunctionObj *callee = instruction->as.callee;
+        appendText(source, "    return %s(", program->names[findFunction(program, callee)]);
+        emitArguments(source, height - callee->arity, callee->arity);
+        appendText(source, ");\n");
+    }
+    else if (opCode == OP_RETURN)
+    {
+        // Like the VM, only a value left right above the arguments is returned.
+        if (height == function->arity + 1)
+        {
+            appendText(source, "    return s%d;\n", function->arity);
+        }
+        else
+        {
+            appendText(source, "    return nil();\n");
+        }
+    }
+    else if (opCode == OP_LOCAL_ADD_CONSTANT || opCode == OP_LOCAL_INCREMENT)
+    {
+        int slot = instruction->as.local.slot;
+        appendText(source, "    s%d = add(s%d, ", opCode == OP_LOCAL_INCREMENT ? slot : height, slot);
+        emitValue(source, program, instruction->as.local.constant);
+        appendText(source, ");\n");
+    }
+    else if (opCode == OP_LOCAL_LESS_THAN_CONSTANT)
+    {
+        appendText(source, "    s%d = wrapBool(unwrapNumber(s%d) < unwrapNumber(", height, instruction->as.local.slot);
+        emitValue(source, program, instruction->as.local.constant);
+        appendText(source, "));\n");
+    }
+    else if (opCode == OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT)
+    {
+        appendText(source, "    if (unwrapNumber(s%d) < unwrapNumber(", instruction->as.local.slot);
+        emitValue(source, program, instruction->as.local.constant);
+        appendText(source, ")) goto L%d;\n", target);
+    }
+}
+
+static void emitSignature(TextBuffer *source, Program *program, int index)
+{
+    FunctionObj *function = program->functions[index];
+    appendText(source, "static Value %s(", program->names[index]);
+    if (function->arity == 0)
+    {
+        appendText(source, "void");
+    }
+    for (int i = 0; i < function->arity; i++)
+    {
+        appendText(source, i == 0 ? "Value s%d" : ", Value s%d", i);
+    }
+    appendText(source, ")");
+}
+
+static void emitFunction(TextBuffer *source, Program *program, int index)
+{
+    FunctionObj *function = program->functions[index];
+    Instruction *code = function->decoded;
+    int maxHeight;
+    int *heights = computeHeights(function, &maxHeight);
+
+    bool *isTarget = calloc(function->decodedCount, sizeof(bool));
+    bool hasSelfTailCall = false;
+    for (int i = 0; i < function->decodedCount; i++)
+    {
+        if (getJumpTarget(&code[i]) != NULL)
+        {
+            isTarget[getJumpTarget(&code[i]) - code] = true;
+        }
+        if (isDirectTailCall(code[i].opCode) && code[i].as.callee == function)
+        {
+            hasSelfTailCall = true;
+        }
+    }
+
+    emitSignature(source, program, index);
+    appendText(source, "\n{\n");
+    if (maxHeight > function->arity)
+    {
+        appendText(source, "    Value ");
+        for (int slot = function->arity; slot < maxHeight; slot++)
+        {
+            appendText(source, slot == function->arity ? "s%d" : ", s%d", slot);
+        }
+        appendText(source, ";\n");
+    }
+    if (hasSelfTailCall)
+    {
+        appendText(source, "start:;\n");
+    }
+
+    for (int i = 0; i < function->decodedCount; i++)
+    {
+        if (isTarget[i])
+        {
+            appendText(source, "L%d:;\n", i);
+        }
+        emitInstruction(source, program, function, &code[i], heights[i]);
+    }
+    appendText(source, "}\n\n");
+
+    free(isTarget);
+    free(heights);
+}
+
+// Functions used as values, rather than called by name, are objects that carry a
+// pointer to a wrapper taking the arguments as an array. Missing arguments are nil.
+static void emitFunctionValues(TextBuffer *source, Program *program)
+{
+    appendText(source, "typedef struct LoxFunction\n{\n    Obj base;\n    Value (*call)(int argumentCount, Value *arguments);\n} LoxFunction;\n\n");
+    for (int i = 0; i < program->functionCount; i++)
+    {
+        if (!program->isValue[i])
+        {
+            continue;
+        }
+        appendText(source, "static Value %s_call(int argumentCount, Value *arguments)\n{\n    return %s(", program->names[i], program->names[i]);
+        for (int argument = 0; argument < program->functions[i]->arity; argument++)
+        {
+            appendText(source, argument == 0 ? "" : ", ");
+            appendText(source, "argumentCount > %d ? arguments[%d] : nil()", argument, argument);
+        }
+        appendText(source, ");\n}\n\n");
+        appendText(source, "static LoxFunction %s_value = {{ObjFunction}, %s_call};\n\n", program->names[i], program->names[i]);
+    }
+
+    if (program->needsCallValue)
+    {
+        appendText(source, "static Value callValue(Value callee, int argumentCount, Value *arguments)\n{\n");
+        appendText(source, "    LoxFunction *function = (LoxFunction *)unwrapObject(callee);\n");
+        appendText(source, "    return function->call(argumentCount, arguments);\n}\n\n");
+    }
+}
+
+static void emitProgram(TextBuffer *source, Program *program)
+{
+    appendText(source, "// Generated by clox. Build with: cc -O2 -Iclox <this file> clox/*.c -lm\n");
+    appendText(source, "#include <stdio.h>\n#include <stdlib.h>\n#include \"value.h\"\n#include \"cloxstring.h\"\n#include \"hashmap.h\"\n\n");
+
+    if (program->globalCount > 0)
+    {
+        appendText(source, "static HashMap globals;\n");
+        for (int i = 0; i < program->globalCount; i++)
+        {
+            appendText(source, "static StringObj *global%d;\n", i);
+        }
+        appendText(source, "\n");
+    }
+
+    if (program->needsPrint)
+    {
+        appendText(source, "static void printValue(Value value)\n{\n    char *line = formatValue(value, NUMBER_FORMAT_SHORTEST);\n");
+        appendText(source, "    if (line != NULL)\n    {\n        puts(line);\n        free(line);\n    }\n}\n\n");
+    }
+
+    for (int i = 0; i < program->functionCount; i++)
+    {
+        emitSignature(source, program, i);
+        appendText(source, ";\n");
+    }
+    appendText(source, "\n");
+
+    if (program->needsCallValue)
+    {
+        emitFunctionValues(source, program);
+    }
+    else
+    {
+        for (int i = 0; i < program->functionCount; i++)
+        {
+            if (program->isValue[i])
+            {
+                emitFunctionValues(source, program);
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < program->functionCount; i++)
+    {
+        emitFunction(source, program, i);
+    }
+
+    appendText(source, "int main(void)\n{\n");
+    if (program->globalCount > 0)
+    {
+        appendText(source, "    initHashMap(&globals);\n");
+        for (int i = 0; i < program->globalCount; i++)
+        {
+            appendText(source, "    global%d = asString(", i);
+            emitString(source, program->globals[i]->chars);
+            appendText(source, ");\n");
+        }
+    }
+    appendText(source, "    lox_script();\n    return 0;\n}\n");
+}
+
+static void freeProgram(Program *program)
+{
+    for (int i = 0; i < program->functionCount; i++)
+    {
+        free(program->names[i]);
+    }
+    FREE_ARRAY(FunctionObj *, program->functions, program->functionCapacity);
+    FREE_ARRAY(char *, program->names, program->functionCapacity);
+    FREE_ARRAY(bool, program->isValue, program->functionCapacity);
+    FREE_ARRAY(StringObj *, program->globals, program->globalCapacity);
+}
+
+char *compileToC(FunctionObj *script)
+{
+    Program program;
+    memset(&program, 0, sizeof(Program));
+    program.isSupported = true;
+
+    collectFunctions(&program, script);
+    for (int i = 0; i < program.functionCount; i++)
+    {
+        scanFunction(&program, program.functions[i]);
+    }
+
+    TextBuffer source;
+    initTextBuffer(&source);
+    if (program.isSupported)
+    {
+        emitProgram(&source, &program);
+    }
+
+    freeProgram(&program);
+    return source.chars;
+}
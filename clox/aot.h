@@ -0,0 +1,17 @@
+#ifndef AOT_HEADER
+#define AOT_HEADER
+
+#include "functionobj.h"
+
+// Translates a compiled script, and every function it declares, into one C file. Each
+// function becomes a C function whose stack slots are locals, and the file calls into
+// value.c, cloxstring.c and hashmap.c for everything else. Building it with the rest of
+// clox gives a standalone program:
+//
+//     cc -O2 -Iclox program.c clox/*.c -lm
+//
+// Returns the source in a malloc'd string, or NULL if a function holds an instruction
+// there is no C for.
+char *compileToC(FunctionObj *script);
+
+#endif
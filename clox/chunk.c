@@ -10,11 +10,15 @@ void initChunk(Chunk *chunk)
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+    chunk->currentLine = 0;
 
     initValueArray(&chunk->constants);
 }
 
-void writeChunk(Chunk *chunk, uint8_t value)
+static void appendByte(Chunk *chunk, uint8_t value)
 {
     if (chunk->capacity < chunk->count + 1)
     {
@@ -26,6 +30,28 @@ void writeChunk(Chunk *chunk, uint8_t value)
     chunk->count++;
 }
 
+static void startLine(Chunk *chunk)
+{
+    if (chunk->lineCapacity < chunk->lineCount + 1)
+    {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+    chunk->lines[chunk->lineCount].offset = chunk->count;
+    chunk->lines[chunk->lineCount].line = chunk->currentLine;
+    chunk->lineCount++;
+}
+
+void writeChunk(Chunk *chunk, uint8_t value)
+{
+    if (chunk->currentLine != 0 && (chunk->lineCount == 0 || chunk->lines[chunk->lineCount - 1].line != chunk->currentLine))
+    {
+        startLine(chunk);
+    }
+    appendByte(chunk, value);
+}
+
 void writeShort(Chunk *chunk, uint16_t value)
 {
     uint8_t msb = value >> 8;
@@ -53,9 +79,79 @@ uint16_t readShort(Chunk *chunk, int index)
     return asShort;
 }
 
+void writeLong(Chunk *chunk, uint32_t value)
+{
+    writeChunk(chunk, value >> 16);
+    writeChunk(chunk, value >> 8);
+    writeChunk(chunk, value);
+}
+
+void overwriteLong(Chunk *chunk, int index, uint32_t value)
+{
+    chunk->code[index] = value >> 16;
+    chunk->code[index + 1] = value >> 8;
+    chunk->code[index + 2] = value;
+}
+
+uint32_t readLong(Chunk *chunk, int index)
+{
+    uint32_t high = chunk->code[index];
+    uint32_t middle = chunk->code[index + 1];
+    uint32_t low = chunk->code[index + 2];
+
+    return (high << 16) | (middle << 8) | low;
+}
+
+// Shifts everything from index onwards right by length bytes, leaving the gap
+// for the caller to fill in. The gap takes the line of the byte before it.
+void insertChunkGap(Chunk *chunk, int index, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        appendByte(chunk, 0);
+    }
+    memmove(&chunk->code[index + length], &chunk->code[index], chunk->count - length - index);
+
+    for (int i = chunk->lineCount - 1; i >= 0 && chunk->lines[i].offset >= index; i--)
+    {
+        chunk->lines[i].offset += length;
+    }
+}
+
+void setChunkLine(Chunk *chunk, int line)
+{
+    chunk->currentLine = line;
+}
+
+int getLineAt(Chunk *chunk, int offset)
+{
+    if (chunk->lineCount == 0)
+    {
+        return 0;
+    }
+
+    // Finds the last line that starts at or before offset.
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high)
+    {
+        int middle = low + (high - low + 1) / 2;
+        if (chunk->lines[middle].offset <= offset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return chunk->lines[low].line;
+}
+
 void freeChunk(Chunk *chunk)
 {
     FREE_ARRAY(uint8_t, chunk->code, chunk->count);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     initChunk(chunk);
 }
 
@@ -70,21 +166,148 @@ Value getConstantAt(Chunk *chunk, int index)
     return getValueAt(&chunk->constants, index);
 }
 
+static const char *opCodeNames[] = {
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_ADD] = "OP_ADD",
+    [OP_MULT] = "OP_MULT",
+    [OP_DIV] = "OP_DIV",
+    [OP_SUB] = "OP_SUB",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_STRING] = "OP_STRING",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_VAR_DECL] = "OP_VAR_DECL",
+    [OP_VAR_ASSIGN] = "OP_VAR_ASSIGN",
+    [OP_VAR_EXPRESSION] = "OP_VAR_EXPRESSION",
+    [OP_STACK_PEEK] = "OP_STACK_PEEK",
+    [OP_POP] = "OP_POP",
+    [OP_VAR_GLOBAL_DECL] = "OP_VAR_GLOBAL_DECL",
+    [OP_VAR_GLOBAL_ASSIGN] = "OP_VAR_GLOBAL_ASSIGN",
+    [OP_VAR_GLOBAL_EXPRESSION] = "OP_VAR_GLOBAL_EXPRESSION",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_LESS_THAN] = "OP_LESS_THAN",
+    [OP_LESS_THAN_EQUALS] = "OP_LESS_THAN_EQUALS",
+    [OP_CALL] = "OP_CALL",
+    [OP_OR] = "OP_OR",
+    [OP_JUMP_IF_FALSE_PEEK] = "OP_JUMP_IF_FALSE_PEEK",
+    [OP_JUMP_IF_TRUE_PEEK] = "OP_JUMP_IF_TRUE_PEEK",
+    [OP_LOOP_IF_TRUE] = "OP_LOOP_IF_TRUE",
+    [OP_CALL_DIRECT] = "OP_CALL_DIRECT",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_TAIL_CALL_DIRECT] = "OP_TAIL_CALL_DIRECT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_VAR_ASSIGN_LONG] = "OP_VAR_ASSIGN_LONG",
+    [OP_VAR_EXPRESSION_LONG] = "OP_VAR_EXPRESSION_LONG",
+    [OP_VAR_GLOBAL_DECL_LONG] = "OP_VAR_GLOBAL_DECL_LONG",
+    [OP_VAR_GLOBAL_ASSIGN_LONG] = "OP_VAR_GLOBAL_ASSIGN_LONG",
+    [OP_VAR_GLOBAL_EXPRESSION_LONG] = "OP_VAR_GLOBAL_EXPRESSION_LONG",
+    [OP_JUMP_LONG] = "OP_JUMP_LONG",
+    [OP_JUMP_IF_FALSE_LONG] = "OP_JUMP_IF_FALSE_LONG",
+    [OP_JUMP_IF_FALSE_PEEK_LONG] = "OP_JUMP_IF_FALSE_PEEK_LONG",
+    [OP_JUMP_IF_TRUE_PEEK_LONG] = "OP_JUMP_IF_TRUE_PEEK_LONG",
+    [OP_LOOP_IF_TRUE_LONG] = "OP_LOOP_IF_TRUE_LONG",
+    [OP_CALL_DIRECT_LONG] = "OP_CALL_DIRECT_LONG",
+    [OP_TAIL_CALL_DIRECT_LONG] = "OP_TAIL_CALL_DIRECT_LONG",
+    [OP_LOCAL_ADD_CONSTANT] = "OP_LOCAL_ADD_CONSTANT",
+    [OP_LOCAL_INCREMENT] = "OP_LOCAL_INCREMENT",
+    [OP_LOCAL_LESS_THAN_CONSTANT] = "OP_LOCAL_LESS_THAN_CONSTANT",
+    [OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT] = "OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT",
+    [OP_GUARD_BRANCH] = "OP_GUARD_BRANCH",
+    [OP_GUARD_NUMBER_ADD] = "OP_GUARD_NUMBER_ADD",
+    [OP_GUARD_NUMBER_LOCAL_ADD_CONSTANT] = "OP_GUARD_NUMBER_LOCAL_ADD_CONSTANT",
+    [OP_GUARD_NUMBER_LOCAL_INCREMENT] = "OP_GUARD_NUMBER_LOCAL_INCREMENT",
+    [OP_TRACE_LOOP] = "OP_TRACE_LOOP",
+};
+
+const char *getOpCodeName(OpCode opCode)
+{
+    return opCode < OP_CODE_COUNT ? opCodeNames[opCode] : "BAD_OP_CODE";
+}
+
 uint8_t getByteLengthFor(OpCode opCode)
 {
     uint8_t byteLength = 0;
-    if (opCode == OP_MULT || opCode == OP_ADD || opCode == OP_DIV || opCode == OP_SUB || opCode == OP_TRUE || opCode == OP_FALSE || opCode == OP_EQUAL || opCode == OP_NEGATE || opCode == OP_VAR_DECL || opCode == OP_LESS_THAN)
+    if (opCode == OP_RETURN || opCode == OP_MULT || opCode == OP_ADD || opCode == OP_DIV || opCode == OP_SUB || opCode == OP_TRUE || opCode == OP_FALSE || opCode == OP_EQUAL || opCode == OP_NEGATE || opCode == OP_VAR_DECL || opCode == OP_LESS_THAN || opCode == OP_LESS_THAN_EQUALS || opCode == OP_PRINT || opCode == OP_POP || opCode == OP_OR || opCode == OP_STACK_PEEK)
     {
         byteLength = 1;
     }
-    else if (opCode == OP_CONSTANT)
+    else if (opCode == OP_CONSTANT || opCode == OP_VAR_ASSIGN || opCode == OP_VAR_EXPRESSION || opCode == OP_VAR_GLOBAL_DECL || opCode == OP_VAR_GLOBAL_ASSIGN || opCode == OP_VAR_GLOBAL_EXPRESSION || opCode == OP_LOOP || opCode == OP_CALL || opCode == OP_CALL_DIRECT || opCode == OP_TAIL_CALL || opCode == OP_TAIL_CALL_DIRECT)
     {
         byteLength = 2;
     }
+    else if (opCode == OP_VAR_ASSIGN_LONG || opCode == OP_VAR_EXPRESSION_LONG || opCode == OP_JUMP || opCode == OP_JUMP_IF_FALSE || opCode == OP_JUMP_IF_FALSE_PEEK || opCode == OP_JUMP_IF_TRUE_PEEK || opCode == OP_LOOP_IF_TRUE)
+    {
+        byteLength = 3;
+    }
+    else if (opCode == OP_CONSTANT_LONG || opCode == OP_VAR_GLOBAL_DECL_LONG || opCode == OP_VAR_GLOBAL_ASSIGN_LONG || opCode == OP_VAR_GLOBAL_EXPRESSION_LONG || opCode == OP_JUMP_LONG || opCode == OP_JUMP_IF_FALSE_LONG || opCode == OP_JUMP_IF_FALSE_PEEK_LONG || opCode == OP_JUMP_IF_TRUE_PEEK_LONG || opCode == OP_LOOP_IF_TRUE_LONG || opCode == OP_CALL_DIRECT_LONG || opCode == OP_TAIL_CALL_DIRECT_LONG)
+    {
+        byteLength = 4;
+    }
 
     return byteLength;
 }
 
+// How many values an instruction leaves on the stack compared with before it ran.
+// argumentCount only matters for calls, where the callee's arity stands in for it on
+// direct calls. A call's arguments, and the callee if it was pushed, become the result.
+int getStackEffectFor(OpCode opCode, int argumentCount)
+{
+    if (opCode == OP_CONSTANT || opCode == OP_CONSTANT_LONG || opCode == OP_TRUE || opCode == OP_FALSE || opCode == OP_STRING || opCode == OP_VAR_DECL || opCode == OP_VAR_EXPRESSION || opCode == OP_VAR_EXPRESSION_LONG || opCode == OP_VAR_GLOBAL_EXPRESSION || opCode == OP_VAR_GLOBAL_EXPRESSION_LONG || opCode == OP_LOCAL_ADD_CONSTANT || opCode == OP_LOCAL_LESS_THAN_CONSTANT)
+    {
+        return 1;
+    }
+    else if (opCode == OP_RETURN || opCode == OP_ADD || opCode == OP_MULT || opCode == OP_DIV || opCode == OP_SUB || opCode == OP_EQUAL || opCode == OP_LESS_THAN || opCode == OP_LESS_THAN_EQUALS || opCode == OP_OR || opCode == OP_PRINT || opCode == OP_POP || opCode == OP_VAR_ASSIGN || opCode == OP_VAR_ASSIGN_LONG || opCode == OP_VAR_GLOBAL_ASSIGN || opCode == OP_VAR_GLOBAL_ASSIGN_LONG || opCode == OP_JUMP_IF_FALSE || opCode == OP_JUMP_IF_FALSE_LONG || opCode == OP_LOOP_IF_TRUE || opCode == OP_LOOP_IF_TRUE_LONG)
+    {
+        return -1;
+    }
+    else if (opCode == OP_CALL || opCode == OP_TAIL_CALL)
+    {
+        return -argumentCount;
+    }
+    else if (opCode == OP_CALL_DIRECT || opCode == OP_CALL_DIRECT_LONG || opCode == OP_TAIL_CALL_DIRECT || opCode == OP_TAIL_CALL_DIRECT_LONG)
+    {
+        return 1 - argumentCount;
+    }
+    return 0;
+}
+
+// OP_STRING carries its characters inline, so it is the one instruction whose
+// length depends on the chunk rather than just the op code.
+int getInstructionLength(Chunk *chunk, int index)
+{
+    OpCode opCode = chunk->code[index];
+    if (opCode == OP_STRING)
+    {
+        return strlen((char *)&chunk->code[index + 1]) + 2;
+    }
+    return getByteLengthFor(opCode);
+}
+
+int getInstructionOffset(Chunk *chunk, int instructionIndex)
+{
+    int offset = 0;
+    for (int i = 0; i < instructionIndex && offset < chunk->count; i++)
+    {
+        offset += getInstructionLength(chunk, offset);
+    }
+    return offset < chunk->count ? offset : -1;
+}
+
+bool isJumpOpCode(OpCode opCode)
+{
+    return opCode == OP_JUMP || opCode == OP_JUMP_LONG || opCode == OP_LOOP || opCode == OP_LOOP_IF_TRUE || opCode == OP_LOOP_IF_TRUE_LONG || opCode == OP_JUMP_IF_FALSE || opCode == OP_JUMP_IF_FALSE_LONG || opCode == OP_JUMP_IF_FALSE_PEEK || opCode == OP_JUMP_IF_FALSE_PEEK_LONG || opCode == OP_JUMP_IF_TRUE_PEEK || opCode == OP_JUMP_IF_TRUE_PEEK_LONG;
+}
+
+bool isCallOpCode(OpCode opCode)
+{
+    return opCode == OP_CALL || opCode == OP_CALL_DIRECT || opCode == OP_CALL_DIRECT_LONG || opCode == OP_TAIL_CALL || opCode == OP_TAIL_CALL_DIRECT || opCode == OP_TAIL_CALL_DIRECT_LONG;
+}
+
 void writeString(Chunk *chunk, const char *chars)
 {
     int length = strlen(chars);
@@ -30,16 +30,68 @@ typedef enum {
     OP_LESS_THAN,
     OP_LESS_THAN_EQUALS,
     OP_CALL,
-    OP_OR
+    OP_OR,
+    OP_JUMP_IF_FALSE_PEEK,
+    OP_JUMP_IF_TRUE_PEEK,
+    OP_LOOP_IF_TRUE,
+    OP_CALL_DIRECT,
+    OP_TAIL_CALL,
+    OP_TAIL_CALL_DIRECT,
+    // Wide variants, emitted only when an operand does not fit the short form.
+    // Constant indexes and jump offsets are 24 bits, local slots are 16 bits.
+    OP_CONSTANT_LONG,
+    OP_VAR_ASSIGN_LONG,
+    OP_VAR_EXPRESSION_LONG,
+    OP_VAR_GLOBAL_DECL_LONG,
+    OP_VAR_GLOBAL_ASSIGN_LONG,
+    OP_VAR_GLOBAL_EXPRESSION_LONG,
+    OP_JUMP_LONG,
+    OP_JUMP_IF_FALSE_LONG,
+    OP_JUMP_IF_FALSE_PEEK_LONG,
+    OP_JUMP_IF_TRUE_PEEK_LONG,
+    OP_LOOP_IF_TRUE_LONG,
+    OP_CALL_DIRECT_LONG,
+    OP_TAIL_CALL_DIRECT_LONG,
+    // Superinstructions. The optimizer builds these out of decoded instructions, so they
+    // never appear in a Chunk.
+    OP_LOCAL_ADD_CONSTANT,
+    OP_LOCAL_INCREMENT,
+    OP_LOCAL_LESS_THAN_CONSTANT,
+    OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT,
+    // Trace instructions, only built by the VM when it records a hot loop. A guard leaves
+    // the trace for the instruction it was recorded from when its assumption fails.
+    OP_GUARD_BRANCH,
+    OP_GUARD_NUMBER_ADD,
+    OP_GUARD_NUMBER_LOCAL_ADD_CONSTANT,
+    OP_GUARD_NUMBER_LOCAL_INCREMENT,
+    OP_TRACE_LOOP
 } OpCode;
 
+#define OP_CODE_COUNT (OP_TRACE_LOOP + 1)
+
+#define UINT24_MAX 0xFFFFFF
+
 uint8_t getByteLengthFor(OpCode opCode);
+int getStackEffectFor(OpCode opCode, int argumentCount);
+const char *getOpCodeName(OpCode opCode);
+
+// The source line of every byte from offset up to the next LineStart's offset.
+typedef struct LineStart {
+    int offset;
+    int line;
+} LineStart;
 
 typedef struct Chunk {
     uint8_t* code;  
     int count;
     int capacity;
     ValueArray constants;
+    // Only a line change gets a new entry, so a line's worth of bytecode costs one.
+    LineStart* lines;
+    int lineCount;
+    int lineCapacity;
+    // The line bytes are written for, set by the compiler as it moves through the source.
+    int currentLine;
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -47,11 +99,23 @@ void writeChunk(Chunk* chunk, uint8_t value);
 void writeShort(Chunk* chunk, uint16_t value);
 void overwriteShort(Chunk *chunk, int index, uint16_t value);
 uint16_t readShort(Chunk *chunk, int index);
+void writeLong(Chunk* chunk, uint32_t value);
+void overwriteLong(Chunk *chunk, int index, uint32_t value);
+uint32_t readLong(Chunk *chunk, int index);
+void insertChunkGap(Chunk *chunk, int index, int length);
+void setChunkLine(Chunk *chunk, int line);
+// The source line the byte at offset was written for, or 0 when no line was set.
+int getLineAt(Chunk *chunk, int offset);
 void freeChunk(Chunk* chunk);
 
 int addConstant(Chunk* chunk, Value constant);
 Value getConstantAt(Chunk* chunk, int index);
 
 void writeString(Chunk* chunk, const char* string);
+int getInstructionLength(Chunk* chunk, int index);
+// Where the instructionIndex'th instruction starts, or -1 past the end of the chunk.
+int getInstructionOffset(Chunk* chunk, int instructionIndex);
+bool isJumpOpCode(OpCode opCode);
+bool isCallOpCode(OpCode opCode);
 
 #endif
\ No newline at end of file
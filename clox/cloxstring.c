@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include "value.h"
 #include <stdbool.h>
+#include "stats.h"
+#include "probes.h"
 
 StringObj* asString(const char *characters)
 {
@@ -19,6 +21,8 @@ StringObj* asString(const char *characters)
     casted->type = ObjString;
     stringObj->length = length;
     stringObj->chars = inHeap;
+    COUNT_OBJECT_ALLOCATION(ObjString, sizeof(StringObj) + length + 1);
+    PROBE_OBJECT_ALLOC(ObjString, sizeof(StringObj) + length + 1);
     return stringObj;
 }
 
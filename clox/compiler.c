@@ -8,6 +8,8 @@
 #include "functionobj.h"
 #include <stdio.h>
 #include "disassembler.h"
+#include "memory.h"
+#include "probes.h"
 
 typedef struct VariableBindingStackLocation
 {
@@ -19,8 +21,9 @@ typedef struct FunctionCompiler
     FunctionObj *compiling;
     HashMap functions;
     int stackDepth;
+    int stackCapacity;
     int blockDepth;
-    VariableBindingStackLocation stack[5];
+    VariableBindingStackLocation *stack;
 } FunctionCompiler;
 
 typedef struct Parser
@@ -28,6 +31,8 @@ typedef struct Parser
     TokenArrayIterator *tokens;
     FunctionCompiler compilers[256];
     int depth;
+    // Where the most recently written call instruction starts, used to spot tail calls.
+    int lastCallLocation;
 } Parser;
 
 typedef void (*ParseFn)(Parser *);
@@ -51,6 +56,12 @@ static Chunk *getCurrentCompilerBytecode(Parser *parser)
     return getCurrentCompiler(parser)->compiling->bytecode;
 }
 
+// Bytecode written from here on is for the token's line.
+static void markLine(Parser *parser, Token token)
+{
+    setChunkLine(getCurrentCompilerBytecode(parser), token.location.line);
+}
+
 static HashMap *getCurrentCompilerFunctions(Parser *parser)
 {
     return &getCurrentCompiler(parser)->functions;
@@ -63,12 +74,19 @@ static void advanceCompilerFunction(Parser *parser, FunctionObj *function)
     current->compiling = function;
     current->blockDepth = 0;
     current->stackDepth = 0;
+    current->stackCapacity = 0;
+    current->stack = NULL;
+    initHashMap(&current->functions);
 }
 
 static void undoCompilerFunction(Parser *parser)
 {
     FunctionCompiler *current = getCurrentCompiler(parser);
     current->compiling = NULL;
+    FREE_ARRAY(VariableBindingStackLocation, current->stack, current->stackCapacity);
+    current->stack = NULL;
+    current->stackCapacity = 0;
+    freeHashMap(&current->functions);
     parser->depth--;
 }
 
@@ -80,13 +98,15 @@ static void unary(Parser *);
 static void literal(Parser *);
 static void identifier(Parser *parser);
 static void callable(Parser *parser);
+static void andOperator(Parser *parser);
+static void orOperator(Parser *parser);
 static void ifStatement(Parser *);
 static void expression(Parser *);
 static void parseExpression(Precedence, Parser *);
 static bool isAtEndOfStatement(Parser *);
 static bool isAtEndOfConditional(Parser *parser);
 static bool isGlobalBinding(Parser *, Token);
-static uint8_t getVariableBinding(Parser *, Token);
+static int getVariableBinding(Parser *, Token);
 static int getVariableBindingAsInt(Parser *parser, Token token);
 static void statement(Parser *);
 
@@ -97,7 +117,8 @@ ParseRule rules[] = {
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
     [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_OR] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_OR] = {NULL, orOperator, PREC_OR},
+    [TOKEN_AND] = {NULL, andOperator, PREC_AND},
     [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
     [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
@@ -111,16 +132,106 @@ static ParseRule *getRule(TokenType tokenType)
     return &rules[tokenType];
 }
 
+static void writeConstantInstruction(Parser *parser, OpCode shortOpCode, OpCode longOpCode, int constantIndex)
+{
+    Chunk *bytecode = getCurrentCompilerBytecode(parser);
+    if (constantIndex <= UINT8_MAX)
+    {
+        writeChunk(bytecode, shortOpCode);
+        writeChunk(bytecode, constantIndex);
+    }
+    else
+    {
+        writeChunk(bytecode, longOpCode);
+        writeLong(bytecode, constantIndex);
+    }
+}
+
+static void writeLocalInstruction(Parser *parser, OpCode shortOpCode, OpCode longOpCode, int stackLocation)
+{
+    Chunk *bytecode = getCurrentCompilerBytecode(parser);
+    if (stackLocation <= UINT8_MAX)
+    {
+        writeChunk(bytecode, shortOpCode);
+        writeChunk(bytecode, stackLocation);
+    }
+    else
+    {
+        writeChunk(bytecode, longOpCode);
+        writeShort(bytecode, stackLocation);
+    }
+}
+
+// Forward jumps always start out in their short form, the distance is not known
+// until the jump is patched.
+static int writeEmptyJump(Parser *parser, OpCode opCode)
+{
+    writeChunk(getCurrentCompilerBytecode(parser), opCode);
+    int jumpLocation = getCurrentCompilerBytecode(parser)->count;
+    writeShort(getCurrentCompilerBytecode(parser), UINT16_MAX);
+    return jumpLocation;
+}
+
+static OpCode getLongJumpFor(OpCode opCode)
+{
+    if (opCode == OP_JUMP_IF_FALSE)
+    {
+        return OP_JUMP_IF_FALSE_LONG;
+    }
+    else if (opCode == OP_JUMP_IF_FALSE_PEEK)
+    {
+        return OP_JUMP_IF_FALSE_PEEK_LONG;
+    }
+    else if (opCode == OP_JUMP_IF_TRUE_PEEK)
+    {
+        return OP_JUMP_IF_TRUE_PEEK_LONG;
+    }
+    return OP_JUMP_LONG;
+}
+
+// Points the jump written at jumpLocation to the end of the bytecode. If the distance
+// does not fit in the short form, the jump is widened in place, which shifts everything
+// emitted after it. Returns the number of bytes that code was shifted by.
+static int patchJump(Parser *parser, int jumpLocation)
+{
+    Chunk *bytecode = getCurrentCompilerBytecode(parser);
+    int distance = bytecode->count - (jumpLocation + 2);
+    if (distance <= UINT16_MAX)
+    {
+        overwriteShort(bytecode, jumpLocation, distance);
+        return 0;
+    }
+
+    insertChunkGap(bytecode, jumpLocation, 1);
+    bytecode->code[jumpLocation - 1] = getLongJumpFor(bytecode->code[jumpLocation - 1]);
+    overwriteLong(bytecode, jumpLocation, distance);
+    return 1;
+}
+
+static void writeLoopIfTrue(Parser *parser, int startOfBody)
+{
+    Chunk *bytecode = getCurrentCompilerBytecode(parser);
+    int distance = bytecode->count + 3 - startOfBody;
+    if (distance <= UINT16_MAX)
+    {
+        writeChunk(bytecode, OP_LOOP_IF_TRUE);
+        writeShort(bytecode, distance);
+    }
+    else
+    {
+        writeChunk(bytecode, OP_LOOP_IF_TRUE_LONG);
+        writeLong(bytecode, distance + 1);
+    }
+}
+
 static void number(Parser *parser)
 {
     Token shouldBeNumber = popToken(parser->tokens);
 
-    double number = strtod(shouldBeNumber.lexeme, NULL);
-    Value value = wrapNumber(number);
+    Value value = wrapNumber(shouldBeNumber.number);
 
     int valueConstantIndex = addConstant(getCurrentCompilerBytecode(parser), value);
-    writeChunk(getCurrentCompilerBytecode(parser), OP_CONSTANT);
-    writeChunk(getCurrentCompilerBytecode(parser), valueConstantIndex);
+    writeConstantInstruction(parser, OP_CONSTANT, OP_CONSTANT_LONG, valueConstantIndex);
 }
 
 static void literal(Parser *parser)
@@ -195,7 +306,7 @@ static bool isLocallyDefinedFunction(Parser *parser, const char *functionName)
     return !isNil(functionIfExists);
 }
 
-static uint8_t getLocalFunctionConstantLocation(Parser *parser, const char *functionName)
+static int getLocalFunctionConstantLocation(Parser *parser, const char *functionName)
 {
     FunctionCompiler *compiler = getCurrentCompiler(parser);
 
@@ -205,12 +316,8 @@ static uint8_t getLocalFunctionConstantLocation(Parser *parser, const char *func
     return unwrapNumber(functionIfExists);
 }
 
-static void callable(Parser *parser)
+static uint8_t compileArguments(Parser *parser)
 {
-    popToken(parser->tokens);
-    // ParseRule *parseRule = getRule(operator.type);
-
-    // parseExpression(parseRule->Precedence + 1, parser);
     uint8_t functionArgumentCount = 0;
 
     if (peekAtToken(parser->tokens).type != TOKEN_RIGHT_PAREN)
@@ -225,11 +332,73 @@ static void callable(Parser *parser)
     {
         popToken(parser->tokens);
     }
+    return functionArgumentCount;
+}
 
+static void callable(Parser *parser)
+{
+    popToken(parser->tokens);
+    // ParseRule *parseRule = getRule(operator.type);
+
+    // parseExpression(parseRule->Precedence + 1, parser);
+    uint8_t functionArgumentCount = compileArguments(parser);
+
+    parser->lastCallLocation = getCurrentCompilerBytecode(parser)->count;
     writeChunk(getCurrentCompilerBytecode(parser), OP_CALL);
     writeChunk(getCurrentCompilerBytecode(parser), functionArgumentCount);
 }
 
+static int getFunctionConstantLocation(Parser *parser, const char *functionName)
+{
+    if (isLocallyDefinedFunction(parser, functionName))
+    {
+        return getLocalFunctionConstantLocation(parser, functionName);
+    }
+
+    FunctionCompiler *currentCompiler = getCurrentCompiler(parser);
+    FunctionObj *functionObj = getFunctionObj(parser, functionName);
+    int constantIndex = addConstant(currentCompiler->compiling->bytecode, wrapObject((Obj *)functionObj));
+    hashMapPut(&currentCompiler->functions, functionObj->name, wrapNumber(constantIndex));
+    return constantIndex;
+}
+
+// The callee is known at compile time, so it is called straight out of the constant
+// table rather than being pushed onto the stack first.
+static void directCall(Parser *parser, int functionConstantIndex)
+{
+    Chunk *bytecode = getCurrentCompilerBytecode(parser);
+    FunctionObj *callee = (FunctionObj *)unwrapObject(getConstantAt(bytecode, functionConstantIndex));
+
+    popToken(parser->tokens);
+    int startOfArguments = bytecode->count;
+    uint8_t functionArgumentCount = compileArguments(parser);
+
+    if (functionArgumentCount == callee->arity)
+    {
+        parser->lastCallLocation = bytecode->count;
+        writeConstantInstruction(parser, OP_CALL_DIRECT, OP_CALL_DIRECT_LONG, functionConstantIndex);
+        return;
+    }
+
+    // Fall back to a regular call, which needs the callee sitting underneath its arguments.
+    // The VM checks the argument count when it runs and reports the mismatch then.
+    int calleeLength = functionConstantIndex <= UINT8_MAX ? 2 : 4;
+    insertChunkGap(bytecode, startOfArguments, calleeLength);
+    bytecode->code[startOfArguments] = calleeLength == 2 ? OP_CONSTANT : OP_CONSTANT_LONG;
+    if (calleeLength == 2)
+    {
+        bytecode->code[startOfArguments + 1] = functionConstantIndex;
+    }
+    else
+    {
+        overwriteLong(bytecode, startOfArguments + 1, functionConstantIndex);
+    }
+
+    parser->lastCallLocation = bytecode->count;
+    writeChunk(bytecode, OP_CALL);
+    writeChunk(bytecode, functionArgumentCount);
+}
+
 static void identifier(Parser *parser)
 {
     Token shouldBeId = popToken(parser->tokens);
@@ -238,35 +407,25 @@ static void identifier(Parser *parser)
     {
         if (isFunction(parser, shouldBeId.lexeme))
         {
-            if (isLocallyDefinedFunction(parser, shouldBeId.lexeme))
+            int constantLocation = getFunctionConstantLocation(parser, shouldBeId.lexeme);
+            if (peekAtToken(parser->tokens).type == TOKEN_LEFT_PAREN)
             {
-                int constantLocation = getLocalFunctionConstantLocation(parser, shouldBeId.lexeme);
-                writeChunk(getCurrentCompilerBytecode(parser), OP_CONSTANT);
-                writeChunk(getCurrentCompilerBytecode(parser), constantLocation);
+                directCall(parser, constantLocation);
             }
             else
             {
-                FunctionCompiler *currentCompiler = getCurrentCompiler(parser);
-                FunctionObj *functionObj = getFunctionObj(parser, shouldBeId.lexeme);
-                int constantIndex = addConstant(currentCompiler->compiling->bytecode, wrapObject((Obj *)functionObj));
-                hashMapPut(&currentCompiler->functions, functionObj->name, wrapNumber(constantIndex));
-
-                writeChunk(currentCompiler->compiling->bytecode, OP_CONSTANT);
-                writeChunk(currentCompiler->compiling->bytecode, constantIndex);
+                writeConstantInstruction(parser, OP_CONSTANT, OP_CONSTANT_LONG, constantLocation);
             }
         }
         else if (isGlobalBinding(parser, shouldBeId))
         {
             int constantLocation = addConstant(getCurrentCompilerBytecode(parser), wrapString(shouldBeId.lexeme));
-            writeChunk(getCurrentCompilerBytecode(parser), OP_VAR_GLOBAL_EXPRESSION);
-            writeChunk(getCurrentCompilerBytecode(parser), constantLocation);
+            writeConstantInstruction(parser, OP_VAR_GLOBAL_EXPRESSION, OP_VAR_GLOBAL_EXPRESSION_LONG, constantLocation);
         }
         else
         {
-            uint8_t stackLocation = getVariableBinding(parser, shouldBeId);
-
-            writeChunk(getCurrentCompilerBytecode(parser), OP_VAR_EXPRESSION);
-            writeChunk(getCurrentCompilerBytecode(parser), stackLocation);
+            int stackLocation = getVariableBinding(parser, shouldBeId);
+            writeLocalInstruction(parser, OP_VAR_EXPRESSION, OP_VAR_EXPRESSION_LONG, stackLocation);
         }
     }
 }
@@ -277,6 +436,7 @@ static void binary(Parser *parser)
     ParseRule *parseRule = getRule(operator.type);
 
     parseExpression(parseRule->Precedence + 1, parser);
+    markLine(parser, operator);
 
     if (operator.type == TOKEN_PLUS)
     {
@@ -298,10 +458,6 @@ static void binary(Parser *parser)
     {
         writeChunk(getCurrentCompilerBytecode(parser), OP_LESS_THAN);
     }
-    else if (operator.type == TOKEN_OR)
-    {
-        writeChunk(getCurrentCompilerBytecode(parser), OP_OR);
-    }
     else if (operator.type == TOKEN_LESS_EQUAL)
     {
         writeChunk(getCurrentCompilerBytecode(parser), OP_LESS_THAN_EQUALS);
@@ -313,38 +469,109 @@ static void binary(Parser *parser)
     }
 }
 
+// The left operand is left on the stack when it decides the result, otherwise
+// it is popped and the right operand is evaluated in its place.
+static void shortCircuit(Parser *parser, OpCode jumpOpCode)
+{
+    Token operator= popToken(parser->tokens);
+    ParseRule *parseRule = getRule(operator.type);
+
+    int jumpLocation = writeEmptyJump(parser, jumpOpCode);
+
+    writeChunk(getCurrentCompilerBytecode(parser), OP_POP);
+    parseExpression(parseRule->Precedence + 1, parser);
+
+    patchJump(parser, jumpLocation);
+}
+
+static void andOperator(Parser *parser)
+{
+    shortCircuit(parser, OP_JUMP_IF_FALSE_PEEK);
+}
+
+static void orOperator(Parser *parser)
+{
+    shortCircuit(parser, OP_JUMP_IF_TRUE_PEEK);
+}
+
 static void unary(Parser *parser)
 {
     Token operator= popToken(parser->tokens);
     ParseRule *parseRule = getRule(operator.type);
 
     parseExpression(parseRule->Precedence + 1, parser);
+    markLine(parser, operator);
 
     writeChunk(getCurrentCompilerBytecode(parser), OP_NEGATE);
 }
 
+static FunctionObj *getDirectCallee(Chunk *bytecode, int index)
+{
+    OpCode opCode = bytecode->code[index];
+    int constantIndex = bytecode->code[index + 1];
+    if (opCode == OP_CALL_DIRECT_LONG || opCode == OP_TAIL_CALL_DIRECT_LONG)
+    {
+        constantIndex = readLong(bytecode, index + 1);
+    }
+    return unwrapFunctionObj(getConstantAt(bytecode, constantIndex));
+}
+
+static int getArgumentCount(Chunk *bytecode, int index)
+{
+    OpCode opCode = bytecode->code[index];
+    if (opCode == OP_CALL || opCode == OP_TAIL_CALL)
+    {
+        return bytecode->code[index + 1];
+    }
+    else if (opCode == OP_CALL_DIRECT || opCode == OP_CALL_DIRECT_LONG || opCode == OP_TAIL_CALL_DIRECT || opCode == OP_TAIL_CALL_DIRECT_LONG)
+    {
+        return getDirectCallee(bytecode, index)->arity;
+    }
+    return 0;
+}
+
+// Every statement the compiler emits leaves the stack as it found it, so walking the
+// bytecode straight through sees the same depth at a jump target as the jump does.
+// A value left behind by an expression without a semicolon stays counted. Only the
+// closing OP_RETURN can pop a value that is not there, and nothing comes after it.
+static void computeMaxStackDepth(FunctionObj *functionObj)
+{
+    Chunk *bytecode = functionObj->bytecode;
+    int depth = 0;
+    int maxDepth = 0;
+
+    int index = 0;
+    while (index < bytecode->count)
+    {
+        depth = depth + getStackEffectFor(bytecode->code[index], getArgumentCount(bytecode, index));
+        if (depth > maxDepth)
+        {
+            maxDepth = depth;
+        }
+        index = index + getInstructionLength(bytecode, index);
+    }
+
+    functionObj->maxStackDepth = maxDepth;
+}
+
 void initInterpreter(Interpreter *interpreter)
 {
     initVirtualMachine(&interpreter->vm);
     interpreter->onStdOut = NULL;
+    interpreter->onStdErr = NULL;
     interpreter->debugMode = false;
 }
 
 void freeInterpreter(Interpreter *interpreter)
 {
+    freeVirtualMachine(&interpreter->vm);
 }
 
 void initParser(Parser *parser)
 {
     parser->tokens = NULL;
     parser->depth = -1;
-
-    initHashMap(getCurrentCompilerFunctions(parser));
-}
-
-void freeParser(Parser *parser)
-{
-    freeHashMap(getCurrentCompilerFunctions(parser));
+    parser->lastCallLocation = -1;
 }
 
 void compile(FunctionObj *functionObj, TokenArrayIterator *tokens)
@@ -363,6 +590,7 @@ void compile(FunctionObj *functionObj, TokenArrayIterator *tokens)
     undoCompilerFunction(&parser);
 
     writeChunk(functionObj->bytecode, OP_RETURN);
+    computeMaxStackDepth(functionObj);
 
     // freeParser(&parser);
 }
@@ -383,9 +611,12 @@ void runInterpreter(Interpreter *interpreter, const char *sourceCode)
     compile(&functionObj, &tokens);
 
     interpreter->vm.onStdOut = interpreter->onStdOut;
-    interpreter->vm.debugMode = interpreter->debugMode;
-    prepareForCall(&interpreter->vm, &functionObj);
-    interpret(&interpreter->vm);
+    interpreter->vm.onStdErr = interpreter->onStdErr;
+    setDebugMode(&interpreter->vm, interpreter->debugMode);
+    if (prepareForCall(&interpreter->vm, &functionObj) != NULL)
+    {
+        interpret(&interpreter->vm);
+    }
 
     freeFunctionObj(&functionObj);
 }
@@ -423,6 +654,13 @@ static void defineVariableBinding(Parser *parser, Token token)
     if (shouldDefineVariableBinding)
     {
         FunctionCompiler *compiler = getCurrentCompiler(parser);
+        if (compiler->stackCapacity < compiler->stackDepth + 1)
+        {
+            int oldCapacity = compiler->stackCapacity;
+            compiler->stackCapacity = GROW_CAPACITY(oldCapacity);
+            compiler->stack = GROW_ARRAY(VariableBindingStackLocation, compiler->stack, oldCapacity, compiler->stackCapacity);
+        }
+
         VariableBindingStackLocation *slot = &compiler->stack[compiler->stackDepth];
         slot->token = token;
 
@@ -437,7 +675,7 @@ static bool isGlobalBinding(Parser *parser, Token token)
     return bindingLocation == _BINDING_NOT_FOUND_;
 }
 
-static uint8_t getVariableBinding(Parser *parser, Token token)
+static int getVariableBinding(Parser *parser, Token token)
 {
     return getVariableBindingAsInt(parser, token);
 }
@@ -470,10 +708,9 @@ static void variableDecl(Parser *parser)
 
     if (isInGlobalScope(parser))
     {
-        writeChunk(getCurrentCompilerBytecode(parser), OP_VAR_GLOBAL_DECL);
         Value asString = wrapString(identifier.lexeme);
         int constantLocation = addConstant(getCurrentCompilerBytecode(parser), asString);
-        writeChunk(getCurrentCompilerBytecode(parser), constantLocation);
+        writeConstantInstruction(parser, OP_VAR_GLOBAL_DECL, OP_VAR_GLOBAL_DECL_LONG, constantLocation);
     }
     else
     {
@@ -488,16 +725,14 @@ static void variableDecl(Parser *parser)
         expression(parser);
         if (isGlobalBinding(parser, identifier))
         {
-            writeChunk(getCurrentCompilerBytecode(parser), OP_VAR_GLOBAL_ASSIGN);
             Value asString = wrapString(identifier.lexeme);
             int constantLocation = addConstant(getCurrentCompilerBytecode(parser), asString);
-            writeChunk(getCurrentCompilerBytecode(parser), constantLocation);
+            writeConstantInstruction(parser, OP_VAR_GLOBAL_ASSIGN, OP_VAR_GLOBAL_ASSIGN_LONG, constantLocation);
         }
         else
         {
-            writeChunk(getCurrentCompilerBytecode(parser), OP_VAR_ASSIGN);
-            uint8_t offset = getVariableBinding(parser, identifier);
-            writeChunk(getCurrentCompilerBytecode(parser), offset);
+            int offset = getVariableBinding(parser, identifier);
+            writeLocalInstruction(parser, OP_VAR_ASSIGN, OP_VAR_ASSIGN_LONG, offset);
         }
         popToken(parser->tokens);
     }
@@ -519,15 +754,13 @@ static void varAssign(Parser *parser)
 
     if (isGlobalBinding(parser, identifier))
     {
-        writeChunk(getCurrentCompilerBytecode(parser), OP_VAR_GLOBAL_ASSIGN);
         int constantLocation = addConstant(getCurrentCompilerBytecode(parser), wrapString(identifier.lexeme));
-        writeChunk(getCurrentCompilerBytecode(parser), constantLocation);
+        writeConstantInstruction(parser, OP_VAR_GLOBAL_ASSIGN, OP_VAR_GLOBAL_ASSIGN_LONG, constantLocation);
     }
     else
     {
-        writeChunk(getCurrentCompilerBytecode(parser), OP_VAR_ASSIGN);
-        uint8_t offset = getVariableBinding(parser, identifier);
-        writeChunk(getCurrentCompilerBytecode(parser), offset);
+        int offset = getVariableBinding(parser, identifier);
+        writeLocalInstruction(parser, OP_VAR_ASSIGN, OP_VAR_ASSIGN_LONG, offset);
     }
 
     popToken(parser->tokens);
@@ -595,38 +828,72 @@ static void ifStatement(Parser *parser)
 
     expression(parser);
 
-    writeChunk(getCurrentCompilerBytecode(parser), OP_JUMP_IF_FALSE);
-    int currentLocation = getCurrentCompilerBytecode(parser)->count;
-    writeShort(getCurrentCompilerBytecode(parser), UINT16_MAX);
+    int jumpIfFalseLocation = writeEmptyJump(parser, OP_JUMP_IF_FALSE);
 
     popToken(parser->tokens);
     blockStatement(parser);
 
-    overwriteShort(getCurrentCompilerBytecode(parser), currentLocation, getCurrentCompilerBytecode(parser)->count);
+    patchJump(parser, jumpIfFalseLocation);
 }
 
-static void whileStatement(Parser *parser)
+// Consumes tokens up to and including the terminator, ignoring any terminator
+// that appears inside nested parentheses.
+static void skipTokensThrough(Parser *parser, TokenType terminator)
 {
-    popToken(parser->tokens); // popping while
-    popToken(parser->tokens); // popping (
+    int parenDepth = 0;
+    while (true)
+    {
+        Token skipped = popToken(parser->tokens);
+        if (parenDepth == 0 && skipped.type == terminator)
+        {
+            break;
+        }
+
+        if (skipped.type == TOKEN_LEFT_PAREN)
+        {
+            parenDepth++;
+        }
+        else if (skipped.type == TOKEN_RIGHT_PAREN)
+        {
+            parenDepth--;
+        }
+    }
+}
+
+// Compiles the loop condition found at conditionStart as the bottom of the loop,
+// branching back to startOfBody while it holds. The token stream is left where it was.
+static void compileLoopCondition(Parser *parser, uint32_t conditionStart, int startOfBody)
+{
+    uint32_t resumeAt = parser->tokens->current;
+    parser->tokens->current = conditionStart;
 
-    int startOfWhileExpression = getCurrentCompilerBytecode(parser)->count + 1;
     expression(parser);
+    writeLoopIfTrue(parser, startOfBody);
 
-    popToken(parser->tokens); // popping )
+    parser->tokens->current = resumeAt;
+}
 
-    writeChunk(getCurrentCompilerBytecode(parser), OP_JUMP_IF_FALSE);
-    int jumpIfFalseLocation = getCurrentCompilerBytecode(parser)->count;
-    writeShort(getCurrentCompilerBytecode(parser), UINT16_MAX);
+// Loops are rotated so the condition sits at the bottom:
+//     OP_JUMP condition
+//     body:      ...
+//     condition: ...
+//     OP_LOOP_IF_TRUE body
+// Entering the loop costs one jump, every iteration after that a single branch.
+static void whileStatement(Parser *parser)
+{
+    popToken(parser->tokens); // popping while
+    popToken(parser->tokens); // popping (
 
-    blockStatement(parser);
+    uint32_t conditionStart = parser->tokens->current;
+    skipTokensThrough(parser, TOKEN_RIGHT_PAREN);
 
-    int blockLength = getCurrentCompilerBytecode(parser)->count - startOfWhileExpression + 1;
+    int jumpToConditionLocation = writeEmptyJump(parser, OP_JUMP);
+    int startOfBody = getCurrentCompilerBytecode(parser)->count;
 
-    writeChunk(getCurrentCompilerBytecode(parser), OP_LOOP);
-    writeChunk(getCurrentCompilerBytecode(parser), blockLength);
+    blockStatement(parser);
 
-    overwriteShort(getCurrentCompilerBytecode(parser), jumpIfFalseLocation, getCurrentCompilerBytecode(parser)->count);
+    startOfBody += patchJump(parser, jumpToConditionLocation);
+    compileLoopCondition(parser, conditionStart, startOfBody);
 }
 
 static void compileInitStatements(Parser *parser)
@@ -643,88 +910,55 @@ static void compileInitStatements(Parser *parser)
     }
 }
 
-static int compileExpressionStatement(Parser *parser)
+static void compileUpdateStatements(Parser *parser, uint32_t updateStart)
 {
-    int startOfIterablePortion = getCurrentCompilerBytecode(parser)->count + 1;
-    expression(parser);
-
-    popToken(parser->tokens); // ; that ends the expression?
-
-    return startOfIterablePortion;
-}
+    uint32_t resumeAt = parser->tokens->current;
+    parser->tokens->current = updateStart;
 
-static int writeEmptyIfFalseJumpStatement(Parser *parser)
-{
-    writeChunk(getCurrentCompilerBytecode(parser), OP_JUMP_IF_FALSE);
-    int jumpIfFalseLocation = getCurrentCompilerBytecode(parser)->count;
-    writeShort(getCurrentCompilerBytecode(parser), UINT16_MAX);
-
-    return jumpIfFalseLocation;
-}
-
-static int writeEmptyJumpStatement(Parser *parser)
-{
-    writeChunk(getCurrentCompilerBytecode(parser), OP_JUMP);
-    int forLoopUpdateLocation = getCurrentCompilerBytecode(parser)->count;
-    writeShort(getCurrentCompilerBytecode(parser), UINT16_MAX);
-    return forLoopUpdateLocation;
-}
-
-static int compileUpdateStatements(Parser *parser, int startOfExpressionLocation)
-{
-    int startOfCompileUpdateStatements = getCurrentCompilerBytecode(parser)->count;
-    Token varAssignOrSemicolon = peekAtToken(parser->tokens);
-    if (varAssignOrSemicolon.type == TOKEN_IDENTIFIER)
+    Token varAssignOrParen = peekAtToken(parser->tokens);
+    if (varAssignOrParen.type == TOKEN_IDENTIFIER)
     {
         varAssignOrFunctionExpr(parser);
     }
-    else
-    {
-        popToken(parser->tokens);
-    }
-
-    int jumpOffset = getCurrentCompilerBytecode(parser)->count - startOfExpressionLocation + 1;
-    writeChunk(getCurrentCompilerBytecode(parser), OP_LOOP);
-    writeChunk(getCurrentCompilerBytecode(parser), jumpOffset);
 
-    return startOfCompileUpdateStatements;
+    parser->tokens->current = resumeAt;
 }
 
 static void forStatement(Parser *parser)
 {
+    FunctionCompiler *current = getCurrentCompiler(parser);
     blockStart(parser);
-    int stackDepthStart = parser->depth;
+    int stackDepthStart = current->stackDepth;
 
     popToken(parser->tokens); // should have been for
     popToken(parser->tokens); // should have been (
 
     compileInitStatements(parser);
 
-    int startOfIterablePortion = compileExpressionStatement(parser);
-    int jumpIfFalseValueLocation = writeEmptyIfFalseJumpStatement(parser);
-    int expressionToBodyJumpLocation = writeEmptyJumpStatement(parser);
-
-    int startOfUpdateStatements = compileUpdateStatements(parser, startOfIterablePortion);
+    uint32_t conditionStart = parser->tokens->current;
+    skipTokensThrough(parser, TOKEN_SEMICOLON);
+    uint32_t updateStart = parser->tokens->current;
+    skipTokensThrough(parser, TOKEN_RIGHT_PAREN);
 
-    overwriteShort(getCurrentCompilerBytecode(parser), expressionToBodyJumpLocation, getCurrentCompilerBytecode(parser)->count);
-
-    popToken(parser->tokens); // should have been a )
+    int jumpToConditionLocation = writeEmptyJump(parser, OP_JUMP);
+    int startOfBody = getCurrentCompilerBytecode(parser)->count;
 
     blockStatement(parser);
+    compileUpdateStatements(parser, updateStart);
 
-    int blockLength = getCurrentCompilerBytecode(parser)->count - startOfUpdateStatements;
-
-    writeChunk(getCurrentCompilerBytecode(parser), OP_LOOP);
-    writeChunk(getCurrentCompilerBytecode(parser), blockLength);
+    startOfBody += patchJump(parser, jumpToConditionLocation);
+    compileLoopCondition(parser, conditionStart, startOfBody);
 
+    int numLocals = current->stackDepth - stackDepthStart;
+    releaseLocals(parser, numLocals);
     blockEnd(parser, stackDepthStart);
-
-    overwriteShort(getCurrentCompilerBytecode(parser), jumpIfFalseValueLocation, getCurrentCompilerBytecode(parser)->count);
 }
 
 static FunctionObj *defineNewLocalFunction(Parser *parser, Token funcId)
 {
     FunctionObj *newFunctionDecl = malloc(sizeof(FunctionObj));
+    COUNT_OBJECT_ALLOCATION(ObjFunction, sizeof(FunctionObj));
+    PROBE_OBJECT_ALLOC(ObjFunction, sizeof(FunctionObj));
     initFunctionObj(newFunctionDecl);
     newFunctionDecl->name = asString(funcId.lexeme);
 
@@ -776,13 +1010,52 @@ static void funcDecl(Parser *parser)
 
     blockStatement(parser);
     writeChunk(getCurrentCompilerBytecode(parser), OP_RETURN);
+    computeMaxStackDepth(newLocalFunction);
     undoCompilerFunction(parser);
 }
 
+static OpCode getTailCallFor(OpCode opCode)
+{
+    if (opCode == OP_CALL_DIRECT)
+    {
+        return OP_TAIL_CALL_DIRECT;
+    }
+    else if (opCode == OP_CALL_DIRECT_LONG)
+    {
+        return OP_TAIL_CALL_DIRECT_LONG;
+    }
+    return OP_TAIL_CALL;
+}
+
+// A call is in tail position when it is the last instruction of the returned expression.
+// Turning it into a tail call lets it reuse the returning function's call frame.
+static void markTailCall(Parser *parser)
+{
+    Chunk *bytecode = getCurrentCompilerBytecode(parser);
+    int callLocation = parser->lastCallLocation;
+    if (callLocation == -1)
+    {
+        return;
+    }
+
+    OpCode call = bytecode->code[callLocation];
+    int callLength = getByteLengthFor(call);
+    if (callLocation + callLength == bytecode->count)
+    {
+        bytecode->code[callLocation] = getTailCallFor(call);
+    }
+}
+
 static void returnStmt(Parser *parser)
 {
     popToken(parser->tokens);
+    parser->lastCallLocation = -1;
     expression(parser);
+
+    if (parser->depth > 0)
+    {
+        markTailCall(parser);
+    }
     writeChunk(getCurrentCompilerBytecode(parser), OP_RETURN);
     popToken(parser->tokens);
 }
@@ -790,6 +1063,7 @@ static void returnStmt(Parser *parser)
 static void statement(Parser *parser)
 {
     Token peeked = peekAtToken(parser->tokens);
+    markLine(parser, peeked);
 
     if (peeked.type == TOKEN_PRINT)
     {
@@ -830,6 +1104,11 @@ static void statement(Parser *parser)
     else
     {
         expression(parser);
+        if (isAtEndOfStatement(parser))
+        {
+            writeChunk(getCurrentCompilerBytecode(parser), OP_POP);
+            popToken(parser->tokens);
+        }
     }
 }
 
@@ -844,16 +1123,15 @@ static void parseExpression(Precedence precedence, Parser *parser)
 {
     Token prefixToken = peekAtToken(parser->tokens);
     ParseFn prefixFunction = getRule(prefixToken.type)->prefix;
+    markLine(parser, prefixToken);
 
     prefixFunction(parser);
 
-    Token maybeInfixToken = peekAtToken(parser->tokens);
-    ParseRule *infixParseRule = getRule(maybeInfixToken.type);
-    while (!isAtEndOfExpression(parser) && precedence <= infixParseRule->Precedence)
+    while (!isAtEndOfExpression(parser) && precedence <= getRule(peekAtToken(parser->tokens).type)->Precedence)
     {
-        ParseFn infixFunction = getRule(maybeInfixToken.type)->infix;
+        Token infixToken = peekAtToken(parser->tokens);
+        ParseFn infixFunction = getRule(infixToken.type)->infix;
         infixFunction(parser);
-        maybeInfixToken = peekAtToken(parser->tokens);
     }
 }
 
@@ -22,6 +22,7 @@ typedef enum {
 
 typedef struct Interpreter {
     void (*onStdOut) (char*);
+    void (*onStdErr) (char*);
     VirtualMachine vm;
     bool debugMode;
 } Interpreter;
@@ -2,12 +2,39 @@
 #include "chunk.h"
 #include "stdint.h"
 #include "stdio.h"
+#include <math.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include "functionobj.h"
+#include "cloxstring.h"
+#include "memory.h"
 
 uint8_t disassemble_peek(Chunk *bytecode, int index);
 uint8_t disassembleInstruction(Chunk *bytecode, int index, void (*logger)(char *message));
 
+static uint8_t callDirectInstruction(const char *opCodeAsString, Chunk *bytecode, int index, uint32_t indexConstant, uint8_t byteLength, void (*logger)(char *message))
+{
+    FunctionObj *callee = (FunctionObj *)unwrapObject(getConstantAt(bytecode, indexConstant));
+    int length = snprintf(NULL, 0, "%04d %s %u %s\n", index, opCodeAsString, indexConstant, callee->name->chars);
+
+    char *line = malloc(sizeof(char) * length + 1);
+    snprintf(line, length + 1, "%04d %s %u %s\n", index, opCodeAsString, indexConstant, callee->name->chars);
+    logger(line);
+
+    return byteLength;
+}
+
+static uint8_t operandInstruction(const char *opCodeAsString, int index, uint32_t operand, uint8_t byteLength, void (*logger)(char *message))
+{
+    int length = snprintf(NULL, 0, "%04d %s %u\n", index, opCodeAsString, operand);
+
+    char *line = malloc(sizeof(char) * length + 1);
+    snprintf(line, length + 1, "%04d %s %u\n", index, opCodeAsString, operand);
+    logger(line);
+
+    return byteLength;
+}
+
 void disassembleChunk(Chunk *bytecode, const char *chunkName, void (*callback)(char *message))
 {
     int iterator = 0;
@@ -247,6 +274,42 @@ uint8_t disassembleInstruction(Chunk *bytecode, int index, void (*logger)(char *
 
         return 3;
     }
+    else if (opCode == OP_LOOP_IF_TRUE)
+    {
+        const char *opCodeAsString = "OP_LOOP_IF_TRUE";
+        uint16_t jumpLocation = readShort(bytecode, index + 1);
+        int length = snprintf(NULL, 0, "%04d %s %d\n", index, opCodeAsString, jumpLocation);
+
+        char *line = malloc(sizeof(char) * length + 1);
+        snprintf(line, length + 1, "%04d %s %d\n", index, opCodeAsString, jumpLocation);
+        logger(line);
+
+        return 3;
+    }
+    else if (opCode == OP_JUMP_IF_FALSE_PEEK)
+    {
+        const char *opCodeAsString = "OP_JUMP_IF_FALSE_PEEK";
+        uint16_t jumpLocation = readShort(bytecode, index + 1);
+        int length = snprintf(NULL, 0, "%04d %s %d\n", index, opCodeAsString, jumpLocation);
+
+        char *line = malloc(sizeof(char) * length + 1);
+        snprintf(line, length + 1, "%04d %s %d\n", index, opCodeAsString, jumpLocation);
+        logger(line);
+
+        return 3;
+    }
+    else if (opCode == OP_JUMP_IF_TRUE_PEEK)
+    {
+        const char *opCodeAsString = "OP_JUMP_IF_TRUE_PEEK";
+        uint16_t jumpLocation = readShort(bytecode, index + 1);
+        int length = snprintf(NULL, 0, "%04d %s %d\n", index, opCodeAsString, jumpLocation);
+
+        char *line = malloc(sizeof(char) * length + 1);
+        snprintf(line, length + 1, "%04d %s %d\n", index, opCodeAsString, jumpLocation);
+        logger(line);
+
+        return 3;
+    }
     else if (opCode == OP_JUMP)
     {
         const char *opCodeAsString = "OP_JUMP";
@@ -316,6 +379,81 @@ uint8_t disassembleInstruction(Chunk *bytecode, int index, void (*logger)(char *
 
         return 1;
     }
+    else if (opCode == OP_CONSTANT_LONG)
+    {
+        uint32_t indexConstant = readLong(bytecode, index + 1);
+        Value constant = getConstantAt(bytecode, indexConstant);
+
+        const char *opCodeAsString = "OP_CONSTANT_LONG";
+        int length = snprintf(NULL, 0, "%04d %s %u %f\n", index, opCodeAsString, indexConstant, unwrapNumber(constant));
+
+        char *line = malloc(sizeof(char) * length + 1);
+        snprintf(line, length + 1, "%04d %s %u %f\n", index, opCodeAsString, indexConstant, unwrapNumber(constant));
+
+        logger(line);
+
+        return 4;
+    }
+    else if (opCode == OP_VAR_ASSIGN_LONG)
+    {
+        return operandInstruction("OP_VAR_ASSIGN_LONG", index, readShort(bytecode, index + 1), 3, logger);
+    }
+    else if (opCode == OP_VAR_EXPRESSION_LONG)
+    {
+        return operandInstruction("OP_VAR_EXPRESSION_LONG", index, readShort(bytecode, index + 1), 3, logger);
+    }
+    else if (opCode == OP_VAR_GLOBAL_DECL_LONG)
+    {
+        return operandInstruction("OP_VAR_GLOBAL_DECL_LONG", index, readLong(bytecode, index + 1), 4, logger);
+    }
+    else if (opCode == OP_VAR_GLOBAL_ASSIGN_LONG)
+    {
+        return operandInstruction("OP_VAR_GLOBAL_ASSIGN_LONG", index, readLong(bytecode, index + 1), 4, logger);
+    }
+    else if (opCode == OP_VAR_GLOBAL_EXPRESSION_LONG)
+    {
+        return operandInstruction("OP_VAR_GLOBAL_EXPRESSION_LONG", index, readLong(bytecode, index + 1), 4, logger);
+    }
+    else if (opCode == OP_JUMP_LONG)
+    {
+        return operandInstruction("OP_JUMP_LONG", index, readLong(bytecode, index + 1), 4, logger);
+    }
+    else if (opCode == OP_JUMP_IF_FALSE_LONG)
+    {
+        return operandInstruction("OP_JUMP_IF_FALSE_LONG", index, readLong(bytecode, index + 1), 4, logger);
+    }
+    else if (opCode == OP_JUMP_IF_FALSE_PEEK_LONG)
+    {
+        return operandInstruction("OP_JUMP_IF_FALSE_PEEK_LONG", index, readLong(bytecode, index + 1), 4, logger);
+    }
+    else if (opCode == OP_JUMP_IF_TRUE_PEEK_LONG)
+    {
+        return operandInstruction("OP_JUMP_IF_TRUE_PEEK_LONG", index, readLong(bytecode, index + 1), 4, logger);
+    }
+    else if (opCode == OP_LOOP_IF_TRUE_LONG)
+    {
+        return operandInstruction("OP_LOOP_IF_TRUE_LONG", index, readLong(bytecode, index + 1), 4, logger);
+    }
+    else if (opCode == OP_CALL_DIRECT)
+    {
+        return callDirectInstruction("OP_CALL_DIRECT", bytecode, index, bytecode->code[index + 1], 2, logger);
+    }
+    else if (opCode == OP_CALL_DIRECT_LONG)
+    {
+        return callDirectInstruction("OP_CALL_DIRECT_LONG", bytecode, index, readLong(bytecode, index + 1), 4, logger);
+    }
+    else if (opCode == OP_TAIL_CALL)
+    {
+        return operandInstruction("OP_TAIL_CALL", index, bytecode->code[index + 1], 2, logger);
+    }
+    else if (opCode == OP_TAIL_CALL_DIRECT)
+    {
+        return callDirectInstruction("OP_TAIL_CALL_DIRECT", bytecode, index, bytecode->code[index + 1], 2, logger);
+    }
+    else if (opCode == OP_TAIL_CALL_DIRECT_LONG)
+    {
+        return callDirectInstruction("OP_TAIL_CALL_DIRECT_LONG", bytecode, index, readLong(bytecode, index + 1), 4, logger);
+    }
     else
     {
         const char *opCodeAsString = "BAD_OP_CODE";
@@ -326,4 +464,245 @@ uint8_t disassembleInstruction(Chunk *bytecode, int index, void (*logger)(char *
         logger(line);
         return 1;
     }
-}
\ No newline at end of file
+}
+
+void initDisassemblyToFile(DisassemblyOutput *output, FILE *file, DisassemblyFormat format)
+{
+    output->format = format;
+    output->file = file;
+    output->chars = NULL;
+    output->length = 0;
+    output->capacity = 0;
+    output->hasWrittenHeader = false;
+}
+
+void initDisassemblyToBuffer(DisassemblyOutput *output, DisassemblyFormat format)
+{
+    initDisassemblyToFile(output, NULL, format);
+}
+
+void freeDisassemblyOutput(DisassemblyOutput *output)
+{
+    FREE_ARRAY(char, output->chars, output->capacity);
+    initDisassemblyToFile(output, NULL, output->format);
+}
+
+static void writeFormatted(DisassemblyOutput *output, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    if (output->file != NULL)
+    {
+        vfprintf(output->file, format, arguments);
+        va_end(arguments);
+        return;
+    }
+
+    int room = output->capacity - output->length;
+    int length = vsnprintf(output->chars == NULL ? NULL : output->chars + output->length, room, format, arguments);
+    va_end(arguments);
+    if (length >= room)
+    {
+        int oldCapacity = output->capacity;
+        while (output->capacity - output->length <= length)
+        {
+            output->capacity = GROW_CAPACITY(output->capacity);
+        }
+        output->chars = GROW_ARRAY(char, output->chars, oldCapacity, output->capacity);
+
+        va_start(arguments, format);
+        vsnprintf(output->chars + output->length, length + 1, format, arguments);
+        va_end(arguments);
+    }
+    output->length += length;
+}
+
+static void writeChar(DisassemblyOutput *output, char character)
+{
+    writeFormatted(output, "%c", character);
+}
+
+// Strings are quoted the way the format needs them, a character at a time.
+static void writeQuoted(DisassemblyOutput *output, const char *chars)
+{
+    writeChar(output, '"');
+    for (const char *next = chars; *next != '\0'; next++)
+    {
+        unsigned char character = *next;
+        if (output->format == DISASSEMBLY_CSV && character == '"')
+        {
+            writeFormatted(output, "\"\"");
+        }
+        else if (output->format == DISASSEMBLY_JSON && (character == '"' || character == '\\'))
+        {
+            writeFormatted(output, "\\%c", character);
+        }
+        else if (output->format == DISASSEMBLY_JSON && character < 0x20)
+        {
+            writeFormatted(output, "\\u%04x", character);
+        }
+        else
+        {
+            writeChar(output, character);
+        }
+    }
+    writeChar(output, '"');
+}
+
+static void writeOptionalNumber(DisassemblyOutput *output, bool isPresent, uint32_t number, const char *absent)
+{
+    if (isPresent)
+    {
+        writeFormatted(output, "%u", number);
+    }
+    else
+    {
+        writeFormatted(output, "%s", absent);
+    }
+}
+
+static bool hasConstantOperand(OpCode opCode)
+{
+    return opCode == OP_CONSTANT || opCode == OP_CONSTANT_LONG || opCode == OP_CALL_DIRECT || opCode == OP_CALL_DIRECT_LONG ||
+           opCode == OP_TAIL_CALL_DIRECT || opCode == OP_TAIL_CALL_DIRECT_LONG || opCode == OP_VAR_GLOBAL_DECL ||
+           opCode == OP_VAR_GLOBAL_DECL_LONG || opCode == OP_VAR_GLOBAL_ASSIGN || opCode == OP_VAR_GLOBAL_ASSIGN_LONG ||
+           opCode == OP_VAR_GLOBAL_EXPRESSION || opCode == OP_VAR_GLOBAL_EXPRESSION_LONG;
+}
+
+// Numbers are written in the fewest digits that read back as the same double, so any two
+// can be told apart. JSON has no infinity or NaN, so there those are written as strings.
+// Functions are written as their name, and OP_STRING's inline characters as a string.
+static void writeConstant(DisassemblyOutput *output, Chunk *bytecode, int offset, uint32_t operand)
+{
+    OpCode opCode = bytecode->code[offset];
+    if (opCode == OP_STRING)
+    {
+        writeQuoted(output, (char *)&bytecode->code[offset + 1]);
+        return;
+    }
+
+    Value constant = getConstantAt(bytecode, operand);
+    if (isNumber(constant))
+    {
+        char number[NUMBER_BUFFER_SIZE];
+        formatNumber(unwrapNumber(constant), number);
+        if (output->format == DISASSEMBLY_JSON && !isfinite(unwrapNumber(constant)))
+        {
+            writeQuoted(output, number);
+        }
+        else
+        {
+            writeFormatted(output, "%s", number);
+        }
+    }
+    else if (isFunctionObj(constant))
+    {
+        StringObj *name = unwrapFunctionObj(constant)->name;
+        writeQuoted(output, name == NULL ? "script" : name->chars);
+    }
+    else if (isStringObj(constant))
+    {
+        writeQuoted(output, ((StringObj *)unwrapObject(constant))->chars);
+    }
+    else if (isBool(constant))
+    {
+        writeFormatted(output, "%s", unwrapBool(constant) ? "true" : "false");
+    }
+    else
+    {
+        writeFormatted(output, "nil");
+    }
+}
+
+static void writeInstruction(DisassemblyOutput *output, Chunk *bytecode, const char *chunkName, int offset, int length)
+{
+    OpCode opCode = bytecode->code[offset];
+    const char *name = opCode < OP_CODE_COUNT ? getOpCodeName(opCode) : "BAD_OP_CODE";
+    int line = getLineAt(bytecode, offset);
+
+    bool hasOperand = opCode != OP_STRING && length > 1;
+    uint32_t operand = length == 2 ? bytecode->code[offset + 1] : length == 3 ? readShort(bytecode, offset + 1) : length == 4 ? readLong(bytecode, offset + 1) : 0;
+    bool hasConstant = opCode == OP_STRING || hasConstantOperand(opCode);
+
+    if (output->format == DISASSEMBLY_TEXT)
+    {
+        // Like a listing, a line that carries on from the instruction before is left blank.
+        if (line == 0 || (offset > 0 && getLineAt(bytecode, offset - 1) == line))
+        {
+            writeFormatted(output, "%04d    | %s", offset, name);
+        }
+        else
+        {
+            writeFormatted(output, "%04d %4d %s", offset, line, name);
+        }
+        if (hasOperand)
+        {
+            writeFormatted(output, " %u", operand);
+        }
+        if (hasConstant)
+        {
+            writeChar(output, ' ');
+            writeConstant(output, bytecode, offset, operand);
+        }
+        writeChar(output, '\n');
+    }
+    else if (output->format == DISASSEMBLY_JSON)
+    {
+        writeFormatted(output, "{\"chunk\":");
+        writeQuoted(output, chunkName);
+        writeFormatted(output, ",\"offset\":%d,\"opcode\":\"%s\",\"operand\":", offset, name);
+        writeOptionalNumber(output, hasOperand, operand, "null");
+        writeFormatted(output, ",\"constant\":");
+        if (hasConstant)
+        {
+            writeConstant(output, bytecode, offset, operand);
+        }
+        else
+        {
+            writeFormatted(output, "null");
+        }
+        writeFormatted(output, ",\"line\":");
+        writeOptionalNumber(output, line != 0, line, "null");
+        writeFormatted(output, "}\n");
+    }
+    else
+    {
+        writeQuoted(output, chunkName);
+        writeFormatted(output, ",%d,%s,", offset, name);
+        writeOptionalNumber(output, hasOperand, operand, "");
+        writeChar(output, ',');
+        if (hasConstant)
+        {
+            writeConstant(output, bytecode, offset, operand);
+        }
+        writeChar(output, ',');
+        writeOptionalNumber(output, line != 0, line, "");
+        writeChar(output, '\n');
+    }
+}
+
+void writeDisassembly(DisassemblyOutput *output, Chunk *bytecode, const char *chunkName)
+{
+    if (output->format == DISASSEMBLY_TEXT)
+    {
+        writeFormatted(output, "=== %s ===\n", chunkName);
+    }
+    else if (output->format == DISASSEMBLY_CSV && !output->hasWrittenHeader)
+    {
+        writeFormatted(output, "chunk,offset,opcode,operand,constant,line\n");
+    }
+    output->hasWrittenHeader = true;
+
+    int offset = 0;
+    while (offset < bytecode->count)
+    {
+        // Bytes that are not an op code are stepped over one at a time.
+        int length = getInstructionLength(bytecode, offset);
+        if (length == 0 || offset + length > bytecode->count)
+        {
+            length = 1;
+        }
+        writeInstruction(output, bytecode, chunkName, offset, length);
+        offset += length;
+    }
+}
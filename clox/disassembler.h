@@ -1,8 +1,35 @@
 #ifndef DISASSEMBLER_HEADER
 #define DISASSEMBLER_HEADER
 
+#include <stdio.h>
 #include "chunk.h"
 
 void disassembleChunk(Chunk* bytecode, const char* chunkName, void (*callback)(char* message));
 
-#endif
\ No newline at end of file
+typedef enum DisassemblyFormat {
+    // One line per instruction: offset, source line, op code, operand, constant.
+    DISASSEMBLY_TEXT,
+    // One JSON object per line, for tools that diff bytecode.
+    DISASSEMBLY_JSON,
+    // A header row, then one row per instruction.
+    DISASSEMBLY_CSV
+} DisassemblyFormat;
+
+// Where writeDisassembly() streams to: a file, or a buffer that is only grown when a line
+// does not fit, so nothing is allocated per instruction either way.
+typedef struct DisassemblyOutput {
+    DisassemblyFormat format;
+    FILE* file;
+    char* chars;
+    int length;
+    int capacity;
+    bool hasWrittenHeader;
+} DisassemblyOutput;
+
+void initDisassemblyToFile(DisassemblyOutput* output, FILE* file, DisassemblyFormat format);
+// The buffer is kept NUL-terminated, so output->chars can be read as a string.
+void initDisassemblyToBuffer(DisassemblyOutput* output, DisassemblyFormat format);
+void freeDisassemblyOutput(DisassemblyOutput* output);
+void writeDisassembly(DisassemblyOutput* output, Chunk* bytecode, const char* chunkName);
+
+#endif
@@ -0,0 +1,260 @@
+#include "flightrecorder.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "memory.h"
+#include "textbuffer.h"
+
+#ifdef __linux__
+#include <signal.h>
+#endif
+
+#define FLIGHT_MAGIC "CLFR"
+#define FLIGHT_VERSION 1
+
+typedef struct FlightHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t functionCount;
+    uint32_t recordCount;
+    uint64_t count;
+} FlightHeader;
+
+static const char *valueTypeNames[] = {
+    [VALUE_TYPE_BOOL] = "bool",
+    [VALUE_TYPE_NUMBER] = "number",
+    [VALUE_TYPE_OBJECT] = "object",
+    [VALUE_TYPE_NIL] = "nil",
+};
+
+void initFlightRecorder(FlightRecorder *recorder, uint32_t capacity)
+{
+    uint32_t rounded = 1;
+    while (rounded < capacity)
+    {
+        rounded *= 2;
+    }
+
+    recorder->records = malloc(sizeof(FlightRecord) * rounded);
+    recorder->capacity = rounded;
+    recorder->count = 0;
+    recorder->functions = NULL;
+    recorder->functionCount = 0;
+    recorder->functionCapacity = 0;
+    recorder->lastFunction = NULL;
+    recorder->lastFunctionId = FLIGHT_UNKNOWN_FUNCTION;
+}
+
+void freeFlightRecorder(FlightRecorder *recorder)
+{
+    free(recorder->records);
+    FREE_ARRAY(FunctionObj *, recorder->functions, recorder->functionCapacity);
+    recorder->records = NULL;
+    recorder->functions = NULL;
+    recorder->functionCount = 0;
+    recorder->functionCapacity = 0;
+}
+
+uint16_t getFlightFunctionId(FlightRecorder *recorder, FunctionObj *function)
+{
+    for (int i = 0; i < recorder->functionCount; i++)
+    {
+        if (recorder->functions[i] == function)
+        {
+            return i;
+        }
+    }
+    if (recorder->functionCount == FLIGHT_UNKNOWN_FUNCTION)
+    {
+        return FLIGHT_UNKNOWN_FUNCTION;
+    }
+
+    if (recorder->functionCapacity < recorder->functionCount + 1)
+    {
+        int oldCapacity = recorder->functionCapacity;
+        recorder->functionCapacity = GROW_CAPACITY(oldCapacity);
+        recorder->functions = GROW_ARRAY(FunctionObj *, recorder->functions, oldCapacity, recorder->functionCapacity);
+    }
+    recorder->functions[recorder->functionCount] = function;
+    return recorder->functionCount++;
+}
+
+static bool writeAll(int fileDescriptor, const void *bytes, size_t length)
+{
+    const char *next = bytes;
+    while (length > 0)
+    {
+        ssize_t written = write(fileDescriptor, next, length);
+        if (written <= 0)
+        {
+            return false;
+        }
+        next += written;
+        length -= written;
+    }
+    return true;
+}
+
+bool writeFlightRecording(FlightRecorder *recorder, int fileDescriptor)
+{
+    uint32_t recordCount = recorder->count < recorder->capacity ? recorder->count : recorder->capacity;
+    FlightHeader header;
+    memcpy(header.magic, FLIGHT_MAGIC, sizeof(header.magic));
+    header.version = FLIGHT_VERSION;
+    header.functionCount = recorder->functionCount;
+    header.recordCount = recordCount;
+    header.count = recorder->count;
+    bool isWritten = writeAll(fileDescriptor, &header, sizeof(header));
+
+    for (int i = 0; i < recorder->functionCount; i++)
+    {
+        StringObj *name = recorder->functions[i]->name;
+        const char *chars = name == NULL ? "script" : name->chars;
+        uint32_t length = strlen(chars);
+        isWritten = isWritten && writeAll(fileDescriptor, &length, sizeof(length)) && writeAll(fileDescriptor, chars, length);
+    }
+
+    // Oldest first: from the next slot to be overwritten round to the last one written.
+    uint32_t oldest = (recorder->count - recordCount) & (recorder->capacity - 1);
+    uint32_t untilEnd = recorder->capacity - oldest < recordCount ? recorder->capacity - oldest : recordCount;
+    isWritten = isWritten && writeAll(fileDescriptor, &recorder->records[oldest], sizeof(FlightRecord) * untilEnd);
+    isWritten = isWritten && writeAll(fileDescriptor, recorder->records, sizeof(FlightRecord) * (recordCount - untilEnd));
+    return isWritten;
+}
+
+#ifdef __linux__
+#define CRASH_SIGNAL_COUNT 5
+
+static FlightRecorder *crashRecorder = NULL;
+static const char *crashPath = NULL;
+static const int crashSignals[CRASH_SIGNAL_COUNT] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+static struct sigaction previousCrashActions[CRASH_SIGNAL_COUNT];
+static bool isCrashHandlerInstalled = false;
+
+static struct sigaction *getPreviousCrashAction(int signalNumber)
+{
+    for (int i = 0; i < CRASH_SIGNAL_COUNT; i++)
+    {
+        if (crashSignals[i] == signalNumber)
+        {
+            return &previousCrashActions[i];
+        }
+    }
+    return NULL;
+}
+
+// Whatever handled the signal before gets the first look, so a guarded stack's SIGSEGV
+// handler can still turn a fault on its guard page into an overflow error. It does not
+// come back when it recovers. When it does come back, or there was none, this is a crash:
+// the recording is written once, then the signal does what it would have done.
+static void onCrash(int signalNumber, siginfo_t *info, void *context)
+{
+    struct sigaction *previous = getPreviousCrashAction(signalNumber);
+    if (previous != NULL && (previous->sa_flags & SA_SIGINFO))
+    {
+        previous->sa_sigaction(signalNumber, info, context);
+    }
+    else if (previous != NULL && previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN)
+    {
+        previous->sa_handler(signalNumber);
+    }
+
+    if (crashRecorder != NULL)
+    {
+        int fileDescriptor = open(crashPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fileDescriptor >= 0)
+        {
+            writeFlightRecording(crashRecorder, fileDescriptor);
+            close(fileDescriptor);
+        }
+        crashRecorder = NULL;
+    }
+    signal(signalNumber, SIG_DFL);
+    raise(signalNumber);
+}
+#endif
+
+bool dumpFlightRecordingOnCrash(FlightRecorder *recorder, const char *path)
+{
+#ifdef __linux__
+    crashRecorder = recorder;
+    crashPath = path;
+    // Installing twice would save this handler as its own previous one.
+    if (isCrashHandlerInstalled)
+    {
+        return true;
+    }
+
+    for (int i = 0; i < CRASH_SIGNAL_COUNT; i++)
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = onCrash;
+        sigemptyset(&action.sa_mask);
+        // A guarded stack's SIGSEGV handler hands faults that are not overflows back to this.
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigaction(crashSignals[i], &action, &previousCrashActions[i]);
+    }
+    isCrashHandlerInstalled = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static const char *getTagName(int tag)
+{
+    int type = tag & FLIGHT_TYPE_MASK;
+    return type <= VALUE_TYPE_NIL ? valueTypeNames[type] : "-";
+}
+
+bool decodeFlightRecording(const char *path, void (*callback)(char *line))
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    FlightHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, FLIGHT_MAGIC, sizeof(header.magic)) != 0 || header.version != FLIGHT_VERSION)
+    {
+        fclose(file);
+        return false;
+    }
+
+    char **names = calloc(header.functionCount + 1, sizeof(char *));
+    bool isComplete = true;
+    for (uint32_t i = 0; i < header.functionCount && isComplete; i++)
+    {
+        uint32_t length;
+        isComplete = fread(&length, sizeof(length), 1, file) == 1;
+        if (isComplete)
+        {
+            names[i] = calloc(length + 1, 1);
+            isComplete = fread(names[i], 1, length, file) == length;
+        }
+    }
+
+    uint64_t first = header.count - header.recordCount;
+    reportLine(callback, "=== last %u of %llu instructions ===\n", header.recordCount, (unsigned long long)header.count);
+    FlightRecord record;
+    for (uint32_t i = 0; i < header.recordCount && isComplete && fread(&record, sizeof(record), 1, file) == 1; i++)
+    {
+        const char *name = record.functionId < header.functionCount ? names[record.functionId] : "?";
+        const char *opCodeName = record.opCode < OP_CODE_COUNT ? getOpCodeName(record.opCode) : "?";
+        reportLine(callback, "%llu %s %04u %s top:%s%s%s\n", (unsigned long long)(first + i), name, record.instructionIndex, opCodeName,
+               getTagName(record.tag), record.tag & FLIGHT_OPTIMIZED ? " optimized" : "", record.tag & FLIGHT_IN_TRACE ? " trace" : "");
+    }
+
+    for (uint32_t i = 0; i < header.functionCount; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    fclose(file);
+    return isComplete;
+}
@@ -0,0 +1,77 @@
+#ifndef FLIGHT_RECORDER_HEADER
+#define FLIGHT_RECORDER_HEADER
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "functionobj.h"
+
+// What was on top of the stack is a ValueType, or FLIGHT_EMPTY_STACK. The high bits say
+// which instructions the index counts through.
+#define FLIGHT_EMPTY_STACK 0x0F
+#define FLIGHT_TYPE_MASK 0x0F
+#define FLIGHT_OPTIMIZED 0x40
+#define FLIGHT_IN_TRACE 0x80
+
+// Functions past the last id all share it.
+#define FLIGHT_UNKNOWN_FUNCTION UINT16_MAX
+
+typedef struct FlightRecord
+{
+    uint16_t functionId;
+    uint8_t opCode;
+    uint8_t tag;
+    uint32_t instructionIndex;
+} FlightRecord;
+
+// The last capacity instructions a VM ran, kept while the recorder is attached to it.
+// Functions are numbered as they are first seen, and their names are only looked up when
+// the recording is written out, so it has to be written before they are freed.
+typedef struct FlightRecorder
+{
+    FlightRecord *records;
+    uint32_t capacity;
+    // Every instruction ever recorded, so count % capacity is where the next one goes.
+    uint64_t count;
+    FunctionObj **functions;
+    int functionCount;
+    int functionCapacity;
+    FunctionObj *lastFunction;
+    uint16_t lastFunctionId;
+} FlightRecorder;
+
+// Capacity is rounded up to a power of two.
+void initFlightRecorder(FlightRecorder *, uint32_t capacity);
+void freeFlightRecorder(FlightRecorder *);
+
+uint16_t getFlightFunctionId(FlightRecorder *, FunctionObj *function);
+
+// Runs for every instruction, so it is kept in the header for the interpreter's loop to
+// inline. Calls and returns are the only way the function changes, so most records skip
+// the lookup.
+static inline void recordFlight(FlightRecorder *recorder, FunctionObj *function, OpCode opCode, int instructionIndex, int tag)
+{
+    if (function != recorder->lastFunction)
+    {
+        recorder->lastFunction = function;
+        recorder->lastFunctionId = getFlightFunctionId(recorder, function);
+    }
+
+    FlightRecord *record = &recorder->records[recorder->count++ & (recorder->capacity - 1)];
+    record->functionId = recorder->lastFunctionId;
+    record->opCode = opCode;
+    record->tag = tag;
+    record->instructionIndex = instructionIndex;
+}
+
+// Writes the functions' names and the records, oldest first, to a file descriptor. Only
+// uses write(), so it can be called from a signal handler.
+bool writeFlightRecording(FlightRecorder *, int fileDescriptor);
+// Writes the recording to path if the process dies on a fatal signal. Only one recorder
+// is dumped this way, and only on Linux; elsewhere this returns false.
+bool dumpFlightRecordingOnCrash(FlightRecorder *, const char *path);
+
+// Turns a written recording back into one line per instruction, each in a malloc'd string
+// the callback frees. Returns false when path is not a recording.
+bool decodeFlightRecording(const char *path, void (*callback)(char *line));
+
+#endif
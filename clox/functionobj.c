@@ -2,6 +2,8 @@
 #include "chunk.h"
 #include <stdlib.h>
 #include "object.h"
+#include "memory.h"
+#include "jit.h"
 
 void initFunctionObj(FunctionObj *functionObj)
 {
@@ -10,16 +12,42 @@ void initFunctionObj(FunctionObj *functionObj)
 
     functionObj->bytecode = compiling;
     functionObj->base.type = ObjFunction;
+    functionObj->name = NULL;
     functionObj->arity = 0;
+    functionObj->maxStackDepth = 0;
+    functionObj->decoded = NULL;
+    functionObj->decodedCount = 0;
+    functionObj->callCount = 0;
+    functionObj->backEdgeCount = 0;
+    functionObj->isOptimized = false;
+    functionObj->threadedWith = NULL;
+    functionObj->native = NULL;
+    functionObj->traces = NULL;
+    functionObj->traceCount = 0;
+    functionObj->traceCapacity = 0;
 }
 
 void freeFunctionObj(FunctionObj *functionObj)
 {
     freeChunk(functionObj->bytecode);
+    FREE_ARRAY(Instruction, functionObj->decoded, functionObj->decodedCount);
+    freeNativeCode(functionObj->native);
+    for (int i = 0; i < functionObj->traceCount; i++)
+    {
+        Trace *trace = &functionObj->traces[i];
+        FREE_ARRAY(Instruction, trace->instructions, trace->count);
+        freeNativeCode(trace->native);
+    }
+    FREE_ARRAY(Trace, functionObj->traces, functionObj->traceCapacity);
 }
 
 bool isFunctionObj(Value value)
 {
+    if (!isObject(value))
+    {
+        return false;
+    }
+
     Obj *asBaseObject = unwrapObject(value);
     return asBaseObject->type == ObjFunction;
 }
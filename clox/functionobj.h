@@ -4,12 +4,42 @@
 #include "object.h"
 #include "chunk.h"
 #include "cloxstring.h"
+#include "instruction.h"
+
+// One iteration of a hot loop, recorded from the back-edge's target up to the back-edge.
+// instructions is NULL when recording gave up, so the loop is not tried again.
+typedef struct Trace {
+    Instruction *backEdge;
+    Instruction *instructions;
+    int count;
+    struct NativeCode *native;
+    // Runs of the trace, and how many of them a guard ended rather than the loop finishing.
+    int entryCount;
+    int guardExitCount;
+    bool isDisabled;
+} Trace;
 
 typedef struct FunctionObj {
     Obj base;
     Chunk* bytecode;
     StringObj* name;
     int arity;
+    // Most values the function pushes on top of its arguments, worked out by the compiler.
+    int maxStackDepth;
+    // Built from the bytecode by the VM the first time the function is called.
+    Instruction *decoded;
+    int decodedCount;
+    // The VM's handler table the decoded instructions were given their handlers from.
+    InstructionHandler *threadedWith;
+    // Counted until the function is hot enough for the VM to optimize its instructions.
+    int callCount;
+    int backEdgeCount;
+    bool isOptimized;
+    // Machine code for the optimized instructions, when the JIT could build it.
+    struct NativeCode *native;
+    Trace *traces;
+    int traceCount;
+    int traceCapacity;
 } FunctionObj;
 
 void initFunctionObj(FunctionObj*);
@@ -89,6 +89,21 @@ Value hashMapGet(HashMap *map, StringObj* key)
     return nil();
 }
 
+bool hashMapContains(HashMap *map, StringObj *key)
+{
+    unsigned long hashed = hash((const unsigned char *)key->chars);
+    Entry *iterator = map->entries[hashed % _NUM_HASH_BUCKETS_];
+    while (iterator != NULL)
+    {
+        if (!strcmp(iterator->key->chars, key->chars))
+        {
+            return true;
+        }
+        iterator = iterator->next;
+    }
+    return false;
+}
+
 unsigned long hash(const unsigned char *str)
 {
     unsigned long hash = 5381;
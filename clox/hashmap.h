@@ -21,6 +21,7 @@ void initHashMap(HashMap*);
 void freeHashMap(HashMap*);
 void hashMapPut(HashMap*, StringObj*, Value);
 Value hashMapGet(HashMap*, StringObj*);
+bool hashMapContains(HashMap*, StringObj*);
 int hashMapSize(HashMap*);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,42 @@
+#ifndef INSTRUCTION_HEADER
+#define INSTRUCTION_HEADER
+
+#include "chunk.h"
+#include "value.h"
+#include "cloxstring.h"
+
+struct VirtualMachine;
+struct FunctionObj;
+struct Instruction;
+
+typedef void (*InstructionHandler)(struct VirtualMachine *, struct Instruction *);
+
+// A bytecode instruction decoded for the VM. The handler is looked up once, when the
+// function is first called, and the operand is stored in the form the handler uses it,
+// so running an instruction never reads Chunk.code.
+typedef struct Instruction
+{
+    InstructionHandler handler;
+    OpCode opCode;
+    union Operand
+    {
+        Value constant;
+        int slot;
+        int argumentCount;
+        StringObj *name;
+        struct FunctionObj *callee;
+        char *chars;
+        struct Instruction *target;
+        // Superinstructions pair a local slot with a constant, and the fused loop also jumps.
+        struct LocalConstant
+        {
+            int slot;
+            Value constant;
+            struct Instruction *target;
+        } local;
+    } as;
+    // Only set in traces: the instruction in the function this one was recorded from.
+    struct Instruction *exit;
+} Instruction;
+
+#endif
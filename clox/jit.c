@@ -0,0 +1,506 @@
+#include "jit.h"
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "vm.h"
+
+#ifdef JIT_AVAILABLE
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The code starts with a prologue that keeps vm in rbx and the frame's sp in r12, then
+// jumps to the requested entry. After it come a shared exit, a stub that stores r11 into
+// the frame's ip before exiting, and one template per instruction.
+//
+// Simple operations on locals, constants and numbers are written out in full. Everything
+// else calls the instruction's handler:
+//
+//   mov rdi, rbx; mov rsi, instruction; mov rax, handler; call rax
+//
+// Handlers that can move ip anywhere other than the next instruction are followed by
+//
+//   rax = vm->frames[vm->fp].ip
+//   cmp rax, target; je target's entry        (jumps only)
+//   cmp rax, instruction + 1; jne exit        (falls through to the next entry)
+//
+// Leaving by any other route sets ip first, so interpret() always carries on from the
+// right place. sp only moves on calls, and calls always leave, so r12 stays valid.
+typedef struct Assembler
+{
+    // NULL while the templates are only being measured.
+    uint8_t *code;
+    size_t count;
+    size_t exitOffset;
+    size_t storeIpOffset;
+    size_t *entryOffsets;
+} Assembler;
+
+static void emitBytes(Assembler *assembler, int length, const uint8_t *bytes)
+{
+    if (assembler->code != NULL)
+    {
+        memcpy(&assembler->code[assembler->count], bytes, length);
+    }
+    assembler->count = assembler->count + length;
+}
+
+static void emitByte(Assembler *assembler, uint8_t byte)
+{
+    emitBytes(assembler, 1, &byte);
+}
+
+static void emitInt32(Assembler *assembler, int32_t value)
+{
+    emitBytes(assembler, sizeof(value), (uint8_t *)&value);
+}
+
+static void emitInt64(Assembler *assembler, uint64_t value)
+{
+    emitBytes(assembler, sizeof(value), (uint8_t *)&value);
+}
+
+static void emitPointer(Assembler *assembler, const void *pointer)
+{
+    emitBytes(assembler, sizeof(pointer), (uint8_t *)&pointer);
+}
+
+// rel32 operands count from the end of the instruction they belong to.
+static void emitRelative(Assembler *assembler, size_t destination)
+{
+    int32_t distance = (int32_t)(destination - (assembler->count + 4));
+    emitInt32(assembler, distance);
+}
+
+static void emitJump(Assembler *assembler, size_t destination)
+{
+    emitByte(assembler, 0xe9); // jmp rel32
+    emitRelative(assembler, destination);
+}
+
+#define JE 0x84
+#define JNE 0x85
+#define JA 0x87
+
+static void emitBranch(Assembler *assembler, uint8_t condition, size_t destination)
+{
+    emitBytes(assembler, 2, (uint8_t[]){0x0f, condition}); // jcc rel32
+    emitRelative(assembler, destination);
+}
+
+// A Value is copied as two 64 bit halves.
+static uint64_t getHalf(Value value, int half)
+{
+    uint64_t bits;
+    memcpy(&bits, (uint8_t *)&value + half * sizeof(bits), sizeof(bits));
+    return bits;
+}
+
+static uint64_t getNumberBits(Value value)
+{
+    double number = unwrapNumber(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return bits;
+}
+
+static int32_t getSlotOffset(int slot)
+{
+    return slot * (int32_t)sizeof(Value);
+}
+
+#define TYPE_OFFSET ((int32_t)offsetof(Value, type))
+#define RAW_OFFSET ((int32_t)offsetof(Value, raw))
+// Offsets from the stack top of the top two values.
+#define TOP (-(int32_t)sizeof(Value))
+#define SECOND (-2 * (int32_t)sizeof(Value))
+
+static void emitLoadStackTop(Assembler *assembler)
+{
+    emitBytes(assembler, 3, (uint8_t[]){0x48, 0x8b, 0x83}); // mov rax, [rbx + stackTop]
+    emitInt32(assembler, offsetof(VirtualMachine, stackTop));
+}
+
+static void emitMoveStackTop(Assembler *assembler, int values)
+{
+    emitBytes(assembler, 3, (uint8_t[]){0x48, 0x81, values < 0 ? 0xab : 0x83}); // sub/add qword [rbx + stackTop], imm32
+    emitInt32(assembler, offsetof(VirtualMachine, stackTop));
+    emitInt32(assembler, abs(values) * (int32_t)sizeof(Value));
+}
+
+// rax = vm->frames, rcx = vm->fp * sizeof(CallFrame)
+static void emitAddressCurrentFrame(Assembler *assembler)
+{
+    emitBytes(assembler, 3, (uint8_t[]){0x48, 0x8b, 0x83}); // mov rax, [rbx + frames]
+    emitInt32(assembler, offsetof(VirtualMachine, frames));
+    emitBytes(assembler, 3, (uint8_t[]){0x48, 0x63, 0x8b}); // movsxd rcx, [rbx + fp]
+    emitInt32(assembler, offsetof(VirtualMachine, fp));
+    emitBytes(assembler, 3, (uint8_t[]){0x48, 0x69, 0xc9}); // imul rcx, rcx, sizeof(CallFrame)
+    emitInt32(assembler, sizeof(CallFrame));
+}
+
+static void emitPrologue(Assembler *assembler)
+{
+    emitByte(assembler, 0x53);                                     // push rbx
+    emitBytes(assembler, 2, (uint8_t[]){0x41, 0x54});             // push r12
+    emitBytes(assembler, 4, (uint8_t[]){0x48, 0x83, 0xec, 0x08}); // sub rsp, 8
+    emitBytes(assembler, 3, (uint8_t[]){0x48, 0x89, 0xfb});       // mov rbx, rdi
+    emitAddressCurrentFrame(assembler);
+    emitBytes(assembler, 4, (uint8_t[]){0x4c, 0x8b, 0xa4, 0x08}); // mov r12, [rax + rcx + sp]
+    emitInt32(assembler, offsetof(CallFrame, sp));
+    emitBytes(assembler, 2, (uint8_t[]){0xff, 0xe6}); // jmp rsi
+
+    assembler->exitOffset = assembler->count;
+    emitBytes(assembler, 4, (uint8_t[]){0x48, 0x83, 0xc4, 0x08}); // add rsp, 8
+    emitBytes(assembler, 2, (uint8_t[]){0x41, 0x5c});             // pop r12
+    emitByte(assembler, 0x5b);                                     // pop rbx
+    emitByte(assembler, 0xc3);                                     // ret
+
+    assembler->storeIpOffset = assembler->count;
+    emitAddressCurrentFrame(assembler);
+    emitBytes(assembler, 4, (uint8_t[]){0x4c, 0x89, 0x9c, 0x08}); // mov [rax + rcx + ip], r11
+    emitInt32(assembler, offsetof(CallFrame, ip));
+    emitJump(assembler, assembler->exitOffset);
+}
+
+static void emitLoadR11(Assembler *assembler, const void *pointer)
+{
+    emitBytes(assembler, 2, (uint8_t[]){0x49, 0xbb}); // mov r11, imm64
+    emitPointer(assembler, pointer);
+}
+
+static void emitLeaveAt(Assembler *assembler, Instruction *resumeAt)
+{
+    emitLoadR11(assembler, resumeAt);
+    emitJump(assembler, assembler->storeIpOffset);
+}
+
+// Leaves for the instruction in r11 unless the local is a number.
+static void emitGuardNumberLocal(Assembler *assembler, int slot)
+{
+    emitBytes(assembler, 4, (uint8_t[]){0x41, 0x81, 0xbc, 0x24}); // cmp dword [r12 + slot.type], imm32
+    emitInt32(assembler, getSlotOffset(slot) + TYPE_OFFSET);
+    emitInt32(assembler, VALUE_TYPE_NUMBER);
+    emitBranch(assembler, JNE, assembler->storeIpOffset);
+}
+
+// Leaves for the instruction in r11 unless the value at offset from the stack top in rax
+// is a number.
+static void emitGuardNumberOnStack(Assembler *assembler, int32_t offset)
+{
+    emitBytes(assembler, 2, (uint8_t[]){0x81, 0xb8}); // cmp dword [rax + offset.type], imm32
+    emitInt32(assembler, offset + TYPE_OFFSET);
+    emitInt32(assembler, VALUE_TYPE_NUMBER);
+    emitBranch(assembler, JNE, assembler->storeIpOffset);
+}
+
+static void emitLoadLocalNumber(Assembler *assembler, int slot)
+{
+    emitBytes(assembler, 6, (uint8_t[]){0xf2, 0x41, 0x0f, 0x10, 0x84, 0x24}); // movsd xmm0, [r12 + slot.raw]
+    emitInt32(assembler, getSlotOffset(slot) + RAW_OFFSET);
+}
+
+static void emitLoadConstantNumber(Assembler *assembler, Value constant)
+{
+    emitBytes(assembler, 2, (uint8_t[]){0x48, 0xb9}); // mov rcx, imm64
+    emitInt64(assembler, getNumberBits(constant));
+    emitBytes(assembler, 5, (uint8_t[]){0x66, 0x48, 0x0f, 0x6e, 0xc9}); // movq xmm1, rcx
+}
+
+static void emitConstant(Assembler *assembler, Value constant)
+{
+    emitLoadStackTop(assembler);
+    emitBytes(assembler, 2, (uint8_t[]){0x48, 0xb9}); // mov rcx, imm64
+    emitInt64(assembler, getHalf(constant, 0));
+    emitBytes(assembler, 3, (uint8_t[]){0x48, 0x89, 0x08}); // mov [rax], rcx
+    emitBytes(assembler, 2, (uint8_t[]){0x48, 0xb9});       // mov rcx, imm64
+    emitInt64(assembler, getHalf(constant, 1));
+    emitBytes(assembler, 4, (uint8_t[]){0x48, 0x89, 0x48, 0x08}); // mov [rax + 8], rcx
+    emitMoveStackTop(assembler, 1);
+}
+
+static void emitLocalExpression(Assembler *assembler, int slot)
+{
+    emitLoadStackTop(assembler);
+    emitBytes(assembler, 4, (uint8_t[]){0x49, 0x8b, 0x8c, 0x24}); // mov rcx, [r12 + slot]
+    emitInt32(assembler, getSlotOffset(slot));
+    emitBytes(assembler, 3, (uint8_t[]){0x48, 0x89, 0x08});       // mov [rax], rcx
+    emitBytes(assembler, 4, (uint8_t[]){0x49, 0x8b, 0x8c, 0x24}); // mov rcx, [r12 + slot + 8]
+    emitInt32(assembler, getSlotOffset(slot) + 8);
+    emitBytes(assembler, 4, (uint8_t[]){0x48, 0x89, 0x48, 0x08}); // mov [rax + 8], rcx
+    emitMoveStackTop(assembler, 1);
+}
+
+static void emitLocalAssign(Assembler *assembler, int slot)
+{
+    emitMoveStackTop(assembler, -1);
+    emitLoadStackTop(assembler);
+    emitBytes(assembler, 3, (uint8_t[]){0x48, 0x8b, 0x08});       // mov rcx, [rax]
+    emitBytes(assembler, 4, (uint8_t[]){0x49, 0x89, 0x8c, 0x24}); // mov [r12 + slot], rcx
+    emitInt32(assembler, getSlotOffset(slot));
+    emitBytes(assembler, 4, (uint8_t[]){0x48, 0x8b, 0x48, 0x08}); // mov rcx, [rax + 8]
+    emitBytes(assembler, 4, (uint8_t[]){0x49, 0x89, 0x8c, 0x24}); // mov [r12 + slot + 8], rcx
+    emitInt32(assembler, getSlotOffset(slot) + 8);
+}
+
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5c
+#define DIVSD 0x5e
+
+// Replaces the top two values (stack top in rax) with a number, like the interpreter's
+// arithmetic handlers, which do not check types either.
+static void emitNumberArithmetic(Assembler *assembler, uint8_t operation)
+{
+    emitBytes(assembler, 4, (uint8_t[]){0xf2, 0x0f, 0x10, 0x80}); // movsd xmm0, [rax + second.raw]
+    emitInt32(assembler, SECOND + RAW_OFFSET);
+    emitBytes(assembler, 4, (uint8_t[]){0xf2, 0x0f, operation, 0x80}); // op xmm0, [rax + top.raw]
+    emitInt32(assembler, TOP + RAW_OFFSET);
+    emitBytes(assembler, 4, (uint8_t[]){0xf2, 0x0f, 0x11, 0x80}); // movsd [rax + second.raw], xmm0
+    emitInt32(assembler, SECOND + RAW_OFFSET);
+    emitBytes(assembler, 2, (uint8_t[]){0xc7, 0x80}); // mov dword [rax + second.type], imm32
+    emitInt32(assembler, SECOND + TYPE_OFFSET);
+    emitInt32(assembler, VALUE_TYPE_NUMBER);
+    emitMoveStackTop(assembler, -1);
+}
+
+static void emitLessThan(Assembler *assembler)
+{
+    emitLoadStackTop(assembler);
+    emitBytes(assembler, 4, (uint8_t[]){0xf2, 0x0f, 0x10, 0x80}); // movsd xmm0, [rax + top.raw]
+    emitInt32(assembler, TOP + RAW_OFFSET);
+    emitBytes(assembler, 4, (uint8_t[]){0x66, 0x0f, 0x2e, 0x80}); // ucomisd xmm0, [rax + second.raw]
+    emitInt32(assembler, SECOND + RAW_OFFSET);
+    emitBytes(assembler, 2, (uint8_t[]){0xc7, 0x80}); // mov dword [rax + second.type], imm32
+    emitInt32(assembler, SECOND + TYPE_OFFSET);
+    emitInt32(assembler, VALUE_TYPE_BOOL);
+    emitBytes(assembler, 3, (uint8_t[]){0x0f, 0x97, 0x80}); // seta byte [rax + second.raw]
+    emitInt32(assembler, SECOND + RAW_OFFSET);
+    emitMoveStackTop(assembler, -1);
+}
+
+static void emitGuardNumberAdd(Assembler *assembler, Instruction *instruction)
+{
+    emitLoadR11(assembler, instruction->exit);
+    emitLoadStackTop(assembler);
+    emitGuardNumberOnStack(assembler, SECOND);
+    emitGuardNumberOnStack(assembler, TOP);
+    emitNumberArithmetic(assembler, ADDSD);
+}
+
+static void emitGuardNumberLocalArithmetic(Assembler *assembler, Instruction *instruction)
+{
+    int slot = instruction->as.local.slot;
+    emitLoadR11(assembler, instruction->exit);
+    emitGuardNumberLocal(assembler, slot);
+    emitLoadLocalNumber(assembler, slot);
+    emitLoadConstantNumber(assembler, instruction->as.local.constant);
+    emitBytes(assembler, 4, (uint8_t[]){0xf2, 0x0f, 0x58, 0xc1}); // addsd xmm0, xmm1
+
+    if (instruction->opCode == OP_GUARD_NUMBER_LOCAL_INCREMENT)
+    {
+        emitBytes(assembler, 6, (uint8_t[]){0xf2, 0x41, 0x0f, 0x11, 0x84, 0x24}); // movsd [r12 + slot.raw], xmm0
+        emitInt32(assembler, getSlotOffset(slot) + RAW_OFFSET);
+        return;
+    }
+
+    emitLoadStackTop(assembler);
+    emitBytes(assembler, 4, (uint8_t[]){0xf2, 0x0f, 0x11, 0x80}); // movsd [rax + raw], xmm0
+    emitInt32(assembler, RAW_OFFSET);
+    emitBytes(assembler, 2, (uint8_t[]){0xc7, 0x80}); // mov dword [rax + type], imm32
+    emitInt32(assembler, TYPE_OFFSET);
+    emitInt32(assembler, VALUE_TYPE_NUMBER);
+    emitMoveStackTop(assembler, 1);
+}
+
+// A trace closed by the fused local < constant back-edge loops without leaving native code.
+static void emitTraceLoop(Assembler *assembler, Instruction *instruction, size_t startOffset)
+{
+    Instruction *backEdge = instruction->exit;
+    emitLoadLocalNumber(assembler, backEdge->as.local.slot);
+    emitLoadConstantNumber(assembler, backEdge->as.local.constant);
+    emitBytes(assembler, 4, (uint8_t[]){0x66, 0x0f, 0x2e, 0xc8}); // ucomisd xmm1, xmm0
+    emitBranch(assembler, JA, startOffset);
+    emitLeaveAt(assembler, backEdge + 1);
+}
+
+static bool emitInline(Assembler *assembler, Instruction *instruction, Instruction *first)
+{
+    OpCode opCode = instruction->opCode;
+    if (opCode == OP_CONSTANT || opCode == OP_CONSTANT_LONG)
+    {
+        emitConstant(assembler, instruction->as.constant);
+    }
+    else if (opCode == OP_VAR_EXPRESSION || opCode == OP_VAR_EXPRESSION_LONG)
+    {
+        emitLocalExpression(assembler, instruction->as.slot);
+    }
+    else if (opCode == OP_VAR_ASSIGN || opCode == OP_VAR_ASSIGN_LONG)
+    {
+        emitLocalAssign(assembler, instruction->as.slot);
+    }
+    else if (opCode == OP_POP)
+    {
+        emitMoveStackTop(assembler, -1);
+    }
+    else if (opCode == OP_SUB || opCode == OP_MULT || opCode == OP_DIV)
+    {
+        emitLoadStackTop(assembler);
+        emitNumberArithmetic(assembler, opCode == OP_SUB ? SUBSD : opCode == OP_MULT ? MULSD : DIVSD);
+    }
+    else if (opCode == OP_LESS_THAN)
+    {
+        emitLessThan(assembler);
+    }
+    else if (opCode == OP_GUARD_NUMBER_ADD)
+    {
+        emitGuardNumberAdd(assembler, instruction);
+    }
+    else if (opCode == OP_GUARD_NUMBER_LOCAL_ADD_CONSTANT || opCode == OP_GUARD_NUMBER_LOCAL_INCREMENT)
+    {
+        emitGuardNumberLocalArithmetic(assembler, instruction);
+    }
+    else if (opCode == OP_TRACE_LOOP && instruction->exit->opCode == OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT)
+    {
+        emitTraceLoop(assembler, instruction, assembler->entryOffsets[instruction->as.target - first]);
+    }
+    else if (opCode == OP_RETURN)
+    {
+        // interpret() runs the return itself, it has to see the script's last one.
+        emitLeaveAt(assembler, instruction);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static Instruction *getJumpTarget(Instruction *instruction)
+{
+    if (instruction->opCode == OP_TRACE_LOOP)
+    {
+        return instruction->as.target;
+    }
+    else if (instruction->opCode == OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT)
+    {
+        return instruction->as.local.target;
+    }
+    else if (isJumpOpCode(instruction->opCode))
+    {
+        return instruction->as.target;
+    }
+    return NULL;
+}
+
+static bool canLeaveStraightLine(Instruction *instruction)
+{
+    return getJumpTarget(instruction) != NULL || isCallOpCode(instruction->opCode) || instruction->opCode == OP_GUARD_BRANCH;
+}
+
+static void emitCallHandler(Assembler *assembler, Instruction *instruction, Instruction *first)
+{
+    emitBytes(assembler, 3, (uint8_t[]){0x48, 0x89, 0xdf}); // mov rdi, rbx
+    emitBytes(assembler, 2, (uint8_t[]){0x48, 0xbe});       // mov rsi, imm64
+    emitPointer(assembler, instruction);
+    emitBytes(assembler, 2, (uint8_t[]){0x48, 0xb8}); // mov rax, imm64
+    emitPointer(assembler, (void *)instruction->handler);
+    emitBytes(assembler, 2, (uint8_t[]){0xff, 0xd0}); // call rax
+
+    if (!canLeaveStraightLine(instruction))
+    {
+        return;
+    }
+
+    emitAddressCurrentFrame(assembler);
+    emitBytes(assembler, 4, (uint8_t[]){0x48, 0x8b, 0x84, 0x08}); // mov rax, [rax + rcx + ip]
+    emitInt32(assembler, offsetof(CallFrame, ip));
+
+    Instruction *target = getJumpTarget(instruction);
+    if (target != NULL)
+    {
+        emitLoadR11(assembler, target);
+        emitBytes(assembler, 3, (uint8_t[]){0x4c, 0x39, 0xd8}); // cmp rax, r11
+        emitBranch(assembler, JE, assembler->entryOffsets[target - first]);
+    }
+    emitLoadR11(assembler, instruction + 1);
+    emitBytes(assembler, 3, (uint8_t[]){0x4c, 0x39, 0xd8}); // cmp rax, r11
+    emitBranch(assembler, JNE, assembler->exitOffset);
+}
+
+static void emitAll(Assembler *assembler, Instruction *instructions, int count)
+{
+    assembler->count = 0;
+    emitPrologue(assembler);
+    for (int i = 0; i < count; i++)
+    {
+        Instruction *instruction = &instructions[i];
+        assembler->entryOffsets[i] = assembler->count;
+        if (!emitInline(assembler, instruction, instructions))
+        {
+            emitCallHandler(assembler, instruction, instructions);
+        }
+    }
+    // Functions end on OP_RETURN and traces on OP_TRACE_LOOP, so this is never reached.
+    emitJump(assembler, assembler->exitOffset);
+}
+
+NativeCode *compileToNative(Instruction *instructions, int count)
+{
+    // The first pass only measures, so the second knows every entry it may jump forward to.
+    Assembler assembler;
+    assembler.code = NULL;
+    assembler.entryOffsets = calloc(count, sizeof(size_t));
+    emitAll(&assembler, instructions, count);
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t mappedSize = (assembler.count + pageSize - 1) / pageSize * pageSize;
+    uint8_t *code = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+    {
+        free(assembler.entryOffsets);
+        return NULL;
+    }
+
+    assembler.code = code;
+    emitAll(&assembler, instructions, count);
+    mprotect(code, mappedSize, PROT_READ | PROT_EXEC);
+
+    NativeCode *native = malloc(sizeof(NativeCode));
+    native->code = code;
+    native->size = mappedSize;
+    native->length = assembler.count;
+    native->entryOffsets = assembler.entryOffsets;
+    return native;
+}
+
+void runNativeCode(NativeCode *native, VirtualMachine *vm, int instructionIndex)
+{
+    void (*enter)(VirtualMachine *, uint8_t *) = (void (*)(VirtualMachine *, uint8_t *))native->code;
+    enter(vm, native->code + native->entryOffsets[instructionIndex]);
+}
+
+void freeNativeCode(NativeCode *native)
+{
+    if (native == NULL)
+    {
+        return;
+    }
+
+    munmap(native->code, native->size);
+    free(native->entryOffsets);
+    free(native);
+}
+#else
+NativeCode *compileToNative(Instruction *instructions, int count)
+{
+    return NULL;
+}
+
+void runNativeCode(NativeCode *native, VirtualMachine *vm, int instructionIndex)
+{
+}
+
+void freeNativeCode(NativeCode *native)
+{
+}
+#endif
@@ -0,0 +1,35 @@
+#ifndef JIT_HEADER
+#define JIT_HEADER
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "functionobj.h"
+
+// The baseline JIT only knows how to write x86-64 code into Linux mappings. Anywhere
+// else compileToNative() returns NULL and functions stay interpreted.
+#if defined(__linux__) && defined(__x86_64__)
+#define JIT_AVAILABLE
+#endif
+
+struct VirtualMachine;
+
+// Machine code for a function's decoded instructions or for a trace. Every instruction
+// has an entry point. Simple instructions are written out in full and the rest call their
+// handler. The code keeps going while ip stays on an instruction it has code for that
+// follows or is jumped to; anything else (calls, returns, failed guards, errors) hands
+// control back to the interpreter.
+typedef struct NativeCode
+{
+    uint8_t *code;
+    // Bytes mapped, and how many of them hold code.
+    size_t size;
+    size_t length;
+    size_t *entryOffsets;
+} NativeCode;
+
+NativeCode *compileToNative(Instruction *instructions, int count);
+void runNativeCode(NativeCode *native, struct VirtualMachine *vm, int instructionIndex);
+void freeNativeCode(NativeCode *native);
+
+#endif
@@ -1,5 +1,202 @@
 #include <stdio.h>
-int main() {
-    printf("Hello, World!");
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "aot.h"
+#include "compiler.h"
+#include "perfmap.h"
+#include "profiler.h"
+
+#define DEFAULT_SAMPLES_PER_SECOND 1000
+#define SAMPLE_CAPACITY 65536
+
+static void printError(char *message)
+{
+    fprintf(stderr, "%s\n", message);
+    free(message);
+}
+
+static char *readFile(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char *contents = malloc(size + 1);
+    size_t read = fread(contents, sizeof(char), size, file);
+    contents[read] = '\0';
+    fclose(file);
+    return contents;
+}
+
+// Writes the script out as C instead of running it.
+static int emitC(FunctionObj *script, const char *path)
+{
+    char *program = compileToC(script);
+    if (program == NULL)
+    {
+        fprintf(stderr, "The script has an instruction with no C translation.\n");
+        return 70;
+    }
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not write %s.\n", path);
+        free(program);
+        return 74;
+    }
+    fputs(program, file);
+    free(program);
+    if (fclose(file) != 0)
+    {
+        fprintf(stderr, "Could not write %s.\n", path);
+        return 74;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// --perf-map's jitdump directory is optional, so the argument after it is only taken
+// for one when it names a directory.
+static bool isDirectory(const char *path)
+{
+    struct stat status;
+    return stat(path, &status) == 0 && S_ISDIR(status.st_mode);
+}
+
+static void printUsage()
+{
+    fprintf(stderr, "Usage: clox [--emit-c <out.c>] [--folded-stacks <file>] [--profile-report <file>] [--samples-per-second <n>] [--perf-map [jitdump-dir]] <script>\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *emitCPath = NULL;
+    const char *foldedStacksPath = NULL;
+    const char *profileReportPath = NULL;
+    bool usePerfMap = false;
+    const char *jitdumpDirectory = NULL;
+    int samplesPerSecond = DEFAULT_SAMPLES_PER_SECOND;
+    const char *scriptPath = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc)
+        {
+            emitCPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--folded-stacks") == 0 && i + 1 < argc)
+        {
+            foldedStacksPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile-report") == 0 && i + 1 < argc)
+        {
+            profileReportPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--samples-per-second") == 0 && i + 1 < argc)
+        {
+            samplesPerSecond = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--perf-map") == 0)
+        {
+            usePerfMap = true;
+            if (i + 1 < argc && isDirectory(argv[i + 1]))
+            {
+                jitdumpDirectory = argv[++i];
+            }
+        }
+        else if (scriptPath == NULL && argv[i][0] != '-')
+        {
+            scriptPath = argv[i];
+        }
+        else
+        {
+            printUsage();
+            return 64;
+        }
+    }
+
+    if (scriptPath == NULL)
+    {
+        printUsage();
+        return 64;
+    }
+
+    char *source = readFile(scriptPath);
+    if (source == NULL)
+    {
+        fprintf(stderr, "Could not read %s.\n", scriptPath);
+        return 74;
+    }
+
+    // Samples point at the functions they caught, and the exit hook reads them after
+    // main returns, so everything they can reach is static and never freed.
+    static VirtualMachine vm;
+    static FunctionObj script;
+    static SamplingProfiler profiler;
+    static PerfMap perfMap;
+    static OutputSink output;
+
+    initVirtualMachine(&vm);
+    initOutputSink(&output, STDOUT_FILENO, OUTPUT_SINK_DEFAULT_CAPACITY);
+    vm.output = &output;
+    vm.onStdErr = printError;
+
+    initFunctionObj(&script);
+    TokenArrayIterator tokens = tokenize(source);
+    compile(&script, &tokens);
+
+    if (emitCPath != NULL)
+    {
+        int status = emitC(&script, emitCPath);
+        free(source);
+        return status;
+    }
+
+    if (foldedStacksPath != NULL || profileReportPath != NULL)
+    {
+        initSamplingProfiler(&profiler, &vm, SAMPLE_CAPACITY);
+        bool isSampling = startSamplingProfiler(&profiler, samplesPerSecond);
+        if (isSampling && foldedStacksPath != NULL)
+        {
+            isSampling = writeFoldedStacksAtExit(&profiler, foldedStacksPath);
+        }
+        if (isSampling && profileReportPath != NULL)
+        {
+            isSampling = writeSamplingProfileAtExit(&profiler, profileReportPath);
+        }
+        if (!isSampling)
+        {
+            fprintf(stderr, "Sampling is not available here.\n");
+            return 70;
+        }
+    }
+
+    if (usePerfMap)
+    {
+        if (!openPerfMap(&perfMap, jitdumpDirectory))
+        {
+            fprintf(stderr, "Could not start a perf map.\n");
+            return 70;
+        }
+        vm.perfMap = &perfMap;
+    }
+
+    if (prepareForCall(&vm, &script) != NULL)
+    {
+        interpret(&vm);
+    }
+    if (usePerfMap)
+    {
+        closePerfMap(&perfMap);
+    }
+    free(source);
+    return 0;
+}
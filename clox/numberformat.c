@@ -0,0 +1,405 @@
+#include "numberformat.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Grisu2, from Loitsch's "Printing Floating-Point Numbers Quickly and Accurately with
+// Integers". A double is scaled by a cached power of ten into a 64 bit fixed point number
+// whose digits can be produced with integer arithmetic alone.
+
+#define SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define HIDDEN_BIT 0x0010000000000000ULL
+#define EXPONENT_BIAS (0x3FF + 52)
+
+typedef struct DiyFp
+{
+    uint64_t f;
+    int e;
+} DiyFp;
+
+// 10^k for k from -348 to 340 in steps of 8, normalized and rounded to 64 bits.
+static const DiyFp cachedPowers[] = {
+    {0xFA8FD5A0081C0288ULL, -1220},
+    {0xBAAEE17FA23EBF76ULL, -1193},
+    {0x8B16FB203055AC76ULL, -1166},
+    {0xCF42894A5DCE35EAULL, -1140},
+    {0x9A6BB0AA55653B2DULL, -1113},
+    {0xE61ACF033D1A45DFULL, -1087},
+    {0xAB70FE17C79AC6CAULL, -1060},
+    {0xFF77B1FCBEBCDC4FULL, -1034},
+    {0xBE5691EF416BD60CULL, -1007},
+    {0x8DD01FAD907FFC3CULL, -980},
+    {0xD3515C2831559A83ULL, -954},
+    {0x9D71AC8FADA6C9B5ULL, -927},
+    {0xEA9C227723EE8BCBULL, -901},
+    {0xAECC49914078536DULL, -874},
+    {0x823C12795DB6CE57ULL, -847},
+    {0xC21094364DFB5637ULL, -821},
+    {0x9096EA6F3848984FULL, -794},
+    {0xD77485CB25823AC7ULL, -768},
+    {0xA086CFCD97BF97F4ULL, -741},
+    {0xEF340A98172AACE5ULL, -715},
+    {0xB23867FB2A35B28EULL, -688},
+    {0x84C8D4DFD2C63F3BULL, -661},
+    {0xC5DD44271AD3CDBAULL, -635},
+    {0x936B9FCEBB25C996ULL, -608},
+    {0xDBAC6C247D62A584ULL, -582},
+    {0xA3AB66580D5FDAF6ULL, -555},
+    {0xF3E2F893DEC3F126ULL, -529},
+    {0xB5B5ADA8AAFF80B8ULL, -502},
+    {0x87625F056C7C4A8BULL, -475},
+    {0xC9BCFF6034C13053ULL, -449},
+    {0x964E858C91BA2655ULL, -422},
+    {0xDFF9772470297EBDULL, -396},
+    {0xA6DFBD9FB8E5B88FULL, -369},
+    {0xF8A95FCF88747D94ULL, -343},
+    {0xB94470938FA89BCFULL, -316},
+    {0x8A08F0F8BF0F156BULL, -289},
+    {0xCDB02555653131B6ULL, -263},
+    {0x993FE2C6D07B7FACULL, -236},
+    {0xE45C10C42A2B3B06ULL, -210},
+    {0xAA242499697392D3ULL, -183},
+    {0xFD87B5F28300CA0EULL, -157},
+    {0xBCE5086492111AEBULL, -130},
+    {0x8CBCCC096F5088CCULL, -103},
+    {0xD1B71758E219652CULL, -77},
+    {0x9C40000000000000ULL, -50},
+    {0xE8D4A51000000000ULL, -24},
+    {0xAD78EBC5AC620000ULL, 3},
+    {0x813F3978F8940984ULL, 30},
+    {0xC097CE7BC90715B3ULL, 56},
+    {0x8F7E32CE7BEA5C70ULL, 83},
+    {0xD5D238A4ABE98068ULL, 109},
+    {0x9F4F2726179A2245ULL, 136},
+    {0xED63A231D4C4FB27ULL, 162},
+    {0xB0DE65388CC8ADA8ULL, 189},
+    {0x83C7088E1AAB65DBULL, 216},
+    {0xC45D1DF942711D9AULL, 242},
+    {0x924D692CA61BE758ULL, 269},
+    {0xDA01EE641A708DEAULL, 295},
+    {0xA26DA3999AEF774AULL, 322},
+    {0xF209787BB47D6B85ULL, 348},
+    {0xB454E4A179DD1877ULL, 375},
+    {0x865B86925B9BC5C2ULL, 402},
+    {0xC83553C5C8965D3DULL, 428},
+    {0x952AB45CFA97A0B3ULL, 455},
+    {0xDE469FBD99A05FE3ULL, 481},
+    {0xA59BC234DB398C25ULL, 508},
+    {0xF6C69A72A3989F5CULL, 534},
+    {0xB7DCBF5354E9BECEULL, 561},
+    {0x88FCF317F22241E2ULL, 588},
+    {0xCC20CE9BD35C78A5ULL, 614},
+    {0x98165AF37B2153DFULL, 641},
+    {0xE2A0B5DC971F303AULL, 667},
+    {0xA8D9D1535CE3B396ULL, 694},
+    {0xFB9B7CD9A4A7443CULL, 720},
+    {0xBB764C4CA7A44410ULL, 747},
+    {0x8BAB8EEFB6409C1AULL, 774},
+    {0xD01FEF10A657842CULL, 800},
+    {0x9B10A4E5E9913129ULL, 827},
+    {0xE7109BFBA19C0C9DULL, 853},
+    {0xAC2820D9623BF429ULL, 880},
+    {0x80444B5E7AA7CF85ULL, 907},
+    {0xBF21E44003ACDD2DULL, 933},
+    {0x8E679C2F5E44FF8FULL, 960},
+    {0xD433179D9C8CB841ULL, 986},
+    {0x9E19DB92B4E31BA9ULL, 1013},
+    {0xEB96BF6EBADF77D9ULL, 1039},
+    {0xAF87023B9BF0EE6BULL, 1066},
+};
+
+static const uint64_t powersOfTen[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+    1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+    1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+static DiyFp makeDiyFp(uint64_t f, int e)
+{
+    DiyFp diyFp = {f, e};
+    return diyFp;
+}
+
+static DiyFp fromDouble(double number)
+{
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    int biasedExponent = (int)((bits >> 52) & 0x7FF);
+    uint64_t significand = bits & SIGNIFICAND_MASK;
+    if (biasedExponent == 0)
+    {
+        return makeDiyFp(significand, 1 - EXPONENT_BIAS);
+    }
+    return makeDiyFp(significand + HIDDEN_BIT, biasedExponent - EXPONENT_BIAS);
+}
+
+// The high 64 bits of the product, rounded.
+static DiyFp multiply(DiyFp a, DiyFp b)
+{
+    uint64_t aHigh = a.f >> 32;
+    uint64_t aLow = a.f & 0xFFFFFFFF;
+    uint64_t bHigh = b.f >> 32;
+    uint64_t bLow = b.f & 0xFFFFFFFF;
+    uint64_t highHigh = aHigh * bHigh;
+    uint64_t lowHigh = aLow * bHigh;
+    uint64_t highLow = aHigh * bLow;
+    uint64_t lowLow = aLow * bLow;
+    uint64_t middle = (lowLow >> 32) + (highLow & 0xFFFFFFFF) + (lowHigh & 0xFFFFFFFF) + (1ULL << 31);
+    return makeDiyFp(highHigh + (highLow >> 32) + (lowHigh >> 32) + (middle >> 32), a.e + b.e + 64);
+}
+
+static DiyFp normalize(DiyFp diyFp)
+{
+    while ((diyFp.f & (1ULL << 63)) == 0)
+    {
+        diyFp.f <<= 1;
+        diyFp.e--;
+    }
+    return diyFp;
+}
+
+// The points halfway to the doubles either side, which bound the digits that still read
+// back as this one.
+static void getBoundaries(DiyFp value, DiyFp *minus, DiyFp *plus)
+{
+    *plus = normalize(makeDiyFp((value.f << 1) + 1, value.e - 1));
+    if (value.f == HIDDEN_BIT)
+    {
+        // The double below a power of two is half as far away.
+        *minus = makeDiyFp((value.f << 2) - 1, value.e - 2);
+    }
+    else
+    {
+        *minus = makeDiyFp((value.f << 1) - 1, value.e - 1);
+    }
+    minus->f <<= minus->e - plus->e;
+    minus->e = plus->e;
+}
+
+// A power of ten that brings a number with binary exponent e into the range the digit
+// loop works in. decimalExponent is set to minus its exponent.
+static DiyFp getCachedPower(int e, int *decimalExponent)
+{
+    double estimate = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)estimate;
+    if (estimate - k > 0.0)
+    {
+        k++;
+    }
+    int index = (k >> 3) + 1;
+    *decimalExponent = -(-348 + index * 8);
+    return cachedPowers[index];
+}
+
+// Nudges the last digit down while that brings it closer to the exact value and stays
+// within the boundaries.
+static void roundLastDigit(char *digits, int length, uint64_t delta, uint64_t rest, uint64_t tenKappa, uint64_t distance)
+{
+    while (rest < distance && delta - rest >= tenKappa &&
+           (rest + tenKappa < distance || distance - rest > rest + tenKappa - distance))
+    {
+        digits[length - 1]--;
+        rest += tenKappa;
+    }
+}
+
+static int countDigits(uint32_t number)
+{
+    int count = 1;
+    while (count < 10 && number >= powersOfTen[count])
+    {
+        count++;
+    }
+    return count;
+}
+
+// Produces digits of high until what is left of it fits within delta, so any more would
+// not be needed to tell the double apart from its neighbours.
+static int generateDigits(DiyFp scaled, DiyFp high, uint64_t delta, char *digits, int *decimalExponent)
+{
+    DiyFp one = makeDiyFp(1ULL << -high.e, high.e);
+    uint64_t distance = high.f - scaled.f;
+    uint32_t integral = (uint32_t)(high.f >> -one.e);
+    uint64_t fraction = high.f & (one.f - 1);
+    int kappa = countDigits(integral);
+    int length = 0;
+
+    while (kappa > 0)
+    {
+        uint32_t divisor = (uint32_t)powersOfTen[kappa - 1];
+        uint32_t digit = integral / divisor;
+        integral %= divisor;
+        if (digit != 0 || length != 0)
+        {
+            digits[length++] = (char)('0' + digit);
+        }
+        kappa--;
+
+        uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+        if (rest <= delta)
+        {
+            *decimalExponent += kappa;
+            roundLastDigit(digits, length, delta, rest, powersOfTen[kappa] << -one.e, distance);
+            return length;
+        }
+    }
+
+    for (;;)
+    {
+        fraction *= 10;
+        delta *= 10;
+        char digit = (char)(fraction >> -one.e);
+        if (digit != 0 || length != 0)
+        {
+            digits[length++] = (char)('0' + digit);
+        }
+        fraction &= one.f - 1;
+        kappa--;
+        if (fraction < delta)
+        {
+            *decimalExponent += kappa;
+            int index = -kappa;
+            roundLastDigit(digits, length, delta, fraction, one.f, index < 20 ? distance * powersOfTen[index] : 0);
+            return length;
+        }
+    }
+}
+
+// Digits for a positive, finite number, which is digits * 10^decimalExponent.
+static int grisu2(double number, char *digits, int *decimalExponent)
+{
+    DiyFp value = fromDouble(number);
+    DiyFp minus;
+    DiyFp plus;
+    getBoundaries(value, &minus, &plus);
+
+    DiyFp power = getCachedPower(plus.e, decimalExponent);
+    DiyFp scaled = multiply(normalize(value), power);
+    DiyFp high = multiply(plus, power);
+    DiyFp low = multiply(minus, power);
+    // The products are only accurate to a unit either way, so stay inside them.
+    high.f--;
+    low.f++;
+    return generateDigits(scaled, high, high.f - low.f, digits, decimalExponent);
+}
+
+static int writeExponent(char *buffer, int exponent)
+{
+    int length = 0;
+    buffer[length++] = 'e';
+    buffer[length++] = exponent < 0 ? '-' : '+';
+    if (exponent < 0)
+    {
+        exponent = -exponent;
+    }
+    if (exponent >= 100)
+    {
+        buffer[length++] = (char)('0' + exponent / 100);
+    }
+    if (exponent >= 10)
+    {
+        buffer[length++] = (char)('0' + exponent / 10 % 10);
+    }
+    buffer[length++] = (char)('0' + exponent % 10);
+    return length;
+}
+
+// Places the decimal point in digits * 10^decimalExponent.
+static int layOutDigits(const char *digits, int digitCount, int decimalExponent, char *buffer)
+{
+    // How many of the digits come before the point.
+    int pointAt = digitCount + decimalExponent;
+    int length = 0;
+
+    if (digitCount <= pointAt && pointAt <= 21)
+    {
+        memcpy(buffer, digits, digitCount);
+        length = digitCount;
+        while (length < pointAt)
+        {
+            buffer[length++] = '0';
+        }
+    }
+    else if (0 < pointAt && pointAt <= 21)
+    {
+        memcpy(buffer, digits, pointAt);
+        buffer[pointAt] = '.';
+        memcpy(buffer + pointAt + 1, digits + pointAt, digitCount - pointAt);
+        length = digitCount + 1;
+    }
+    else if (-6 < pointAt && pointAt <= 0)
+    {
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        while (length < 2 - pointAt)
+        {
+            buffer[length++] = '0';
+        }
+        memcpy(buffer + length, digits, digitCount);
+        length += digitCount;
+    }
+    else
+    {
+        buffer[length++] = digits[0];
+        if (digitCount > 1)
+        {
+            buffer[length++] = '.';
+            memcpy(buffer + length, digits + 1, digitCount - 1);
+            length += digitCount - 1;
+        }
+        length += writeExponent(buffer + length, pointAt - 1);
+    }
+    return length;
+}
+
+static int formatWholeNumber(uint64_t number, char *buffer)
+{
+    char reversed[20];
+    int count = 0;
+    do
+    {
+        reversed[count++] = (char)('0' + number % 10);
+        number /= 10;
+    } while (number != 0);
+
+    for (int i = 0; i < count; i++)
+    {
+        buffer[i] = reversed[count - 1 - i];
+    }
+    return count;
+}
+
+int formatNumber(double number, char *buffer)
+{
+    if (isnan(number))
+    {
+        return snprintf(buffer, NUMBER_BUFFER_SIZE, "nan");
+    }
+
+    int length = 0;
+    if (signbit(number))
+    {
+        buffer[length++] = '-';
+        number = -number;
+    }
+
+    if (isinf(number))
+    {
+        length += snprintf(buffer + length, NUMBER_BUFFER_SIZE - length, "inf");
+    }
+    else if (number < 9007199254740992.0 && number == (double)(uint64_t)number)
+    {
+        length += formatWholeNumber((uint64_t)number, buffer + length);
+    }
+    else
+    {
+        char digits[20];
+        int decimalExponent;
+        int digitCount = grisu2(number, digits, &decimalExponent);
+        length += layOutDigits(digits, digitCount, decimalExponent, buffer + length);
+    }
+    buffer[length] = '\0';
+    return length;
+}
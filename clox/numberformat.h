@@ -0,0 +1,22 @@
+#ifndef NUMBER_FORMAT_HEADER
+#define NUMBER_FORMAT_HEADER
+
+typedef enum NumberFormat
+{
+    // printf's %f, what print showed before shortest became the default: 8.000000, 0.100000.
+    NUMBER_FORMAT_FIXED,
+    // The fewest digits that read back as the same double: 8, 0.1, 1e+21.
+    NUMBER_FORMAT_SHORTEST
+} NumberFormat;
+
+// Long enough for any number formatNumber() writes, and its NUL.
+#define NUMBER_BUFFER_SIZE 32
+
+// Writes number the NUMBER_FORMAT_SHORTEST way into buffer, which must hold
+// NUMBER_BUFFER_SIZE chars, and returns its length. Whole numbers below 2^53 take a fast
+// path; others go through Grisu2, which always reads back as the same double and is the
+// shortest that does in all but a few cases. Exponents are used outside 1e-7 to 1e21, the
+// way JavaScript does.
+int formatNumber(double number, char *buffer);
+
+#endif
@@ -6,6 +6,8 @@ typedef enum ObjType {
     ObjFunction
 } ObjType;
 
+#define OBJ_TYPE_COUNT (ObjFunction + 1)
+
 typedef struct Obj {
     ObjType type;
 } Obj;
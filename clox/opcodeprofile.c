@@ -0,0 +1,205 @@
+#include "opcodeprofile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "textbuffer.h"
+
+static const char *shapeNames[OPERAND_SHAPE_COUNT] = {
+    [VALUE_TYPE_BOOL] = "bool",
+    [VALUE_TYPE_NUMBER] = "number",
+    [VALUE_TYPE_OBJECT] = "object",
+    [VALUE_TYPE_NIL] = "nil",
+    [OPERAND_NONE] = "none",
+};
+
+// A pair or triple of opcodes that could become one superinstruction.
+typedef struct Candidate
+{
+    OpCode opCodes[3];
+    int length;
+    uint64_t count;
+    uint64_t savedDispatches;
+} Candidate;
+
+void initOpcodeProfile(OpcodeProfile *profile)
+{
+    memset(profile->counts, 0, sizeof(profile->counts));
+    memset(profile->bigrams, 0, sizeof(profile->bigrams));
+    memset(profile->shapes, 0, sizeof(profile->shapes));
+    profile->trigrams = calloc(OP_CODE_COUNT * OP_CODE_COUNT * OP_CODE_COUNT, sizeof(uint64_t));
+    breakInstructionSequence(profile);
+}
+
+void freeOpcodeProfile(OpcodeProfile *profile)
+{
+    free(profile->trigrams);
+    profile->trigrams = NULL;
+}
+
+static uint64_t *getTrigram(OpcodeProfile *profile, OpCode first, OpCode second, OpCode third)
+{
+    return &profile->trigrams[(first * OP_CODE_COUNT + second) * OP_CODE_COUNT + third];
+}
+
+uint64_t getTrigramCount(OpcodeProfile *profile, OpCode first, OpCode second, OpCode third)
+{
+    return *getTrigram(profile, first, second, third);
+}
+
+void recordInstruction(OpcodeProfile *profile, Instruction *instruction, int operandShape)
+{
+    profile->counts[instruction->opCode]++;
+    profile->shapes[instruction->opCode][operandShape]++;
+
+    if (profile->previous != NULL && profile->previous + 1 == instruction)
+    {
+        profile->bigrams[profile->previous->opCode][instruction->opCode]++;
+        if (profile->beforePrevious != NULL && profile->beforePrevious + 1 == profile->previous)
+        {
+            (*getTrigram(profile, profile->beforePrevious->opCode, profile->previous->opCode, instruction->opCode))++;
+        }
+        profile->beforePrevious = profile->previous;
+    }
+    else
+    {
+        profile->beforePrevious = NULL;
+    }
+    profile->previous = instruction;
+}
+
+void breakInstructionSequence(OpcodeProfile *profile)
+{
+    profile->previous = NULL;
+    profile->beforePrevious = NULL;
+}
+
+// Most dispatches saved first. Ties go to the longer sequence, then to opcode order, so
+// the ranking does not depend on the sort.
+static int compareCandidates(const void *leftPointer, const void *rightPointer)
+{
+    const Candidate *left = leftPointer;
+    const Candidate *right = rightPointer;
+    if (left->savedDispatches != right->savedDispatches)
+    {
+        return left->savedDispatches < right->savedDispatches ? 1 : -1;
+    }
+    if (left->length != right->length)
+    {
+        return right->length - left->length;
+    }
+    for (int i = 0; i < left->length; i++)
+    {
+        if (left->opCodes[i] != right->opCodes[i])
+        {
+            return (int)left->opCodes[i] - (int)right->opCodes[i];
+        }
+    }
+    return 0;
+}
+
+static void addCandidate(Candidate *candidates, int *count, OpCode *opCodes, int length, uint64_t executed)
+{
+    if (executed == 0)
+    {
+        return;
+    }
+
+    Candidate *candidate = &candidates[(*count)++];
+    memcpy(candidate->opCodes, opCodes, sizeof(OpCode) * length);
+    candidate->length = length;
+    candidate->count = executed;
+    // Fusing n instructions into one saves n - 1 dispatches every time the sequence runs.
+    candidate->savedDispatches = executed * (length - 1);
+}
+
+static int collectCandidates(OpcodeProfile *profile, Candidate *candidates)
+{
+    int count = 0;
+    for (int first = 0; first < OP_CODE_COUNT; first++)
+    {
+        for (int second = 0; second < OP_CODE_COUNT; second++)
+        {
+            OpCode pair[] = {first, second};
+            addCandidate(candidates, &count, pair, 2, profile->bigrams[first][second]);
+            if (profile->bigrams[first][second] == 0)
+            {
+                continue;
+            }
+
+            for (int third = 0; third < OP_CODE_COUNT; third++)
+            {
+                OpCode triple[] = {first, second, third};
+                addCandidate(candidates, &count, triple, 3, getTrigramCount(profile, first, second, third));
+            }
+        }
+    }
+    return count;
+}
+
+static void reportCandidates(OpcodeProfile *profile, uint64_t dispatches, int limit, void (*callback)(char *line))
+{
+    // Every pair or triple counted has a pair counted for its first two instructions, so
+    // there are at most OP_CODE_COUNT candidates for each pair.
+    int pairCount = 0;
+    for (int first = 0; first < OP_CODE_COUNT; first++)
+    {
+        for (int second = 0; second < OP_CODE_COUNT; second++)
+        {
+            pairCount += profile->bigrams[first][second] != 0;
+        }
+    }
+    Candidate *candidates = malloc(sizeof(Candidate) * (pairCount * (OP_CODE_COUNT + 1) + 1));
+    int count = collectCandidates(profile, candidates);
+    qsort(candidates, count, sizeof(Candidate), compareCandidates);
+
+    reportLine(callback, "=== superinstruction candidates ===\n");
+    for (int i = 0; i < count && i < limit; i++)
+    {
+        Candidate *candidate = &candidates[i];
+        double share = 100.0 * candidate->savedDispatches / dispatches;
+        reportLine(callback, "%4d %6.2f%% %12llu %s %s%s%s\n", i + 1, share, (unsigned long long)candidate->count,
+               getOpCodeName(candidate->opCodes[0]), getOpCodeName(candidate->opCodes[1]),
+               candidate->length == 3 ? " " : "", candidate->length == 3 ? getOpCodeName(candidate->opCodes[2]) : "");
+    }
+    free(candidates);
+}
+
+static void reportOpcodes(OpcodeProfile *profile, void (*callback)(char *line))
+{
+    reportLine(callback, "=== opcodes ===\n");
+    for (int opCode = 0; opCode < OP_CODE_COUNT; opCode++)
+    {
+        if (profile->counts[opCode] == 0)
+        {
+            continue;
+        }
+
+        char shapes[256] = "";
+        int length = 0;
+        for (int shape = 0; shape < OPERAND_SHAPE_COUNT; shape++)
+        {
+            if (profile->shapes[opCode][shape] != 0)
+            {
+                length += snprintf(shapes + length, sizeof(shapes) - length, " %s:%llu", shapeNames[shape], (unsigned long long)profile->shapes[opCode][shape]);
+            }
+        }
+        reportLine(callback, "%-40s %12llu%s\n", getOpCodeName(opCode), (unsigned long long)profile->counts[opCode], shapes);
+    }
+}
+
+void reportOpcodeProfile(OpcodeProfile *profile, int limit, void (*callback)(char *line))
+{
+    uint64_t dispatches = 0;
+    for (int opCode = 0; opCode < OP_CODE_COUNT; opCode++)
+    {
+        dispatches += profile->counts[opCode];
+    }
+    reportLine(callback, "%llu instructions run\n", (unsigned long long)dispatches);
+    if (dispatches == 0)
+    {
+        return;
+    }
+
+    reportCandidates(profile, dispatches, limit, callback);
+    reportOpcodes(profile, callback);
+}
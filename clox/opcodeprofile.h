@@ -0,0 +1,41 @@
+#ifndef OPCODE_PROFILE_HEADER
+#define OPCODE_PROFILE_HEADER
+
+#include <stdint.h>
+#include "chunk.h"
+#include "instruction.h"
+
+// The operand an instruction works on is one of the ValueTypes, or there is none.
+#define OPERAND_NONE (VALUE_TYPE_NIL + 1)
+#define OPERAND_SHAPE_COUNT (OPERAND_NONE + 1)
+
+// Counts of what the VM runs, gathered while a profile is attached to it. A pair or
+// triple is only counted when its instructions ran one straight after the other in the
+// same function, since those are the only sequences a superinstruction could replace.
+// One profile can be attached to many runs to build up a corpus.
+typedef struct OpcodeProfile
+{
+    uint64_t counts[OP_CODE_COUNT];
+    uint64_t bigrams[OP_CODE_COUNT][OP_CODE_COUNT];
+    // OP_CODE_COUNT^3 counters, too many to keep inline.
+    uint64_t *trigrams;
+    uint64_t shapes[OP_CODE_COUNT][OPERAND_SHAPE_COUNT];
+    Instruction *previous;
+    Instruction *beforePrevious;
+} OpcodeProfile;
+
+void initOpcodeProfile(OpcodeProfile *);
+void freeOpcodeProfile(OpcodeProfile *);
+
+void recordInstruction(OpcodeProfile *, Instruction *, int operandShape);
+// Forgets the last instructions run, so a new run does not continue a sequence.
+void breakInstructionSequence(OpcodeProfile *);
+
+uint64_t getTrigramCount(OpcodeProfile *, OpCode first, OpCode second, OpCode third);
+
+// Sends the report a line at a time, each in a malloc'd string the callback frees: the
+// limit most frequent pairs and triples, ranked by the dispatches fusing each into one
+// instruction would save, then every opcode run with the shapes of its operands.
+void reportOpcodeProfile(OpcodeProfile *, int limit, void (*callback)(char *line));
+
+#endif
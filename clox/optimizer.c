@@ -0,0 +1,273 @@
+#include "optimizer.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include "memory.h"
+#include "value.h"
+
+// The optimized instructions are built like a stack: each decoded instruction is
+// appended, then the rules below try to collapse the last few into one. A rule may only
+// swallow instructions that nothing jumps or returns to, other than the first.
+typedef struct Rewrite
+{
+    Instruction *instructions;
+    bool *isEntry;
+    int count;
+} Rewrite;
+
+static Instruction *fromEnd(Rewrite *rewrite, int distance)
+{
+    return &rewrite->instructions[rewrite->count - distance];
+}
+
+static bool canCollapse(Rewrite *rewrite, int length)
+{
+    if (rewrite->count < length)
+    {
+        return false;
+    }
+
+    for (int distance = 1; distance < length; distance++)
+    {
+        if (rewrite->isEntry[rewrite->count - distance])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void collapse(Rewrite *rewrite, int length)
+{
+    rewrite->count = rewrite->count - length + 1;
+}
+
+static bool isConstant(Instruction *instruction)
+{
+    return instruction->opCode == OP_CONSTANT || instruction->opCode == OP_CONSTANT_LONG;
+}
+
+static bool isNumberConstant(Instruction *instruction)
+{
+    return isConstant(instruction) && isNumber(instruction->as.constant);
+}
+
+static bool isLocalExpression(Instruction *instruction)
+{
+    return instruction->opCode == OP_VAR_EXPRESSION || instruction->opCode == OP_VAR_EXPRESSION_LONG;
+}
+
+static bool isLocalAssign(Instruction *instruction)
+{
+    return instruction->opCode == OP_VAR_ASSIGN || instruction->opCode == OP_VAR_ASSIGN_LONG;
+}
+
+static bool isLoopIfTrue(Instruction *instruction)
+{
+    return instruction->opCode == OP_LOOP_IF_TRUE || instruction->opCode == OP_LOOP_IF_TRUE_LONG;
+}
+
+// Works the operator out the same way its handler would at run time.
+static bool evaluateBinary(OpCode opCode, Value leftValue, Value rightValue, Value *result)
+{
+    double left = unwrapNumber(leftValue);
+    double right = unwrapNumber(rightValue);
+    if (opCode == OP_ADD)
+    {
+        *result = add(leftValue, rightValue);
+    }
+    else if (opCode == OP_SUB)
+    {
+        *result = wrapNumber(left - right);
+    }
+    else if (opCode == OP_MULT)
+    {
+        *result = wrapNumber(left * right);
+    }
+    else if (opCode == OP_DIV)
+    {
+        *result = wrapNumber(left / right);
+    }
+    else if (opCode == OP_LESS_THAN)
+    {
+        *result = wrapBool(left < right);
+    }
+    else if (opCode == OP_LESS_THAN_EQUALS)
+    {
+        *result = wrapBool(left <= right);
+    }
+    else if (opCode == OP_EQUAL)
+    {
+        *result = wrapBool(equals(leftValue, rightValue));
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// constant, constant, operator => constant
+static bool foldBinary(Rewrite *rewrite)
+{
+    if (!canCollapse(rewrite, 3) || !isNumberConstant(fromEnd(rewrite, 3)) || !isNumberConstant(fromEnd(rewrite, 2)))
+    {
+        return false;
+    }
+
+    Instruction *left = fromEnd(rewrite, 3);
+    Value folded;
+    if (!evaluateBinary(fromEnd(rewrite, 1)->opCode, left->as.constant, fromEnd(rewrite, 2)->as.constant, &folded))
+    {
+        return false;
+    }
+
+    left->opCode = OP_CONSTANT;
+    left->as.constant = folded;
+    collapse(rewrite, 3);
+    return true;
+}
+
+// constant, negate => constant
+static bool foldNegate(Rewrite *rewrite)
+{
+    if (!canCollapse(rewrite, 2) || !isNumberConstant(fromEnd(rewrite, 2)) || fromEnd(rewrite, 1)->opCode != OP_NEGATE)
+    {
+        return false;
+    }
+
+    Instruction *constant = fromEnd(rewrite, 2);
+    constant->opCode = OP_CONSTANT;
+    constant->as.constant = negate(constant->as.constant);
+    collapse(rewrite, 2);
+    return true;
+}
+
+// local, constant, operator => one instruction reading the local directly
+static bool fuseLocalWithConstant(Rewrite *rewrite, OpCode operator, OpCode fused)
+{
+    if (!canCollapse(rewrite, 3) || !isLocalExpression(fromEnd(rewrite, 3)) || !isConstant(fromEnd(rewrite, 2)) || fromEnd(rewrite, 1)->opCode != operator)
+    {
+        return false;
+    }
+
+    Instruction *local = fromEnd(rewrite, 3);
+    int slot = local->as.slot;
+    Value constant = fromEnd(rewrite, 2)->as.constant;
+
+    local->opCode = fused;
+    local->as.local.slot = slot;
+    local->as.local.constant = constant;
+    local->as.local.target = NULL;
+    collapse(rewrite, 3);
+    return true;
+}
+
+// local + constant, assign to the same local => increment in place
+static bool fuseIncrement(Rewrite *rewrite)
+{
+    if (!canCollapse(rewrite, 2) || fromEnd(rewrite, 2)->opCode != OP_LOCAL_ADD_CONSTANT || !isLocalAssign(fromEnd(rewrite, 1)))
+    {
+        return false;
+    }
+
+    Instruction *sum = fromEnd(rewrite, 2);
+    if (sum->as.local.slot != fromEnd(rewrite, 1)->as.slot)
+    {
+        return false;
+    }
+
+    sum->opCode = OP_LOCAL_INCREMENT;
+    collapse(rewrite, 2);
+    return true;
+}
+
+// local < constant, loop if true => one loop condition
+static bool fuseLoopCondition(Rewrite *rewrite)
+{
+    if (!canCollapse(rewrite, 2) || fromEnd(rewrite, 2)->opCode != OP_LOCAL_LESS_THAN_CONSTANT || !isLoopIfTrue(fromEnd(rewrite, 1)))
+    {
+        return false;
+    }
+
+    Instruction *condition = fromEnd(rewrite, 2);
+    condition->opCode = OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT;
+    condition->as.local.target = fromEnd(rewrite, 1)->as.target;
+    collapse(rewrite, 2);
+    return true;
+}
+
+static bool applyRule(Rewrite *rewrite)
+{
+    return foldBinary(rewrite) || foldNegate(rewrite) || fuseLocalWithConstant(rewrite, OP_ADD, OP_LOCAL_ADD_CONSTANT) || fuseLocalWithConstant(rewrite, OP_LESS_THAN, OP_LOCAL_LESS_THAN_CONSTANT) || fuseIncrement(rewrite) || fuseLoopCondition(rewrite);
+}
+
+// Calls that come back to the instruction after them. A tail call never does.
+static bool isReturningCall(OpCode opCode)
+{
+    return opCode == OP_CALL || opCode == OP_CALL_DIRECT || opCode == OP_CALL_DIRECT_LONG;
+}
+
+static bool *findEntries(Instruction *decoded, int count)
+{
+    bool *isEntry = calloc(count, sizeof(bool));
+    isEntry[0] = true;
+    for (int i = 0; i < count; i++)
+    {
+        if (isJumpOpCode(decoded[i].opCode))
+        {
+            isEntry[decoded[i].as.target - decoded] = true;
+        }
+        if (isReturningCall(decoded[i].opCode) && i + 1 < count)
+        {
+            isEntry[i + 1] = true;
+        }
+    }
+    return isEntry;
+}
+
+static Instruction *retarget(Instruction *target, Instruction *decoded, Instruction *optimized, int *newIndexOf)
+{
+    return &optimized[newIndexOf[target - decoded]];
+}
+
+Instruction *optimizeInstructions(Instruction *decoded, int count, int *optimizedCount, int *newIndexOf)
+{
+    bool *isEntry = findEntries(decoded, count);
+
+    Rewrite rewrite;
+    rewrite.instructions = GROW_ARRAY(Instruction, NULL, 0, count);
+    rewrite.isEntry = calloc(count, sizeof(bool));
+    rewrite.count = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        rewrite.instructions[rewrite.count] = decoded[i];
+        rewrite.isEntry[rewrite.count] = isEntry[i];
+        newIndexOf[i] = rewrite.count;
+        rewrite.count++;
+
+        while (applyRule(&rewrite))
+        {
+        }
+    }
+
+    // Jumps still point into the decoded instructions.
+    for (int i = 0; i < rewrite.count; i++)
+    {
+        Instruction *instruction = &rewrite.instructions[i];
+        if (isJumpOpCode(instruction->opCode))
+        {
+            instruction->as.target = retarget(instruction->as.target, decoded, rewrite.instructions, newIndexOf);
+        }
+        else if (instruction->opCode == OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT)
+        {
+            instruction->as.local.target = retarget(instruction->as.local.target, decoded, rewrite.instructions, newIndexOf);
+        }
+    }
+
+    free(isEntry);
+    free(rewrite.isEntry);
+
+    *optimizedCount = rewrite.count;
+    return rewrite.instructions;
+}
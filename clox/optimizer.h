@@ -0,0 +1,12 @@
+#ifndef OPTIMIZER_HEADER
+#define OPTIMIZER_HEADER
+
+#include "instruction.h"
+
+// Returns an optimized copy of a function's decoded instructions: constant expressions
+// are folded and common local/constant sequences become superinstructions. newIndexOf
+// maps every place execution can resume at (the entry, jump targets and call return
+// points) to its position in the copy. Handlers are left for the VM to fill in.
+Instruction *optimizeInstructions(Instruction *decoded, int count, int *optimizedCount, int *newIndexOf);
+
+#endif
@@ -0,0 +1,169 @@
+#include "outputsink.h"
+#include <string.h>
+#include <unistd.h>
+#include "memory.h"
+#include "cloxstring.h"
+
+#ifdef OUTPUT_WRITEV_AVAILABLE
+#include <sys/uio.h>
+#endif
+
+void initOutputSink(OutputSink *sink, int fileDescriptor, int capacity)
+{
+    sink->chars = GROW_ARRAY(char, NULL, 0, capacity);
+    sink->length = 0;
+    sink->capacity = capacity;
+    sink->onFlush = NULL;
+    sink->fileDescriptor = fileDescriptor;
+    sink->hasFailed = false;
+}
+
+void freeOutputSink(OutputSink *sink)
+{
+    flushOutput(sink);
+    FREE_ARRAY(char, sink->chars, sink->capacity);
+    sink->chars = NULL;
+    sink->capacity = 0;
+}
+
+static bool writeAll(int fileDescriptor, const char *chars, int length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fileDescriptor, chars, length);
+        if (written <= 0)
+        {
+            return false;
+        }
+        chars += written;
+        length -= written;
+    }
+    return true;
+}
+
+static void deliver(OutputSink *sink, const char *chars, int length)
+{
+    if (sink->onFlush != NULL)
+    {
+        sink->onFlush(chars, length);
+    }
+    else if (sink->fileDescriptor >= 0 && !writeAll(sink->fileDescriptor, chars, length))
+    {
+        sink->hasFailed = true;
+    }
+}
+
+bool flushOutput(OutputSink *sink)
+{
+    if (sink->length > 0)
+    {
+        deliver(sink, sink->chars, sink->length);
+        sink->length = 0;
+    }
+    return !sink->hasFailed;
+}
+
+// Output bigger than the whole buffer is delivered as it is rather than copied in.
+void writeOutput(OutputSink *sink, const char *chars, int length)
+{
+    if (length > sink->capacity - sink->length)
+    {
+        flushOutput(sink);
+    }
+    if (length > sink->capacity)
+    {
+        deliver(sink, chars, length);
+        return;
+    }
+
+    memcpy(sink->chars + sink->length, chars, length);
+    sink->length += length;
+}
+
+#ifdef OUTPUT_WRITEV_AVAILABLE
+static bool writeAllParts(int fileDescriptor, struct iovec *parts, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fileDescriptor, parts, count);
+        if (written <= 0)
+        {
+            return false;
+        }
+
+        while (count > 0 && (size_t)written >= parts->iov_len)
+        {
+            written -= parts->iov_len;
+            parts++;
+            count--;
+        }
+        if (count > 0)
+        {
+            parts->iov_base = (char *)parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+    return true;
+}
+#endif
+
+static void writeLine(OutputSink *sink, const char *chars, int length)
+{
+#ifdef OUTPUT_WRITEV_AVAILABLE
+    if (sink->onFlush == NULL && sink->fileDescriptor >= 0 && length >= sink->capacity - sink->length)
+    {
+        struct iovec parts[] = {
+            {sink->chars, sink->length},
+            {(char *)chars, length},
+            {"\n", 1},
+        };
+        if (!writeAllParts(sink->fileDescriptor, parts, 3))
+        {
+            sink->hasFailed = true;
+        }
+        sink->length = 0;
+        return;
+    }
+#endif
+    writeOutput(sink, chars, length);
+    writeOutput(sink, "\n", 1);
+}
+
+// Grows the buffer only for a single line that could never fit in it.
+static void reserveOutput(OutputSink *sink, int length)
+{
+    if (length > sink->capacity - sink->length)
+    {
+        flushOutput(sink);
+    }
+    if (length > sink->capacity)
+    {
+        sink->chars = GROW_ARRAY(char, sink->chars, sink->capacity, length);
+        sink->capacity = length;
+    }
+}
+
+void writeValueLine(OutputSink *sink, Value value, NumberFormat format)
+{
+    if (isStringObj(value))
+    {
+        StringObj *string = (StringObj *)unwrapObject(value);
+        writeLine(sink, string->chars, string->length);
+        return;
+    }
+
+    // Formatted in place, and again after making room in the rare case it did not fit.
+    int room = sink->capacity - sink->length;
+    int length = formatValueInto(value, format, sink->chars + sink->length, room);
+    if (length < 0)
+    {
+        return;
+    }
+    if (length >= room)
+    {
+        reserveOutput(sink, length + 1);
+        formatValueInto(value, format, sink->chars + sink->length, length + 1);
+    }
+    sink->length += length;
+    sink->chars[sink->length++] = '\n';
+}
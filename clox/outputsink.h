@@ -0,0 +1,41 @@
+#ifndef OUTPUT_SINK_HEADER
+#define OUTPUT_SINK_HEADER
+
+#include <stdbool.h>
+#include "value.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define OUTPUT_WRITEV_AVAILABLE
+#endif
+
+#define OUTPUT_SINK_DEFAULT_CAPACITY (64 * 1024)
+
+// What print writes, gathered into one buffer and handed on in bulk when it fills up or
+// is flushed, so a print-heavy script costs a write per buffer rather than one per print.
+typedef struct OutputSink
+{
+    char *chars;
+    int length;
+    int capacity;
+    // Gets everything written since the last flush. The chars stay the sink's.
+    void (*onFlush)(const char *chars, int length);
+    // Written to when there is no onFlush, or -1 to drop the output.
+    int fileDescriptor;
+    // Set by the first write that fails and never cleared, so output lost halfway
+    // through a run still shows when the run's last flush is checked.
+    bool hasFailed;
+} OutputSink;
+
+void initOutputSink(OutputSink *, int fileDescriptor, int capacity);
+// Flushes whatever is still buffered.
+void freeOutputSink(OutputSink *);
+
+void writeOutput(OutputSink *, const char *chars, int length);
+// A value the way print shows it, then a newline. A string that does not fit in what is
+// left of the buffer goes to the file descriptor in one writev with what was buffered,
+// uncopied, where writev is available.
+void writeValueLine(OutputSink *, Value, NumberFormat);
+// False when this or any earlier write since the sink was made has failed.
+bool flushOutput(OutputSink *);
+
+#endif
@@ -0,0 +1,164 @@
+#include "perfmap.h"
+#include <string.h>
+
+#ifdef PERF_MAP_AVAILABLE
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// The layouts perf's jitdump reader expects, from tools/perf/util/jitdump.h.
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+#define JIT_CODE_CLOSE 3
+
+typedef struct JitdumpHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t totalSize;
+    uint32_t elfMachine;
+    uint32_t padding;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+} JitdumpHeader;
+
+typedef struct JitdumpRecord
+{
+    uint32_t id;
+    uint32_t totalSize;
+    uint64_t timestamp;
+} JitdumpRecord;
+
+typedef struct JitdumpCodeLoad
+{
+    JitdumpRecord record;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t codeAddress;
+    uint64_t codeSize;
+    uint64_t codeIndex;
+} JitdumpCodeLoad;
+
+// perf has to be recording with -k mono for these to line up with its samples.
+static uint64_t getTimestamp()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static FILE *openJitdump(PerfMap *perfMap, const char *directory)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/jit-%d.dump", directory, (int)getpid());
+    FILE *jitdump = fopen(path, "w+");
+    if (jitdump == NULL)
+    {
+        return NULL;
+    }
+
+    perfMap->markerSize = sysconf(_SC_PAGESIZE);
+    perfMap->marker = mmap(NULL, perfMap->markerSize, PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(jitdump), 0);
+    if (perfMap->marker == MAP_FAILED)
+    {
+        perfMap->marker = NULL;
+        fclose(jitdump);
+        return NULL;
+    }
+
+    JitdumpHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JITDUMP_MAGIC;
+    header.version = JITDUMP_VERSION;
+    header.totalSize = sizeof(header);
+    header.elfMachine = EM_X86_64;
+    header.pid = getpid();
+    header.timestamp = getTimestamp();
+    fwrite(&header, sizeof(header), 1, jitdump);
+    fflush(jitdump);
+    return jitdump;
+}
+
+bool openPerfMap(PerfMap *perfMap, const char *jitdumpDirectory)
+{
+    perfMap->jitdump = NULL;
+    perfMap->marker = NULL;
+    perfMap->markerSize = 0;
+    perfMap->codeIndex = 0;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perfMap->map = fopen(path, "a");
+    if (jitdumpDirectory != NULL)
+    {
+        perfMap->jitdump = openJitdump(perfMap, jitdumpDirectory);
+    }
+    return perfMap->map != NULL || perfMap->jitdump != NULL;
+}
+
+void closePerfMap(PerfMap *perfMap)
+{
+    if (perfMap->map != NULL)
+    {
+        fclose(perfMap->map);
+        perfMap->map = NULL;
+    }
+    if (perfMap->jitdump != NULL)
+    {
+        JitdumpRecord close = {JIT_CODE_CLOSE, sizeof(JitdumpRecord), getTimestamp()};
+        fwrite(&close, sizeof(close), 1, perfMap->jitdump);
+        munmap(perfMap->marker, perfMap->markerSize);
+        fclose(perfMap->jitdump);
+        perfMap->jitdump = NULL;
+        perfMap->marker = NULL;
+    }
+}
+
+// Each record is flushed so a crash still leaves every earlier one for perf to read.
+void recordNativeCode(PerfMap *perfMap, const char *name, NativeCode *native)
+{
+    if (perfMap->map != NULL)
+    {
+        fprintf(perfMap->map, "%lx %zx %s\n", (unsigned long)(uintptr_t)native->code, native->length, name);
+        fflush(perfMap->map);
+    }
+
+    if (perfMap->jitdump != NULL)
+    {
+        size_t nameSize = strlen(name) + 1;
+        JitdumpCodeLoad load;
+        load.record.id = JIT_CODE_LOAD;
+        load.record.totalSize = sizeof(load) + nameSize + native->length;
+        load.record.timestamp = getTimestamp();
+        load.pid = getpid();
+        load.tid = syscall(SYS_gettid);
+        load.vma = (uintptr_t)native->code;
+        load.codeAddress = (uintptr_t)native->code;
+        load.codeSize = native->length;
+        load.codeIndex = perfMap->codeIndex++;
+        fwrite(&load, sizeof(load), 1, perfMap->jitdump);
+        fwrite(name, nameSize, 1, perfMap->jitdump);
+        fwrite(native->code, native->length, 1, perfMap->jitdump);
+        fflush(perfMap->jitdump);
+    }
+}
+#else
+bool openPerfMap(PerfMap *perfMap, const char *jitdumpDirectory)
+{
+    memset(perfMap, 0, sizeof(PerfMap));
+    return false;
+}
+
+void closePerfMap(PerfMap *perfMap)
+{
+}
+
+void recordNativeCode(PerfMap *perfMap, const char *name, NativeCode *native)
+{
+}
+#endif
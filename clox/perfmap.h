@@ -0,0 +1,36 @@
+#ifndef PERFMAP_HEADER
+#define PERFMAP_HEADER
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "jit.h"
+
+// Tells Linux perf which Lox function machine code belongs to. Only code the JIT wrote
+// can be named: interpreted functions all run inside the same handlers, so samples there
+// land on the handlers whatever function they were for.
+#ifdef JIT_AVAILABLE
+#define PERF_MAP_AVAILABLE
+#endif
+
+typedef struct PerfMap
+{
+    // /tmp/perf-<pid>.map, which perf report reads as it is.
+    FILE *map;
+    // jit-<pid>.dump, which perf inject --jit turns into symbols and a copy of the code.
+    FILE *jitdump;
+    // perf only looks for a jitdump that the process mapped executable.
+    void *marker;
+    size_t markerSize;
+    uint64_t codeIndex;
+} PerfMap;
+
+// Starts /tmp/perf-<pid>.map, and a jitdump in jitdumpDirectory unless it is NULL.
+// Returns false when neither could be opened.
+bool openPerfMap(PerfMap *, const char *jitdumpDirectory);
+void closePerfMap(PerfMap *);
+
+// Names native code as it is published, e.g. "lox:fib" or "lox:fib:trace@12".
+void recordNativeCode(PerfMap *, const char *name, NativeCode *native);
+
+#endif
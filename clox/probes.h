@@ -0,0 +1,73 @@
+#ifndef PROBES_HEADER
+#define PROBES_HEADER
+
+#include <stdbool.h>
+
+// USDT probes for bpftrace and other tracers, for example
+//   bpftrace -e 'usdt:./clox:clox:function__entry { @[str(arg0)] = count(); }'
+// They are built wherever <sys/sdt.h> is found and compile to nothing elsewhere. Each has
+// a semaphore the tracer raises while it is attached, so a probe nobody is watching costs
+// one test of a global and its arguments are never worked out.
+//
+//   function__entry(char *name, int depth, int argumentCount)
+//   function__return(char *name, int depth)
+//   object__alloc(int objType, size_t size)
+//   global__miss(char *name)
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define CLOX_PROBES
+#endif
+#endif
+
+#ifdef CLOX_PROBES
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+extern unsigned short clox_function__entry_semaphore;
+extern unsigned short clox_function__return_semaphore;
+extern unsigned short clox_object__alloc_semaphore;
+extern unsigned short clox_global__miss_semaphore;
+
+#define PROBE_ENABLED(probe) __builtin_expect(clox_##probe##_semaphore != 0, 0)
+
+#define PROBE_FUNCTION_ENTRY(name, depth, argumentCount)                            \
+    do                                                                              \
+    {                                                                               \
+        if (PROBE_ENABLED(function__entry))                                         \
+        {                                                                           \
+            DTRACE_PROBE3(clox, function__entry, name, depth, argumentCount);       \
+        }                                                                           \
+    } while (0)
+#define PROBE_FUNCTION_RETURN(name, depth)                                          \
+    do                                                                              \
+    {                                                                               \
+        if (PROBE_ENABLED(function__return))                                        \
+        {                                                                           \
+            DTRACE_PROBE2(clox, function__return, name, depth);                     \
+        }                                                                           \
+    } while (0)
+#define PROBE_OBJECT_ALLOC(type, size)                                              \
+    do                                                                              \
+    {                                                                               \
+        if (PROBE_ENABLED(object__alloc))                                           \
+        {                                                                           \
+            DTRACE_PROBE2(clox, object__alloc, type, size);                         \
+        }                                                                           \
+    } while (0)
+#define PROBE_GLOBAL_MISS(name)                                                     \
+    do                                                                              \
+    {                                                                               \
+        if (PROBE_ENABLED(global__miss))                                            \
+        {                                                                           \
+            DTRACE_PROBE1(clox, global__miss, name);                                \
+        }                                                                           \
+    } while (0)
+#else
+#define PROBE_ENABLED(probe) false
+#define PROBE_FUNCTION_ENTRY(name, depth, argumentCount) ((void)0)
+#define PROBE_FUNCTION_RETURN(name, depth) ((void)0)
+#define PROBE_OBJECT_ALLOC(type, size) ((void)0)
+#define PROBE_GLOBAL_MISS(name) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,489 @@
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "memory.h"
+#include "textbuffer.h"
+
+#ifdef SAMPLING_PROFILER_AVAILABLE
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#endif
+
+#define MAX_HOT_INSTRUCTIONS 10
+
+typedef struct FunctionTally
+{
+    FunctionObj *function;
+    uint64_t self;
+    uint64_t total;
+} FunctionTally;
+
+typedef struct InstructionTally
+{
+    SampledFrame frame;
+    uint64_t count;
+} InstructionTally;
+
+void initSamplingProfiler(SamplingProfiler *profiler, VirtualMachine *vm, uint32_t capacity)
+{
+    profiler->vm = vm;
+    profiler->samples = malloc(sizeof(Sample) * capacity);
+    profiler->capacity = capacity;
+    atomic_init(&profiler->head, 0);
+    profiler->tail = 0;
+    atomic_init(&profiler->dropped, 0);
+    profiler->samplesPerSecond = 0;
+}
+
+void freeSamplingProfiler(SamplingProfiler *profiler)
+{
+    free(profiler->samples);
+    profiler->samples = NULL;
+    profiler->capacity = 0;
+}
+
+// Frames are read as they stand when the signal lands, so a frame a call is still
+// setting up may have no function yet, or an ip from before its function was optimized.
+static void sampleFrame(CallFrame *frame, SampledFrame *sampled)
+{
+    FunctionObj *function = frame->function;
+    sampled->function = function;
+    sampled->instructionIndex = -1;
+    sampled->isOptimized = function != NULL && function->isOptimized;
+    if (function != NULL && frame->ip >= function->decoded && frame->ip < function->decoded + function->decodedCount)
+    {
+        sampled->instructionIndex = frame->ip - function->decoded;
+    }
+}
+
+void sampleCallStack(SamplingProfiler *profiler)
+{
+    VirtualMachine *vm = profiler->vm;
+    uint32_t head = atomic_load_explicit(&profiler->head, memory_order_relaxed);
+    if (vm->fp < 0)
+    {
+        return;
+    }
+    if (head - profiler->tail >= profiler->capacity)
+    {
+        atomic_fetch_add_explicit(&profiler->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    // Read once: growing the frames swaps in a new array, see growFrames().
+    CallFrame *frames = vm->frames;
+    Sample *sample = &profiler->samples[head % profiler->capacity];
+    int frameCount = vm->fp + 1;
+    int first = frameCount > MAX_SAMPLED_FRAMES ? frameCount - MAX_SAMPLED_FRAMES : 0;
+    sample->isTruncated = first > 0;
+    sample->depth = 0;
+    for (int i = first; i < frameCount; i++)
+    {
+        if (frames[i].function != NULL)
+        {
+            sampleFrame(&frames[i], &sample->frames[sample->depth++]);
+        }
+    }
+    if (sample->depth == 0)
+    {
+        return;
+    }
+
+    atomic_store_explicit(&profiler->head, head + 1, memory_order_release);
+}
+
+#ifdef SAMPLING_PROFILER_AVAILABLE
+static SamplingProfiler *activeProfiler = NULL;
+static struct sigaction previousProfAction;
+
+static void onProfilingSignal(int signalNumber)
+{
+    (void)signalNumber;
+    int savedErrno = errno;
+    sampleCallStack(activeProfiler);
+    errno = savedErrno;
+}
+
+static void setTimer(int samplesPerSecond)
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    if (samplesPerSecond > 0)
+    {
+        long interval = 1000000L / samplesPerSecond;
+        timer.it_interval.tv_sec = interval / 1000000L;
+        timer.it_interval.tv_usec = interval % 1000000L;
+        timer.it_value = timer.it_interval;
+    }
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+#endif
+
+bool startSamplingProfiler(SamplingProfiler *profiler, int samplesPerSecond)
+{
+#ifdef SAMPLING_PROFILER_AVAILABLE
+    if (activeProfiler != NULL || samplesPerSecond <= 0 || samplesPerSecond > 1000000)
+    {
+        return false;
+    }
+
+    activeProfiler = profiler;
+    profiler->samplesPerSecond = samplesPerSecond;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onProfilingSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, &previousProfAction);
+
+    setTimer(samplesPerSecond);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void stopSamplingProfiler(SamplingProfiler *profiler)
+{
+#ifdef SAMPLING_PROFILER_AVAILABLE
+    if (activeProfiler != profiler)
+    {
+        return;
+    }
+
+    setTimer(0);
+    sigaction(SIGPROF, &previousProfAction, NULL);
+    activeProfiler = NULL;
+#endif
+}
+
+static const char *getFunctionName(FunctionObj *function)
+{
+    return function->name == NULL ? "script" : function->name->chars;
+}
+
+static char *foldStack(Sample *sample)
+{
+    int length = sample->isTruncated ? strlen("[truncated]") : 0;
+    for (int i = 0; i < sample->depth; i++)
+    {
+        length += strlen(getFunctionName(sample->frames[i].function)) + 1;
+    }
+
+    char *folded = malloc(length + 1);
+    folded[0] = '\0';
+    int written = 0;
+    if (sample->isTruncated)
+    {
+        written += sprintf(folded, "[truncated]");
+    }
+    for (int i = 0; i < sample->depth; i++)
+    {
+        written += sprintf(folded + written, written == 0 ? "%s" : ";%s", getFunctionName(sample->frames[i].function));
+    }
+    return folded;
+}
+
+static int compareStrings(const void *left, const void *right)
+{
+    return strcmp(*(char *const *)left, *(char *const *)right);
+}
+
+void writeFoldedStacks(SamplingProfiler *profiler, void (*callback)(char *line))
+{
+    uint32_t tail = profiler->tail;
+    uint32_t count = atomic_load_explicit(&profiler->head, memory_order_acquire) - tail;
+    char **stacks = malloc(sizeof(char *) * (count + 1));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        stacks[i] = foldStack(&profiler->samples[(tail + i) % profiler->capacity]);
+    }
+    qsort(stacks, count, sizeof(char *), compareStrings);
+
+    uint32_t runStart = 0;
+    for (uint32_t i = 1; i <= count; i++)
+    {
+        if (i == count || strcmp(stacks[i], stacks[runStart]) != 0)
+        {
+            reportLine(callback, "%s %u\n", stacks[runStart], i - runStart);
+            runStart = i;
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        free(stacks[i]);
+    }
+    free(stacks);
+}
+
+static FILE *outputFile = NULL;
+
+static void writeToOutputFile(char *line)
+{
+    fputs(line, outputFile);
+    free(line);
+}
+
+static bool writeToFile(SamplingProfiler *profiler, const char *path, void (*write)(SamplingProfiler *, void (*)(char *)))
+{
+    outputFile = fopen(path, "w");
+    if (outputFile == NULL)
+    {
+        return false;
+    }
+
+    write(profiler, writeToOutputFile);
+    bool written = !ferror(outputFile);
+    written = fclose(outputFile) == 0 && written;
+    outputFile = NULL;
+    return written;
+}
+
+bool writeFoldedStacksToFile(SamplingProfiler *profiler, const char *path)
+{
+    return writeToFile(profiler, path, writeFoldedStacks);
+}
+
+bool writeSamplingProfileToFile(SamplingProfiler *profiler, const char *path)
+{
+    return writeToFile(profiler, path, reportSamplingProfile);
+}
+
+static SamplingProfiler *exitProfiler = NULL;
+static const char *exitFoldedStacksPath = NULL;
+static const char *exitReportPath = NULL;
+
+static void writeProfileOnExit()
+{
+    if (exitProfiler == NULL)
+    {
+        return;
+    }
+
+    stopSamplingProfiler(exitProfiler);
+    if (exitFoldedStacksPath != NULL && !writeFoldedStacksToFile(exitProfiler, exitFoldedStacksPath))
+    {
+        fprintf(stderr, "Could not write folded stacks to %s.\n", exitFoldedStacksPath);
+    }
+    if (exitReportPath != NULL && !writeSamplingProfileToFile(exitProfiler, exitReportPath))
+    {
+        fprintf(stderr, "Could not write the profile to %s.\n", exitReportPath);
+    }
+    exitProfiler = NULL;
+}
+
+static bool writeAtExit(SamplingProfiler *profiler)
+{
+    static bool isRegistered = false;
+    if (!isRegistered)
+    {
+        if (atexit(writeProfileOnExit) != 0)
+        {
+            return false;
+        }
+        isRegistered = true;
+    }
+
+    if (exitProfiler != profiler)
+    {
+        exitFoldedStacksPath = NULL;
+        exitReportPath = NULL;
+    }
+    exitProfiler = profiler;
+    return true;
+}
+
+bool writeFoldedStacksAtExit(SamplingProfiler *profiler, const char *path)
+{
+    if (!writeAtExit(profiler))
+    {
+        return false;
+    }
+    exitFoldedStacksPath = path;
+    return true;
+}
+
+bool writeSamplingProfileAtExit(SamplingProfiler *profiler, const char *path)
+{
+    if (!writeAtExit(profiler))
+    {
+        return false;
+    }
+    exitReportPath = path;
+    return true;
+}
+
+typedef struct FunctionTallies
+{
+    FunctionTally *tallies;
+    int count;
+    int capacity;
+} FunctionTallies;
+
+static FunctionTally *findTally(FunctionTallies *tallies, FunctionObj *function)
+{
+    for (int i = 0; i < tallies->count; i++)
+    {
+        if (tallies->tallies[i].function == function)
+        {
+            return &tallies->tallies[i];
+        }
+    }
+
+    if (tallies->capacity < tallies->count + 1)
+    {
+        int oldCapacity = tallies->capacity;
+        tallies->capacity = GROW_CAPACITY(oldCapacity);
+        tallies->tallies = GROW_ARRAY(FunctionTally, tallies->tallies, oldCapacity, tallies->capacity);
+    }
+    FunctionTally *tally = &tallies->tallies[tallies->count++];
+    tally->function = function;
+    tally->self = 0;
+    tally->total = 0;
+    return tally;
+}
+
+static bool isFurtherOut(Sample *sample, int frameIndex)
+{
+    for (int i = 0; i < frameIndex; i++)
+    {
+        if (sample->frames[i].function == sample->frames[frameIndex].function)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static double percentOf(uint64_t part, uint32_t whole)
+{
+    return 100.0 * part / whole;
+}
+
+// Self counts the samples a function was on top in. Total counts the samples it was
+// anywhere in, once however deep it had recursed.
+static void reportFunctions(SamplingProfiler *profiler, uint32_t tail, uint32_t count, void (*callback)(char *line))
+{
+    FunctionTallies tallies = {NULL, 0, 0};
+    for (uint32_t i = 0; i < count; i++)
+    {
+        Sample *sample = &profiler->samples[(tail + i) % profiler->capacity];
+        for (int frame = 0; frame < sample->depth; frame++)
+        {
+            FunctionTally *tally = findTally(&tallies, sample->frames[frame].function);
+            if (!isFurtherOut(sample, frame))
+            {
+                tally->total++;
+            }
+            if (frame == sample->depth - 1)
+            {
+                tally->self++;
+            }
+        }
+    }
+
+    reportLine(callback, "=== functions ===\n");
+    reportLine(callback, "%-32s %10s %7s %10s %7s\n", "function", "self", "self%", "total", "total%");
+    for (int i = 0; i < tallies.count; i++)
+    {
+        FunctionTally *tally = &tallies.tallies[i];
+        reportLine(callback, "%-32s %10llu %6.2f%% %10llu %6.2f%%\n", getFunctionName(tally->function),
+               (unsigned long long)tally->self, percentOf(tally->self, count),
+               (unsigned long long)tally->total, percentOf(tally->total, count));
+    }
+    FREE_ARRAY(FunctionTally, tallies.tallies, tallies.capacity);
+}
+
+static int compareInstructionTallies(const void *left, const void *right)
+{
+    uint64_t leftCount = ((const InstructionTally *)left)->count;
+    uint64_t rightCount = ((const InstructionTally *)right)->count;
+    return leftCount < rightCount ? 1 : leftCount > rightCount ? -1 : 0;
+}
+
+static bool isSameInstruction(SampledFrame *left, SampledFrame *right)
+{
+    return left->function == right->function && left->instructionIndex == right->instructionIndex && left->isOptimized == right->isOptimized;
+}
+
+// The source line of a sampled instruction, or 0 when it cannot be told.
+static int getSampledLine(SampledFrame *frame)
+{
+    if (frame->isOptimized || frame->instructionIndex < 0)
+    {
+        return 0;
+    }
+
+    Chunk *bytecode = frame->function->bytecode;
+    int offset = getInstructionOffset(bytecode, frame->instructionIndex);
+    return offset < 0 ? 0 : getLineAt(bytecode, offset);
+}
+
+static void reportHotInstructions(SamplingProfiler *profiler, uint32_t tail, uint32_t count, void (*callback)(char *line))
+{
+    InstructionTally *tallies = malloc(sizeof(InstructionTally) * count);
+    int tallyCount = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        Sample *sample = &profiler->samples[(tail + i) % profiler->capacity];
+        if (sample->depth == 0)
+        {
+            continue;
+        }
+
+        SampledFrame *top = &sample->frames[sample->depth - 1];
+        int found = 0;
+        while (found < tallyCount && !isSameInstruction(&tallies[found].frame, top))
+        {
+            found++;
+        }
+        if (found == tallyCount)
+        {
+            tallies[tallyCount].frame = *top;
+            tallies[tallyCount].count = 0;
+            tallyCount++;
+        }
+        tallies[found].count++;
+    }
+    qsort(tallies, tallyCount, sizeof(InstructionTally), compareInstructionTallies);
+
+    reportLine(callback, "=== hot instructions ===\n");
+    reportLine(callback, "%-32s %11s %6s %10s %7s\n", "function", "instruction", "line", "samples", "%");
+    for (int i = 0; i < tallyCount && i < MAX_HOT_INSTRUCTIONS; i++)
+    {
+        SampledFrame *frame = &tallies[i].frame;
+        char line[16] = "-";
+        int lineNumber = getSampledLine(frame);
+        if (lineNumber != 0)
+        {
+            snprintf(line, sizeof(line), "%d", lineNumber);
+        }
+        reportLine(callback, "%-32s %11d %6s %10llu %6.2f%%\n", getFunctionName(frame->function), frame->instructionIndex, line,
+               (unsigned long long)tallies[i].count, percentOf(tallies[i].count, count));
+    }
+    free(tallies);
+}
+
+void discardSamples(SamplingProfiler *profiler)
+{
+    profiler->tail = atomic_load_explicit(&profiler->head, memory_order_acquire);
+}
+
+void reportSamplingProfile(SamplingProfiler *profiler, void (*callback)(char *line))
+{
+    uint32_t tail = profiler->tail;
+    uint32_t count = atomic_load_explicit(&profiler->head, memory_order_acquire) - tail;
+
+    reportLine(callback, "%u samples at %d a second, %u dropped\n", count, profiler->samplesPerSecond, atomic_load(&profiler->dropped));
+    if (count == 0)
+    {
+        return;
+    }
+
+    reportFunctions(profiler, tail, count, callback);
+    reportHotInstructions(profiler, tail, count, callback);
+}
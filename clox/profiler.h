@@ -0,0 +1,78 @@
+#ifndef PROFILER_HEADER
+#define PROFILER_HEADER
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "vm.h"
+
+// Sampling needs SIGPROF and setitimer(), so it is only built where they exist. Elsewhere
+// startSamplingProfiler() returns false.
+#if defined(__linux__)
+#define SAMPLING_PROFILER_AVAILABLE
+#endif
+
+// Deeper call chains keep their innermost frames.
+#define MAX_SAMPLED_FRAMES 32
+
+typedef struct SampledFrame
+{
+    FunctionObj *function;
+    // Index of the instruction the frame was on, or -1 when it was between functions.
+    int instructionIndex;
+    // Optimized instructions no longer line up with the bytecode, so have no line.
+    bool isOptimized;
+} SampledFrame;
+
+// One snapshot of the call frames, outermost first.
+typedef struct Sample
+{
+    int depth;
+    bool isTruncated;
+    SampledFrame frames[MAX_SAMPLED_FRAMES];
+} Sample;
+
+// The timer signal writes samples at head and only ever moves head forward. Reports read
+// from tail up to head, so reading never has to stop the sampling. A full buffer drops
+// new samples rather than overwriting old ones.
+typedef struct SamplingProfiler
+{
+    VirtualMachine *vm;
+    Sample *samples;
+    uint32_t capacity;
+    atomic_uint head;
+    uint32_t tail;
+    atomic_uint dropped;
+    int samplesPerSecond;
+} SamplingProfiler;
+
+void initSamplingProfiler(SamplingProfiler *, VirtualMachine *, uint32_t capacity);
+void freeSamplingProfiler(SamplingProfiler *);
+
+// Only one profiler can be sampling at a time.
+bool startSamplingProfiler(SamplingProfiler *, int samplesPerSecond);
+void stopSamplingProfiler(SamplingProfiler *);
+
+// What the timer signal does: snapshots the VM's call frames into the buffer.
+void sampleCallStack(SamplingProfiler *);
+
+// Both send their output a line at a time, each in a malloc'd string the callback frees.
+// The folded stacks, "script;outer;inner count", are what flame graph tools read.
+void writeFoldedStacks(SamplingProfiler *, void (*callback)(char *line));
+// Writes the folded stacks to the file at path, replacing it. False when it could not.
+bool writeFoldedStacksToFile(SamplingProfiler *, const char *path);
+// Stops the profiler and writes its folded stacks to path when the process exits, so a
+// run that ends in exit() still leaves its profile behind. Calling it again replaces
+// the path, and a different profiler replaces both exit outputs. The profiler and path
+// have to stay valid until then.
+bool writeFoldedStacksAtExit(SamplingProfiler *, const char *path);
+// Each function's self and total samples, then the instructions most often on top and
+// the source lines they came from.
+void reportSamplingProfile(SamplingProfiler *, void (*callback)(char *line));
+// The same report written to a file, now or when the process exits, like the folded stacks.
+bool writeSamplingProfileToFile(SamplingProfiler *, const char *path);
+bool writeSamplingProfileAtExit(SamplingProfiler *, const char *path);
+// Frees the buffer's room by forgetting the samples taken so far.
+void discardSamples(SamplingProfiler *);
+
+#endif
@@ -11,6 +11,7 @@ typedef struct Lexer
 {
     uint32_t current;
     uint32_t iterator;
+    uint32_t line;
     const char *sourceCode;
 } Lexer;
 
@@ -18,6 +19,7 @@ static void initLexer(Lexer *lexer, const char *sourceCode)
 {
     lexer->current = 0;
     lexer->iterator = 0;
+    lexer->line = 1;
     lexer->sourceCode = sourceCode;
 }
 
@@ -77,6 +79,7 @@ static void leftParen(Lexer *, TokenArray *);
 static void rightParen(Lexer *, TokenArray *);
 static void lessThan(Lexer *, TokenArray *);
 static void orOperator(Lexer *, TokenArray *);
+static void andOperator(Lexer *, TokenArray *);
 static void comma(Lexer *, TokenArray *);
 
 TokenArray parseTokens(const char *sourceCode)
@@ -90,7 +93,14 @@ TokenArray parseTokens(const char *sourceCode)
     while (hasNext(&lexer))
     {
         chewUpWhitespace(&lexer);
+        if (!hasNext(&lexer))
+        {
+            break;
+        }
 
+        // A token gets the line it starts on.
+        int tokenCount = tokenArray.count;
+        uint32_t line = lexer.line;
         char current = peek(&lexer);
         if (isalpha(current))
         {
@@ -160,11 +170,20 @@ TokenArray parseTokens(const char *sourceCode)
         {
             orOperator(&lexer, &tokenArray);
         }
+        else if (current == '&')
+        {
+            andOperator(&lexer, &tokenArray);
+        }
         else
         {
             printf("%c was not supported by parse tokens\n", current);
             pop(&lexer);
         }
+
+        if (tokenArray.count > tokenCount)
+        {
+            tokenArray.tokens[tokenCount].location.line = line;
+        }
     }
 
     return tokenArray;
@@ -191,6 +210,10 @@ static char pop(Lexer *lexer)
 {
     char popped = lexer->sourceCode[lexer->current];
     lexer->current = lexer->current + 1;
+    if (popped == '\n')
+    {
+        lexer->line++;
+    }
     return popped;
 }
 
@@ -257,6 +280,11 @@ static void identifierOrKeyword(Lexer *lexer, TokenArray *tokenArray)
         {
             type = TOKEN_FOR;
         }
+
+        if (!strcmp("and", lexeme))
+        {
+            type = TOKEN_AND;
+        }
     }
 
     if (lexemeLength == 2)
@@ -265,6 +293,11 @@ static void identifierOrKeyword(Lexer *lexer, TokenArray *tokenArray)
         {
             type = TOKEN_IF;
         }
+
+        if (!strcmp("or", lexeme))
+        {
+            type = TOKEN_OR;
+        }
     }
 
     if (type == -1)
@@ -276,7 +309,6 @@ static void identifierOrKeyword(Lexer *lexer, TokenArray *tokenArray)
     token.lexeme = lexeme;
     token.location.start = start;
     token.location.end = end;
-    token.location.line = -1;
     token.type = type;
 
     writeToken(tokenArray, token);
@@ -352,9 +384,61 @@ static void bangOrNotEqual(Lexer *lexer, TokenArray *tokenArray)
     writeToken(tokenArray, token);
 }
 
+// Doubles hold every power of ten up to 10^22 exactly.
+static const double exactPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define MAX_EXACT_MANTISSA (1ULL << 53)
+
+static int consumeDigits(Lexer *lexer, uint64_t *mantissa, int *significantDigits)
+{
+    int count = 0;
+    while (isdigit(peek(lexer)))
+    {
+        int digit = pop(lexer) - '0';
+        if (*significantDigits > 0 || digit != 0)
+        {
+            (*significantDigits)++;
+        }
+        if (*significantDigits <= 19)
+        {
+            *mantissa = *mantissa * 10 + digit;
+        }
+        count++;
+    }
+    return count;
+}
+
+// The digits are gathered into an integer as they are consumed. When that integer fits in
+// a double's 53 bits and the point moves it by at most 10^22, one exact division gives the
+// correctly rounded value (Clinger's fast path), so the text is never read again. Other
+// literals fall back to strtod.
 static void digit(Lexer *lexer, TokenArray *tokenArray)
 {
-    writeToken(tokenArray, consumeSingleCharacter(lexer, TOKEN_NUMBER));
+    int start = lexer->current;
+    uint64_t mantissa = 0;
+    int significantDigits = 0;
+    consumeDigits(lexer, &mantissa, &significantDigits);
+
+    int fractionDigits = 0;
+    if (peek(lexer) == '.' && isdigit(lexer->sourceCode[lexer->current + 1]))
+    {
+        pop(lexer);
+        fractionDigits = consumeDigits(lexer, &mantissa, &significantDigits);
+    }
+
+    Token token = genToken(lexer, TOKEN_NUMBER, start, lexer->current);
+    if (significantDigits <= 19 && mantissa <= MAX_EXACT_MANTISSA && fractionDigits <= 22)
+    {
+        token.number = (double)mantissa / exactPowersOfTen[fractionDigits];
+    }
+    else
+    {
+        token.number = strtod(token.lexeme, NULL);
+    }
+    writeToken(tokenArray, token);
 }
 
 static void string(Lexer *lexer, TokenArray *tokenArray)
@@ -437,6 +521,16 @@ static void orOperator(Lexer * lexer, TokenArray *tokens)
     writeToken(tokens, genToken(lexer, TOKEN_OR, start, end));
 }
 
+static void andOperator(Lexer *lexer, TokenArray *tokens)
+{
+    int start = lexer->current;
+    pop(lexer);
+    pop(lexer);
+    int end = lexer->current;
+
+    writeToken(tokens, genToken(lexer, TOKEN_AND, start, end));
+}
+
 TokenArrayIterator tokensIterator(TokenArray array)
 {
     TokenArrayIterator iterator;
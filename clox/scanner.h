@@ -60,6 +60,8 @@ struct Token
     const char *lexeme;
     Location location;
     TokenType type;
+    // A TOKEN_NUMBER's value, worked out as its digits were scanned.
+    double number;
 };
 
 typedef struct TokenArray
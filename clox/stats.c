@@ -0,0 +1,93 @@
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "textbuffer.h"
+
+static ObjectStats objectStats;
+
+static const char *objectTypeNames[OBJ_TYPE_COUNT] = {
+    [ObjString] = "string",
+    [ObjFunction] = "function",
+};
+
+void initVmStats(VmStats *stats)
+{
+    memset(stats, 0, sizeof(VmStats));
+}
+
+bool areStatsEnabled()
+{
+#ifdef VM_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void countObjectAllocation(ObjType type, size_t size)
+{
+    objectStats.allocations[type]++;
+    objectStats.bytes[type] += size;
+}
+
+ObjectStats *getObjectStats()
+{
+    return &objectStats;
+}
+
+static void appendFamily(TextBuffer *text, const char *name, const char *type, const char *help)
+{
+    appendText(text, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static void appendCounter(TextBuffer *text, const char *name, const char *help, uint64_t value)
+{
+    appendFamily(text, name, "counter", help);
+    appendText(text, "%s_total %llu\n", name, (unsigned long long)value);
+}
+
+static void appendGauge(TextBuffer *text, const char *name, const char *help, int value)
+{
+    appendFamily(text, name, "gauge", help);
+    appendText(text, "%s %d\n", name, value);
+}
+
+char *formatOpenMetrics(VmStats *stats)
+{
+    TextBuffer text;
+    initTextBuffer(&text);
+
+    appendGauge(&text, "clox_stats_enabled", "1 when the VM was built with CLOX_STATS.", areStatsEnabled());
+
+    appendFamily(&text, "clox_instructions", "counter", "Instructions run by the interpreter, by opcode.");
+    for (int opCode = 0; opCode < OP_CODE_COUNT; opCode++)
+    {
+        if (stats->instructions[opCode] != 0)
+        {
+            appendText(&text, "clox_instructions_total{opcode=\"%s\"} %llu\n", getOpCodeName(opCode), (unsigned long long)stats->instructions[opCode]);
+        }
+    }
+
+    appendCounter(&text, "clox_calls", "Function calls, the script included.", stats->calls);
+    appendCounter(&text, "clox_tail_calls", "Calls that reused their caller's frame.", stats->tailCalls);
+    appendGauge(&text, "clox_max_frame_depth", "Most call frames in use at once.", stats->maxFrameDepth);
+    appendGauge(&text, "clox_max_stack_depth", "Most value stack slots reserved at once.", stats->maxStackDepth);
+    appendCounter(&text, "clox_global_reads", "Global variable lookups.", stats->globalReads);
+    appendCounter(&text, "clox_global_writes", "Global variable declarations and assignments.", stats->globalWrites);
+
+    // Unlike the counters above, these are not this VM's own, and the scope label says so.
+    appendFamily(&text, "clox_object_allocations", "counter", "Objects allocated by type, by every VM and compiler in the process, not only this VM.");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++)
+    {
+        appendText(&text, "clox_object_allocations_total{scope=\"process\",type=\"%s\"} %llu\n", objectTypeNames[type], (unsigned long long)objectStats.allocations[type]);
+    }
+    appendFamily(&text, "clox_object_bytes", "counter", "Bytes allocated for objects by type, by every VM and compiler in the process, not only this VM.");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++)
+    {
+        appendText(&text, "clox_object_bytes_total{scope=\"process\",type=\"%s\"} %llu\n", objectTypeNames[type], (unsigned long long)objectStats.bytes[type]);
+    }
+
+    appendText(&text, "# EOF\n");
+    return text.chars;
+}
@@ -0,0 +1,52 @@
+#ifndef STATS_HEADER
+#define STATS_HEADER
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "chunk.h"
+#include "object.h"
+
+// Building with CLOX_STATS counts what the VM does. Without it every counter below stays
+// at zero and the counting compiles away.
+#ifdef CLOX_STATS
+#define VM_STATS
+#endif
+
+typedef struct VmStats
+{
+    uint64_t instructions[OP_CODE_COUNT];
+    uint64_t calls;
+    uint64_t tailCalls;
+    // High-water marks of what calls reserved: frames in use and stack slots.
+    int maxFrameDepth;
+    int maxStackDepth;
+    uint64_t globalReads;
+    uint64_t globalWrites;
+} VmStats;
+
+// Objects are made without a VM at hand, so their counts are kept for the whole process.
+typedef struct ObjectStats
+{
+    uint64_t allocations[OBJ_TYPE_COUNT];
+    uint64_t bytes[OBJ_TYPE_COUNT];
+} ObjectStats;
+
+#ifdef VM_STATS
+#define COUNT_OBJECT_ALLOCATION(type, size) countObjectAllocation(type, size)
+#else
+#define COUNT_OBJECT_ALLOCATION(type, size) ((void)0)
+#endif
+
+void initVmStats(VmStats *);
+bool areStatsEnabled();
+
+void countObjectAllocation(ObjType, size_t);
+ObjectStats *getObjectStats();
+
+// The VM's counters and the object counters in the OpenMetrics text format, in a
+// malloc'd string the caller frees. The object counters are the process-wide ones, so
+// their samples carry scope="process".
+char *formatOpenMetrics(VmStats *);
+
+#endif
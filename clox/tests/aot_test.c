@@ -0,0 +1,119 @@
+#include "unity.h"
+#include "aot.h"
+#include "compiler.h"
+#include "functionobj.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static FunctionObj script;
+static char *source;
+
+void setUp()
+{
+    source = NULL;
+}
+
+void tearDown()
+{
+    free(source);
+    freeFunctionObj(&script);
+}
+
+static void compileTest(const char *sourceCode)
+{
+    initFunctionObj(&script);
+    TokenArrayIterator tokens = tokenize(sourceCode);
+    compile(&script, &tokens);
+    source = compileToC(&script);
+}
+
+void testItShouldTurnEachFunctionIntoACFunction()
+{
+    compileTest("func sum(a, b) { return a + b; } print sum(1, 2);");
+
+    TEST_ASSERT_NOT_NULL(source);
+    TEST_ASSERT_NOT_NULL(strstr(source, "static Value lox_sum_1(Value s0, Value s1)\n{"));
+    TEST_ASSERT_NOT_NULL(strstr(source, "s2 = add(s2, s3);"));
+    TEST_ASSERT_NOT_NULL(strstr(source, "s0 = lox_sum_1(s0, s1);"));
+    TEST_ASSERT_NOT_NULL(strstr(source, "int main(void)"));
+}
+
+void testItShouldTurnASelfTailCallIntoAJump()
+{
+    compileTest("func count(n) { if (n < 1) { return n; } return count(n - 1); } print count(5);");
+
+    TEST_ASSERT_NOT_NULL(source);
+    TEST_ASSERT_NOT_NULL(strstr(source, "    s0 = s1;\n    goto start;"));
+    TEST_ASSERT_NULL(strstr(source, "return lox_count_1("));
+}
+
+void testItShouldCallAFunctionValueThroughItsWrapper()
+{
+    // The arity mismatch makes the compiler fall back to calling the function as a value.
+    compileTest("func one(a) { return a; } print one();");
+
+    TEST_ASSERT_NOT_NULL(source);
+    TEST_ASSERT_NOT_NULL(strstr(source, "s0 = wrapObject((Obj *)&lox_one_1_value);"));
+    TEST_ASSERT_NOT_NULL(strstr(source, "s0 = callValue(s0, 0, NULL);"));
+    TEST_ASSERT_NOT_NULL(strstr(source, "return lox_one_1(argumentCount > 0 ? arguments[0] : nil());"));
+}
+
+void testItShouldPrintEachValueOnItsOwnLine()
+{
+    compileTest("print 1; print 2;");
+
+    TEST_ASSERT_NOT_NULL(source);
+    TEST_ASSERT_NOT_NULL(strstr(source, "    if (line != NULL)\n    {\n        puts(line);\n        free(line);\n    }\n"));
+    TEST_ASSERT_NULL(strstr(source, "fputs(line, stdout);"));
+}
+
+// Builds the generated program with the clox sources in the working directory, as the
+// tests are run from clox/, and returns everything it prints.
+static char *buildAndRun(const char *program)
+{
+    char directory[] = "/tmp/clox-aot-XXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(directory));
+
+    char path[64];
+    snprintf(path, sizeof(path), "%s/program.c", directory);
+    FILE *file = fopen(path, "w");
+    fputs(program, file);
+    fclose(file);
+
+    char command[256];
+    snprintf(command, sizeof(command), "cc -w -I. %s/program.c *.c -o %s/program -lm", directory, directory);
+    TEST_ASSERT_EQUAL(0, system(command));
+
+    snprintf(command, sizeof(command), "%s/program", directory);
+    FILE *output = popen(command, "r");
+    char *printed = calloc(256, sizeof(char));
+    fread(printed, sizeof(char), 255, output);
+    TEST_ASSERT_EQUAL(0, pclose(output));
+
+    snprintf(command, sizeof(command), "rm -r %s", directory);
+    system(command);
+    return printed;
+}
+
+void testItShouldBuildAProgramThatPrintsWhatTheVmPrints()
+{
+    compileTest("func fib(n) { if (n <= 1) { return n; } return fib(n - 2) + fib(n - 1); } print fib(10); print 1 / 4; print \"a\" + \"b\";");
+    TEST_ASSERT_NOT_NULL(source);
+
+    char *printed = buildAndRun(source);
+    TEST_ASSERT_EQUAL_STRING("55\n0.25\nab\n", printed);
+    free(printed);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testItShouldTurnEachFunctionIntoACFunction);
+    RUN_TEST(testItShouldTurnASelfTailCallIntoAJump);
+    RUN_TEST(testItShouldCallAFunctionValueThroughItsWrapper);
+    RUN_TEST(testItShouldPrintEachValueOnItsOwnLine);
+    RUN_TEST(testItShouldBuildAProgramThatPrintsWhatTheVmPrints);
+    return UNITY_END();
+}
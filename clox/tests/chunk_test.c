@@ -71,11 +71,88 @@ void testItShouldBeAbleToWriteShort()
     TEST_ASSERT_EQUAL(25, asShort);
 }
 
+void testItShouldBeAbleToWriteLong()
+{
+    writeLong(&testObject, UINT24_MAX);
+    TEST_ASSERT_EQUAL(3, testObject.count);
+    TEST_ASSERT_EQUAL(UINT24_MAX, readLong(&testObject, 0));
+
+    overwriteLong(&testObject, 0, 70000);
+
+    TEST_ASSERT_EQUAL(1, testObject.code[0]);
+    TEST_ASSERT_EQUAL(17, testObject.code[1]);
+    TEST_ASSERT_EQUAL(112, testObject.code[2]);
+    TEST_ASSERT_EQUAL(70000, readLong(&testObject, 0));
+}
+
+void testItShouldBeAbleToInsertGap()
+{
+    writeChunk(&testObject, 1);
+    writeChunk(&testObject, 2);
+    writeChunk(&testObject, 3);
+
+    insertChunkGap(&testObject, 1, 2);
+
+    TEST_ASSERT_EQUAL(5, testObject.count);
+    TEST_ASSERT_EQUAL(1, testObject.code[0]);
+    TEST_ASSERT_EQUAL(2, testObject.code[3]);
+    TEST_ASSERT_EQUAL(3, testObject.code[4]);
+}
+
+void testItShouldKeepOneLineStartPerLineChange()
+{
+    setChunkLine(&testObject, 1);
+    writeChunk(&testObject, OP_TRUE);
+    writeChunk(&testObject, OP_POP);
+    setChunkLine(&testObject, 4);
+    writeChunk(&testObject, OP_FALSE);
+    setChunkLine(&testObject, 4);
+    writeChunk(&testObject, OP_POP);
+    setChunkLine(&testObject, 2);
+    writeChunk(&testObject, OP_RETURN);
+
+    TEST_ASSERT_EQUAL(3, testObject.lineCount);
+    TEST_ASSERT_EQUAL(1, getLineAt(&testObject, 0));
+    TEST_ASSERT_EQUAL(1, getLineAt(&testObject, 1));
+    TEST_ASSERT_EQUAL(4, getLineAt(&testObject, 2));
+    TEST_ASSERT_EQUAL(4, getLineAt(&testObject, 3));
+    TEST_ASSERT_EQUAL(2, getLineAt(&testObject, 4));
+
+    // The gap belongs to the line before it, what followed keeps its own.
+    insertChunkGap(&testObject, 2, 2);
+    TEST_ASSERT_EQUAL(1, getLineAt(&testObject, 3));
+    TEST_ASSERT_EQUAL(4, getLineAt(&testObject, 4));
+    TEST_ASSERT_EQUAL(2, getLineAt(&testObject, 6));
+}
+
+void testItShouldHaveNoLinesUntilOneIsSet()
+{
+    writeChunk(&testObject, OP_RETURN);
+
+    TEST_ASSERT_EQUAL(0, testObject.lineCount);
+    TEST_ASSERT_EQUAL(0, getLineAt(&testObject, 0));
+}
+
+void testItShouldGiveEachCallItsStackEffect()
+{
+    // The callee goes with the arguments on a value call, a direct call never pushed it.
+    TEST_ASSERT_EQUAL(-2, getStackEffectFor(OP_CALL, 2));
+    TEST_ASSERT_EQUAL(-1, getStackEffectFor(OP_CALL_DIRECT, 2));
+    TEST_ASSERT_EQUAL(1, getStackEffectFor(OP_CALL_DIRECT_LONG, 0));
+    TEST_ASSERT_EQUAL(-1, getStackEffectFor(OP_RETURN, 0));
+    TEST_ASSERT_EQUAL(0, getStackEffectFor(OP_JUMP_IF_FALSE_PEEK, 0));
+}
+
 int main(void)
 {
     UNITY_BEGIN();
     RUN_TEST(testAddByteToChunk);
     RUN_TEST(testItShouldBeAbleToAddConstant);
     RUN_TEST(testItShouldBeAbleToWriteShort);
+    RUN_TEST(testItShouldBeAbleToWriteLong);
+    RUN_TEST(testItShouldBeAbleToInsertGap);
+    RUN_TEST(testItShouldKeepOneLineStartPerLineChange);
+    RUN_TEST(testItShouldHaveNoLinesUntilOneIsSet);
+    RUN_TEST(testItShouldGiveEachCallItsStackEffect);
     return UNITY_END();
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #include "value.h"
 #include "cloxstring.h"
 #include "functionobj.h"
+#include <stdio.h>
+#include <string.h>
 
 static char *test_messages[100];
 uint32_t test_messages_size = 0;
@@ -163,6 +165,175 @@ void testItShouldParseDivision()
     TEST_ASSERT_EQUAL_STRING("0004 OP_DIV\n", test_messages[3]);
 }
 
+void testItShouldShortCircuitOr()
+{
+    const char *sourceCode = "true || false";
+
+    disassembleTest(sourceCode);
+
+    TEST_ASSERT_EQUAL(6, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("=== test chunk ===\n", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0000 OP_TRUE\n", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("0001 OP_JUMP_IF_TRUE_PEEK 2\n", test_messages[2]);
+    TEST_ASSERT_EQUAL_STRING("0004 OP_POP\n", test_messages[3]);
+    TEST_ASSERT_EQUAL_STRING("0005 OP_FALSE\n", test_messages[4]);
+}
+
+void testItShouldShortCircuitAnd()
+{
+    const char *sourceCode = "true && false";
+
+    disassembleTest(sourceCode);
+
+    TEST_ASSERT_EQUAL(6, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("=== test chunk ===\n", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0000 OP_TRUE\n", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("0001 OP_JUMP_IF_FALSE_PEEK 2\n", test_messages[2]);
+    TEST_ASSERT_EQUAL_STRING("0004 OP_POP\n", test_messages[3]);
+    TEST_ASSERT_EQUAL_STRING("0005 OP_FALSE\n", test_messages[4]);
+}
+
+void testItShouldTestWhileConditionAtBottomOfLoop()
+{
+    const char *sourceCode = "while (false) {print 1;}";
+
+    disassembleTest(sourceCode);
+
+    TEST_ASSERT_EQUAL(7, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("=== test chunk ===\n", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0000 OP_JUMP 3\n", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("0003 OP_CONSTANT 0 1.000000\n", test_messages[2]);
+    TEST_ASSERT_EQUAL_STRING("0005 OP_PRINT\n", test_messages[3]);
+    TEST_ASSERT_EQUAL_STRING("0006 OP_FALSE\n", test_messages[4]);
+    TEST_ASSERT_EQUAL_STRING("0007 OP_LOOP_IF_TRUE 7\n", test_messages[5]);
+    TEST_ASSERT_EQUAL_STRING("0010 OP_RETURN\n", test_messages[6]);
+}
+
+void testItShouldCallKnownFunctionDirectly()
+{
+    const char *sourceCode = "{func foo(a) {print a;} foo(5);}";
+
+    disassembleTest(sourceCode);
+
+    TEST_ASSERT_EQUAL(5, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("=== test chunk ===\n", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0000 OP_CONSTANT 1 5.000000\n", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("0002 OP_CALL_DIRECT 0 foo\n", test_messages[2]);
+    TEST_ASSERT_EQUAL_STRING("0004 OP_POP\n", test_messages[3]);
+    TEST_ASSERT_EQUAL_STRING("0005 OP_RETURN\n", test_messages[4]);
+}
+
+void testItShouldTurnCallInReturnIntoTailCall()
+{
+    const char *sourceCode = "{func foo(n) { return foo(n); }}";
+
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize(sourceCode);
+    compile(&function, &tokens);
+
+    FunctionObj *foo = (FunctionObj *)unwrapObject(getConstantAt(function.bytecode, 0));
+    disassembleChunk(foo->bytecode, "foo", logWhenDisassemble);
+
+    TEST_ASSERT_EQUAL(5, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("=== foo ===\n", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0000 OP_VAR_EXPRESSION 0\n", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("0002 OP_TAIL_CALL_DIRECT 0 foo\n", test_messages[2]);
+    TEST_ASSERT_EQUAL_STRING("0004 OP_RETURN\n", test_messages[3]);
+}
+
+void testItShouldNotTailCallWhenCallIsNotLastInReturn()
+{
+    const char *sourceCode = "{func foo(n) { return foo(n) + 1; }}";
+
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize(sourceCode);
+    compile(&function, &tokens);
+
+    FunctionObj *foo = (FunctionObj *)unwrapObject(getConstantAt(function.bytecode, 0));
+    disassembleChunk(foo->bytecode, "foo", logWhenDisassemble);
+
+    TEST_ASSERT_EQUAL_STRING("0002 OP_CALL_DIRECT 0 foo\n", test_messages[2]);
+}
+
+void testItShouldUseLongConstantPastTwoHundredFiftySixConstants()
+{
+    char sourceCode[1024] = "1";
+    for (int i = 1; i < 257; i++)
+    {
+        strcat(sourceCode, "+1");
+    }
+
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize(sourceCode);
+    compile(&function, &tokens);
+
+    int lastConstantLocation = 2 + 255 * 3;
+    TEST_ASSERT_EQUAL(OP_CONSTANT, function.bytecode->code[lastConstantLocation - 3]);
+    TEST_ASSERT_EQUAL(OP_CONSTANT_LONG, function.bytecode->code[lastConstantLocation]);
+    TEST_ASSERT_EQUAL(256, readLong(function.bytecode, lastConstantLocation + 1));
+}
+
+void testItShouldUseLongLocalPastTwoHundredFiftySixLocals()
+{
+    char sourceCode[8192] = "{";
+    for (int i = 0; i < 300; i++)
+    {
+        char declaration[16];
+        snprintf(declaration, sizeof(declaration), "var a%d;", i);
+        strcat(sourceCode, declaration);
+    }
+    strcat(sourceCode, "print a299;}");
+
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize(sourceCode);
+    compile(&function, &tokens);
+
+    // OP_VAR_EXPRESSION_LONG, OP_PRINT, 300 OP_POPs and OP_RETURN end the bytecode
+    int expressionLocation = function.bytecode->count - 305;
+    TEST_ASSERT_EQUAL(OP_VAR_EXPRESSION_LONG, function.bytecode->code[expressionLocation]);
+    TEST_ASSERT_EQUAL(299, readShort(function.bytecode, expressionLocation + 1));
+    TEST_ASSERT_EQUAL(OP_PRINT, function.bytecode->code[expressionLocation + 3]);
+}
+
+void testItShouldRecordMaxStackDepth()
+{
+    const char *sourceCode = "{func foo(a) { var b = a; print a + b * 2; } print 1;}";
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize(sourceCode);
+    compile(&function, &tokens);
+
+    FunctionObj *foo = unwrapFunctionObj(getConstantAt(function.bytecode, 0));
+    // b, then a, b and 2 on top of it while the expression is evaluated
+    TEST_ASSERT_EQUAL(4, foo->maxStackDepth);
+    TEST_ASSERT_EQUAL(1, function.maxStackDepth);
+}
+
+void testItShouldRecordTheLineOfEachInstruction()
+{
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("print 1;\nprint 2 +\n3;");
+    compile(&function, &tokens);
+    Chunk *bytecode = function.bytecode;
+
+    TEST_ASSERT_EQUAL(OP_PRINT, bytecode->code[2]);
+    TEST_ASSERT_EQUAL(1, getLineAt(bytecode, 2));
+    TEST_ASSERT_EQUAL(2, getLineAt(bytecode, 3));
+    TEST_ASSERT_EQUAL(OP_CONSTANT, bytecode->code[5]);
+    TEST_ASSERT_EQUAL(3, getLineAt(bytecode, 5));
+    // The addition belongs to the line its operator is on.
+    TEST_ASSERT_EQUAL(OP_ADD, bytecode->code[7]);
+    TEST_ASSERT_EQUAL(2, getLineAt(bytecode, 7));
+    TEST_ASSERT_EQUAL(2, getLineAt(bytecode, getInstructionOffset(bytecode, 5)));
+
+    freeFunctionObj(&function);
+}
+
 int main(void)
 {
     UNITY_BEGIN();
@@ -175,5 +346,15 @@ int main(void)
     RUN_TEST(testItShouldBeAbleParseNegationOnBothSidesOfMultiplication);
     RUN_TEST(testItShouldParseBasicSubtraction);
     RUN_TEST(testItShouldParseDivision);
+    RUN_TEST(testItShouldShortCircuitOr);
+    RUN_TEST(testItShouldShortCircuitAnd);
+    RUN_TEST(testItShouldTestWhileConditionAtBottomOfLoop);
+    RUN_TEST(testItShouldCallKnownFunctionDirectly);
+    RUN_TEST(testItShouldTurnCallInReturnIntoTailCall);
+    RUN_TEST(testItShouldNotTailCallWhenCallIsNotLastInReturn);
+    RUN_TEST(testItShouldUseLongConstantPastTwoHundredFiftySixConstants);
+    RUN_TEST(testItShouldUseLongLocalPastTwoHundredFiftySixLocals);
+    RUN_TEST(testItShouldRecordMaxStackDepth);
+    RUN_TEST(testItShouldRecordTheLineOfEachInstruction);
     return UNITY_END();
 }
\ No newline at end of file
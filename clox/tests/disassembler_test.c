@@ -2,7 +2,10 @@
 #include "chunk.h"
 #include "stdint.h"
 #include "disassembler.h"
+#include <math.h>
 #include <stdlib.h>
+#include "functionobj.h"
+#include <string.h>
 
 char *disassembler_test_messages[100];
 int disassembler_test_size;
@@ -228,6 +231,146 @@ void testItShouldDisassembleOpOr()
     TEST_ASSERT_EQUAL_STRING("0000 OP_OR\n", disassembler_test_messages[1]);
 }
 
+void testItShouldDisassembleOpLoopIfTrue()
+{
+    writeChunk(&bytecode, OP_LOOP_IF_TRUE);
+    writeShort(&bytecode, 3);
+    disassembleChunk(&bytecode, "test chunk", logWhenDisassemble);
+    TEST_ASSERT_EQUAL(2, disassembler_test_size);
+    TEST_ASSERT_EQUAL_STRING("=== test chunk ===\n", disassembler_test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0000 OP_LOOP_IF_TRUE 3\n", disassembler_test_messages[1]);
+}
+
+void testItShouldDisassembleOpJumpIfFalsePeek()
+{
+    writeChunk(&bytecode, OP_JUMP_IF_FALSE_PEEK);
+    writeShort(&bytecode, 12);
+    disassembleChunk(&bytecode, "test chunk", logWhenDisassemble);
+    TEST_ASSERT_EQUAL(2, disassembler_test_size);
+    TEST_ASSERT_EQUAL_STRING("=== test chunk ===\n", disassembler_test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0000 OP_JUMP_IF_FALSE_PEEK 12\n", disassembler_test_messages[1]);
+}
+
+void testItShouldDisassembleOpJumpIfTruePeek()
+{
+    writeChunk(&bytecode, OP_JUMP_IF_TRUE_PEEK);
+    writeShort(&bytecode, 12);
+    disassembleChunk(&bytecode, "test chunk", logWhenDisassemble);
+    TEST_ASSERT_EQUAL(2, disassembler_test_size);
+    TEST_ASSERT_EQUAL_STRING("=== test chunk ===\n", disassembler_test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0000 OP_JUMP_IF_TRUE_PEEK 12\n", disassembler_test_messages[1]);
+}
+
+void testItShouldDisassembleOpCallDirect()
+{
+    FunctionObj callee;
+    initFunctionObj(&callee);
+    callee.name = asString("foo");
+
+    int constantIndex = addConstant(&bytecode, wrapObject((Obj *)&callee));
+    writeChunk(&bytecode, OP_CALL_DIRECT);
+    writeChunk(&bytecode, constantIndex);
+    disassembleChunk(&bytecode, "test chunk", logWhenDisassemble);
+    TEST_ASSERT_EQUAL(2, disassembler_test_size);
+    TEST_ASSERT_EQUAL_STRING("=== test chunk ===\n", disassembler_test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0000 OP_CALL_DIRECT 0 foo\n", disassembler_test_messages[1]);
+
+    freeStringObj(callee.name);
+    freeFunctionObj(&callee);
+}
+
+static FunctionObj callee;
+
+static void writeMixedChunk()
+{
+    initFunctionObj(&callee);
+    callee.name = asString("foo");
+
+    setChunkLine(&bytecode, 1);
+    writeChunk(&bytecode, OP_CONSTANT);
+    writeChunk(&bytecode, addConstant(&bytecode, wrapNumber(0.1)));
+    writeChunk(&bytecode, OP_CALL_DIRECT);
+    writeChunk(&bytecode, addConstant(&bytecode, wrapObject((Obj *)&callee)));
+    setChunkLine(&bytecode, 2);
+    writeChunk(&bytecode, OP_STRING);
+    writeString(&bytecode, "say \"hi\"");
+    writeChunk(&bytecode, OP_RETURN);
+}
+
+static void freeMixedChunk(DisassemblyOutput *output)
+{
+    freeDisassemblyOutput(output);
+    freeStringObj(callee.name);
+    freeFunctionObj(&callee);
+}
+
+void testItShouldStreamDisassemblyIntoABuffer()
+{
+    writeMixedChunk();
+    DisassemblyOutput output;
+    initDisassemblyToBuffer(&output, DISASSEMBLY_TEXT);
+    writeDisassembly(&output, &bytecode, "test chunk");
+
+    TEST_ASSERT_EQUAL_STRING("=== test chunk ===\n"
+                             "0000    1 OP_CONSTANT 0 0.1\n"
+                             "0002    | OP_CALL_DIRECT 1 \"foo\"\n"
+                             "0004    2 OP_STRING \"say \"hi\"\"\n"
+                             "0014    | OP_RETURN\n",
+                             output.chars);
+    TEST_ASSERT_EQUAL(strlen(output.chars), output.length);
+    freeMixedChunk(&output);
+}
+
+void testItShouldWriteDisassemblyAsJson()
+{
+    writeMixedChunk();
+    DisassemblyOutput output;
+    initDisassemblyToBuffer(&output, DISASSEMBLY_JSON);
+    writeDisassembly(&output, &bytecode, "test chunk");
+
+    TEST_ASSERT_EQUAL_STRING("{\"chunk\":\"test chunk\",\"offset\":0,\"opcode\":\"OP_CONSTANT\",\"operand\":0,\"constant\":0.1,\"line\":1}\n"
+                             "{\"chunk\":\"test chunk\",\"offset\":2,\"opcode\":\"OP_CALL_DIRECT\",\"operand\":1,\"constant\":\"foo\",\"line\":1}\n"
+                             "{\"chunk\":\"test chunk\",\"offset\":4,\"opcode\":\"OP_STRING\",\"operand\":null,\"constant\":\"say \\\"hi\\\"\",\"line\":2}\n"
+                             "{\"chunk\":\"test chunk\",\"offset\":14,\"opcode\":\"OP_RETURN\",\"operand\":null,\"constant\":null,\"line\":2}\n",
+                             output.chars);
+    freeMixedChunk(&output);
+}
+
+void testItShouldQuoteNumbersJsonCannotHold()
+{
+    writeChunk(&bytecode, OP_CONSTANT);
+    writeChunk(&bytecode, addConstant(&bytecode, wrapNumber(-INFINITY)));
+    writeChunk(&bytecode, OP_CONSTANT);
+    writeChunk(&bytecode, addConstant(&bytecode, wrapNumber(NAN)));
+    DisassemblyOutput output;
+    initDisassemblyToBuffer(&output, DISASSEMBLY_JSON);
+    writeDisassembly(&output, &bytecode, "a");
+
+    TEST_ASSERT_EQUAL_STRING("{\"chunk\":\"a\",\"offset\":0,\"opcode\":\"OP_CONSTANT\",\"operand\":0,\"constant\":\"-inf\",\"line\":null}\n"
+                             "{\"chunk\":\"a\",\"offset\":2,\"opcode\":\"OP_CONSTANT\",\"operand\":1,\"constant\":\"nan\",\"line\":null}\n",
+                             output.chars);
+    freeDisassemblyOutput(&output);
+}
+
+void testItShouldWriteDisassemblyAsCsv()
+{
+    writeMixedChunk();
+    DisassemblyOutput output;
+    initDisassemblyToBuffer(&output, DISASSEMBLY_CSV);
+    writeDisassembly(&output, &bytecode, "a");
+    writeDisassembly(&output, &bytecode, "b");
+
+    // The header is only written once, so chunks can be streamed into the same table.
+    const char *expected = "chunk,offset,opcode,operand,constant,line\n"
+                           "\"a\",0,OP_CONSTANT,0,0.1,1\n"
+                           "\"a\",2,OP_CALL_DIRECT,1,\"foo\",1\n"
+                           "\"a\",4,OP_STRING,,\"say \"\"hi\"\"\",2\n"
+                           "\"a\",14,OP_RETURN,,,2\n"
+                           "\"b\",0,OP_CONSTANT,0,0.1,1\n";
+    TEST_ASSERT_EQUAL_INT(0, strncmp(expected, output.chars, strlen(expected)));
+    freeMixedChunk(&output);
+}
+
 int main(void)
 {
     UNITY_BEGIN();
@@ -248,6 +391,14 @@ int main(void)
     RUN_TEST(testItShouldDisassembleOpLessThan);
     RUN_TEST(testItShouldDisassembleOpLessThanOrEquals);
     RUN_TEST(testItShouldDisassembleOpCall);
+    RUN_TEST(testItShouldDisassembleOpCallDirect);
     RUN_TEST(testItShouldDisassembleOpOr);
+    RUN_TEST(testItShouldDisassembleOpLoopIfTrue);
+    RUN_TEST(testItShouldDisassembleOpJumpIfFalsePeek);
+    RUN_TEST(testItShouldDisassembleOpJumpIfTruePeek);
+    RUN_TEST(testItShouldStreamDisassemblyIntoABuffer);
+    RUN_TEST(testItShouldWriteDisassemblyAsJson);
+    RUN_TEST(testItShouldQuoteNumbersJsonCannotHold);
+    RUN_TEST(testItShouldWriteDisassemblyAsCsv);
     return UNITY_END();
 }
\ No newline at end of file
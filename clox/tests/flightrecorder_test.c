@@ -0,0 +1,154 @@
+#include "unity.h"
+#include "flightrecorder.h"
+#include "compiler.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static FlightRecorder recorder;
+static char path[] = "/tmp/clox-flight-XXXXXX";
+static char *lines[100];
+static int lineCount;
+
+static void collectLine(char *line)
+{
+    if (lineCount < 100)
+    {
+        lines[lineCount++] = line;
+        return;
+    }
+    free(line);
+}
+
+static void ignoreOutput(char *line)
+{
+    free(line);
+}
+
+static void writeAndDecode()
+{
+    strcpy(path, "/tmp/clox-flight-XXXXXX");
+    int fileDescriptor = mkstemp(path);
+    TEST_ASSERT_TRUE(writeFlightRecording(&recorder, fileDescriptor));
+    close(fileDescriptor);
+    TEST_ASSERT_TRUE(decodeFlightRecording(path, collectLine));
+    remove(path);
+}
+
+void setUp()
+{
+    initFlightRecorder(&recorder, 3);
+    lineCount = 0;
+}
+
+void tearDown()
+{
+    freeFlightRecorder(&recorder);
+    for (int i = 0; i < lineCount; i++)
+    {
+        free(lines[i]);
+    }
+}
+
+void testItShouldKeepOnlyTheLastRecords()
+{
+    FunctionObj script;
+    initFunctionObj(&script);
+    TEST_ASSERT_EQUAL(4, recorder.capacity);
+
+    for (int i = 0; i < 6; i++)
+    {
+        recordFlight(&recorder, &script, i == 5 ? OP_RETURN : OP_ADD, i, i == 5 ? FLIGHT_EMPTY_STACK : VALUE_TYPE_NUMBER | FLIGHT_OPTIMIZED);
+    }
+    writeAndDecode();
+
+    TEST_ASSERT_EQUAL(5, lineCount);
+    TEST_ASSERT_EQUAL_STRING("=== last 4 of 6 instructions ===\n", lines[0]);
+    TEST_ASSERT_EQUAL_STRING("2 script 0002 OP_ADD top:number optimized\n", lines[1]);
+    TEST_ASSERT_EQUAL_STRING("5 script 0005 OP_RETURN top:-\n", lines[4]);
+    freeFunctionObj(&script);
+}
+
+void testItShouldRecordWhatAProgramRan()
+{
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("func fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); } print fib(9);");
+    compile(&function, &tokens);
+
+    VirtualMachine vm;
+    initVirtualMachine(&vm);
+    vm.onStdOut = ignoreOutput;
+    vm.hotCallThreshold = 5;
+    vm.recorder = &recorder;
+    prepareForCall(&vm, &function);
+    interpret(&vm);
+    writeAndDecode();
+
+    // The last instructions are the script's, printing what fib returned.
+    TEST_ASSERT_EQUAL(5, lineCount);
+    TEST_ASSERT_NOT_NULL(strstr(lines[3], " fib "));
+    TEST_ASSERT_NOT_NULL(strstr(lines[4], " script "));
+    TEST_ASSERT_NOT_NULL(strstr(lines[4], " OP_PRINT top:number\n"));
+    // Recording keeps the function interpreted, though it is still optimized.
+    TEST_ASSERT_NULL(unwrapFunctionObj(getConstantAt(function.bytecode, 0))->native);
+
+    freeVirtualMachine(&vm);
+    freeFunctionObj(&function);
+}
+
+#ifdef __linux__
+static sigjmp_buf recovered;
+static int earlierHandlerCalls;
+
+static void recoveringHandler(int signalNumber, siginfo_t *info, void *context)
+{
+    earlierHandlerCalls++;
+    siglongjmp(recovered, 1);
+}
+#endif
+
+void testItShouldLeaveAnEarlierHandlerToRecoverFirst()
+{
+#ifdef __linux__
+    struct sigaction action;
+    struct sigaction original;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = recoveringHandler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &original);
+
+    strcpy(path, "/tmp/clox-flight-XXXXXX");
+    close(mkstemp(path));
+    remove(path);
+    earlierHandlerCalls = 0;
+    TEST_ASSERT_TRUE(dumpFlightRecordingOnCrash(&recorder, path));
+    if (sigsetjmp(recovered, 1) == 0)
+    {
+        raise(SIGSEGV);
+    }
+
+    // The earlier handler recovered, so there was no crash to record.
+    TEST_ASSERT_EQUAL(1, earlierHandlerCalls);
+    TEST_ASSERT_EQUAL(-1, access(path, F_OK));
+
+    dumpFlightRecordingOnCrash(NULL, NULL);
+    sigaction(SIGSEGV, &original, NULL);
+#else
+    TEST_ASSERT_FALSE(dumpFlightRecordingOnCrash(&recorder, path));
+#endif
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testItShouldKeepOnlyTheLastRecords);
+    RUN_TEST(testItShouldRecordWhatAProgramRan);
+    RUN_TEST(testItShouldLeaveAnEarlierHandlerToRecoverFirst);
+    return UNITY_END();
+}
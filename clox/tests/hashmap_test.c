@@ -36,10 +36,19 @@ void testItShouldGetNilIfNoKeyExists() {
     TEST_ASSERT_TRUE(isNil(nil));
 }
 
+void testItShouldTellANilValueFromAMissingKey()
+{
+    hashMapPut(&testObject, asString("a"), nil());
+
+    TEST_ASSERT_TRUE(hashMapContains(&testObject, asString("a")));
+    TEST_ASSERT_FALSE(hashMapContains(&testObject, asString("b")));
+}
+
 int main(void)
 {
     UNITY_BEGIN();
     RUN_TEST(testItShouldPutValueInWithKey);
     RUN_TEST(testItShouldGetNilIfNoKeyExists);
+    RUN_TEST(testItShouldTellANilValueFromAMissingKey);
     return UNITY_END();
 }
\ No newline at end of file
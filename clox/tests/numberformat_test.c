@@ -0,0 +1,82 @@
+#include "unity.h"
+#include "numberformat.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char buffer[NUMBER_BUFFER_SIZE];
+
+static const char *format(double number)
+{
+    formatNumber(number, buffer);
+    return buffer;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void testItShouldWriteWholeNumbersWithoutAFraction()
+{
+    TEST_ASSERT_EQUAL_STRING("8", format(8));
+    TEST_ASSERT_EQUAL_STRING("0", format(0));
+    TEST_ASSERT_EQUAL_STRING("-0", format(-0.0));
+    TEST_ASSERT_EQUAL_STRING("-42", format(-42));
+    TEST_ASSERT_EQUAL_STRING("9007199254740992", format(9007199254740992.0));
+    TEST_ASSERT_EQUAL_STRING("100000000000000000000", format(1e20));
+}
+
+void testItShouldWriteTheShortestDigitsThatReadBack()
+{
+    TEST_ASSERT_EQUAL_STRING("0.1", format(0.1));
+    TEST_ASSERT_EQUAL_STRING("0.30000000000000004", format(0.1 + 0.2));
+    TEST_ASSERT_EQUAL_STRING("0.3333333333333333", format(1.0 / 3));
+    TEST_ASSERT_EQUAL_STRING("-2.5", format(-2.5));
+    TEST_ASSERT_EQUAL_STRING("123456789012345680", format(123456789012345678.0));
+}
+
+void testItShouldUseAnExponentForVeryLargeAndSmallNumbers()
+{
+    TEST_ASSERT_EQUAL_STRING("1e+21", format(1e21));
+    TEST_ASSERT_EQUAL_STRING("0.000001", format(1e-6));
+    TEST_ASSERT_EQUAL_STRING("1.5e-7", format(1.5e-7));
+    TEST_ASSERT_EQUAL_STRING("5e-324", format(5e-324));
+    TEST_ASSERT_EQUAL_STRING("1.7976931348623157e+308", format(1.7976931348623157e308));
+    TEST_ASSERT_EQUAL_STRING("-inf", format(-INFINITY));
+    TEST_ASSERT_EQUAL_STRING("nan", format(NAN));
+}
+
+void testItShouldReadBackAsTheSameDouble()
+{
+    srand(49);
+    for (int i = 0; i < 100000; i++)
+    {
+        uint64_t bits = ((uint64_t)rand() << 62) ^ ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+        if (isnan(number))
+        {
+            continue;
+        }
+
+        int length = formatNumber(number, buffer);
+        TEST_ASSERT_LESS_THAN(NUMBER_BUFFER_SIZE, length);
+        double readBack = strtod(buffer, NULL);
+        TEST_ASSERT_EQUAL_MEMORY_MESSAGE(&number, &readBack, sizeof(number), buffer);
+    }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testItShouldWriteWholeNumbersWithoutAFraction);
+    RUN_TEST(testItShouldWriteTheShortestDigitsThatReadBack);
+    RUN_TEST(testItShouldUseAnExponentForVeryLargeAndSmallNumbers);
+    RUN_TEST(testItShouldReadBackAsTheSameDouble);
+    return UNITY_END();
+}
@@ -0,0 +1,91 @@
+#include "unity.h"
+#include "opcodeprofile.h"
+#include "compiler.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+static OpcodeProfile profile;
+static Instruction instructions[8];
+static char *lines[200];
+static int lineCount;
+
+static void collectLine(char *line)
+{
+    lines[lineCount++] = line;
+}
+
+static void ignoreOutput(char *line)
+{
+    free(line);
+}
+
+void setUp()
+{
+    initOpcodeProfile(&profile);
+    lineCount = 0;
+}
+
+void tearDown()
+{
+    freeOpcodeProfile(&profile);
+    for (int i = 0; i < lineCount; i++)
+    {
+        free(lines[i]);
+    }
+}
+
+void testItShouldOnlyCountSequencesThatRunInAStraightLine()
+{
+    instructions[0].opCode = OP_VAR_EXPRESSION;
+    instructions[1].opCode = OP_CONSTANT;
+    instructions[2].opCode = OP_ADD;
+    instructions[3].opCode = OP_JUMP;
+    instructions[6].opCode = OP_POP;
+
+    recordInstruction(&profile, &instructions[0], VALUE_TYPE_NUMBER);
+    recordInstruction(&profile, &instructions[1], VALUE_TYPE_NUMBER);
+    recordInstruction(&profile, &instructions[2], VALUE_TYPE_NUMBER);
+    recordInstruction(&profile, &instructions[3], OPERAND_NONE);
+    recordInstruction(&profile, &instructions[6], VALUE_TYPE_NUMBER);
+
+    TEST_ASSERT_EQUAL(1, profile.bigrams[OP_VAR_EXPRESSION][OP_CONSTANT]);
+    TEST_ASSERT_EQUAL(1, profile.bigrams[OP_ADD][OP_JUMP]);
+    TEST_ASSERT_EQUAL(0, profile.bigrams[OP_JUMP][OP_POP]);
+    TEST_ASSERT_EQUAL(1, getTrigramCount(&profile, OP_VAR_EXPRESSION, OP_CONSTANT, OP_ADD));
+    TEST_ASSERT_EQUAL(1, getTrigramCount(&profile, OP_CONSTANT, OP_ADD, OP_JUMP));
+    TEST_ASSERT_EQUAL(3, profile.shapes[OP_ADD][VALUE_TYPE_NUMBER] + profile.shapes[OP_CONSTANT][VALUE_TYPE_NUMBER] + profile.shapes[OP_POP][VALUE_TYPE_NUMBER]);
+}
+
+void testItShouldProfileTheBytecodeOfAHotLoop()
+{
+    Interpreter interpreter;
+    initInterpreter(&interpreter);
+    interpreter.onStdOut = ignoreOutput;
+    interpreter.vm.hotCallThreshold = 1;
+    interpreter.vm.hotLoopThreshold = 1;
+    interpreter.vm.profile = &profile;
+
+    runInterpreter(&interpreter, "{var i = 0; while (i < 9) { i = i + 1; } print i;}");
+
+    // The loop stays unoptimized while it is profiled.
+    TEST_ASSERT_EQUAL(0, profile.counts[OP_LOCAL_INCREMENT]);
+    TEST_ASSERT_EQUAL(9, profile.counts[OP_ADD]);
+    TEST_ASSERT_EQUAL(9, getTrigramCount(&profile, OP_VAR_EXPRESSION, OP_CONSTANT, OP_ADD));
+    TEST_ASSERT_EQUAL(10, profile.shapes[OP_LESS_THAN][VALUE_TYPE_NUMBER]);
+    TEST_ASSERT_EQUAL(1, profile.shapes[OP_PRINT][VALUE_TYPE_NUMBER]);
+
+    reportOpcodeProfile(&profile, 3, collectLine);
+    TEST_ASSERT_EQUAL_STRING("=== superinstruction candidates ===\n", lines[1]);
+    TEST_ASSERT_NOT_NULL(strstr(lines[2], "10 OP_CONSTANT OP_LESS_THAN OP_LOOP_IF_TRUE\n"));
+
+    freeInterpreter(&interpreter);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testItShouldOnlyCountSequencesThatRunInAStraightLine);
+    RUN_TEST(testItShouldProfileTheBytecodeOfAHotLoop);
+    return UNITY_END();
+}
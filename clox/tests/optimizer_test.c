@@ -0,0 +1,107 @@
+#include "unity.h"
+#include "optimizer.h"
+#include "compiler.h"
+#include "vm.h"
+#include "functionobj.h"
+#include <stdlib.h>
+
+static Instruction decoded[16];
+static int newIndexOf[16];
+static Instruction *optimized;
+
+void setUp()
+{
+    optimized = NULL;
+}
+
+void tearDown()
+{
+    free(optimized);
+}
+
+static void constantAt(int index, double number)
+{
+    decoded[index].opCode = OP_CONSTANT;
+    decoded[index].as.constant = wrapNumber(number);
+}
+
+static void opAt(int index, OpCode opCode)
+{
+    decoded[index].opCode = opCode;
+}
+
+void testItShouldFoldConstantExpressions()
+{
+    // 9 * 9 * 9 - 1
+    constantAt(0, 9);
+    constantAt(1, 9);
+    opAt(2, OP_MULT);
+    constantAt(3, 9);
+    opAt(4, OP_MULT);
+    constantAt(5, 1);
+    opAt(6, OP_SUB);
+    opAt(7, OP_PRINT);
+    opAt(8, OP_RETURN);
+
+    int count;
+    optimized = optimizeInstructions(decoded, 9, &count, newIndexOf);
+
+    TEST_ASSERT_EQUAL(3, count);
+    TEST_ASSERT_EQUAL(OP_CONSTANT, optimized[0].opCode);
+    TEST_ASSERT_EQUAL(728.0, unwrapNumber(optimized[0].as.constant));
+    TEST_ASSERT_EQUAL(OP_PRINT, optimized[1].opCode);
+    TEST_ASSERT_EQUAL(1, newIndexOf[7]);
+}
+
+void testItShouldNotFoldAcrossAJumpTarget()
+{
+    opAt(0, OP_JUMP);
+    decoded[0].as.target = &decoded[2];
+    constantAt(1, 1);
+    constantAt(2, 2);
+    opAt(3, OP_ADD);
+    opAt(4, OP_RETURN);
+
+    int count;
+    optimized = optimizeInstructions(decoded, 5, &count, newIndexOf);
+
+    TEST_ASSERT_EQUAL(5, count);
+    TEST_ASSERT_EQUAL_PTR(&optimized[2], optimized[0].as.target);
+}
+
+void testItShouldFuseLoopIncrementAndCondition()
+{
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("{var i = 0; while (i < 5) { i = i + 1; } print i;}");
+    compile(&function, &tokens);
+
+    VirtualMachine vm;
+    initVirtualMachine(&vm);
+    prepareForCall(&vm, &function);
+
+    int count;
+    optimized = optimizeInstructions(function.decoded, function.decodedCount, &count, newIndexOf);
+
+    // OP_VAR_DECL, OP_CONSTANT, OP_VAR_ASSIGN, OP_JUMP, then the loop body and condition
+    Instruction *increment = &optimized[4];
+    Instruction *condition = &optimized[5];
+    TEST_ASSERT_EQUAL(OP_LOCAL_INCREMENT, increment->opCode);
+    TEST_ASSERT_EQUAL(OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT, condition->opCode);
+    TEST_ASSERT_EQUAL_PTR(condition, optimized[3].as.target);
+    TEST_ASSERT_EQUAL_PTR(increment, condition->as.local.target);
+    TEST_ASSERT_EQUAL(0, condition->as.local.slot);
+    TEST_ASSERT_EQUAL(5.0, unwrapNumber(condition->as.local.constant));
+
+    freeVirtualMachine(&vm);
+    freeFunctionObj(&function);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testItShouldFoldConstantExpressions);
+    RUN_TEST(testItShouldNotFoldAcrossAJumpTarget);
+    RUN_TEST(testItShouldFuseLoopIncrementAndCondition);
+    return UNITY_END();
+}
@@ -0,0 +1,171 @@
+#include "unity.h"
+#include "outputsink.h"
+#include "compiler.h"
+#include "cloxstring.h"
+#include "vm.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char flushed[256];
+static int flushCount;
+
+static void collectFlush(const char *chars, int length)
+{
+    memcpy(flushed + strlen(flushed), chars, length);
+    flushCount++;
+}
+
+void setUp()
+{
+    memset(flushed, 0, sizeof(flushed));
+    flushCount = 0;
+}
+
+void tearDown()
+{
+}
+
+void testItShouldHandPrintsOnInOneFlush()
+{
+    OutputSink sink;
+    initOutputSink(&sink, -1, OUTPUT_SINK_DEFAULT_CAPACITY);
+    sink.onFlush = collectFlush;
+
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("print 1; print true; print \"a\" + \"b\";");
+    compile(&function, &tokens);
+
+    VirtualMachine vm;
+    initVirtualMachine(&vm);
+    vm.output = &sink;
+    prepareForCall(&vm, &function);
+    interpret(&vm);
+
+    TEST_ASSERT_EQUAL(1, flushCount);
+    TEST_ASSERT_EQUAL_STRING("1\ntrue\nab\n", flushed);
+
+    freeVirtualMachine(&vm);
+    freeFunctionObj(&function);
+    freeOutputSink(&sink);
+}
+
+void testItShouldFlushWhenTheBufferFillsUp()
+{
+    OutputSink sink;
+    initOutputSink(&sink, -1, 12);
+    sink.onFlush = collectFlush;
+
+    writeValueLine(&sink, wrapNumber(1), NUMBER_FORMAT_FIXED);
+    writeValueLine(&sink, wrapNumber(2), NUMBER_FORMAT_FIXED);
+    TEST_ASSERT_EQUAL(1, flushCount);
+    TEST_ASSERT_EQUAL_STRING("1.000000\n", flushed);
+
+    // A number longer than the whole buffer grows it rather than being cut short.
+    writeValueLine(&sink, wrapNumber(1e20), NUMBER_FORMAT_FIXED);
+    freeOutputSink(&sink);
+    TEST_ASSERT_EQUAL(3, flushCount);
+    TEST_ASSERT_EQUAL_STRING("1.000000\n2.000000\n100000000000000000000.000000\n", flushed);
+}
+
+void testItShouldWriteToAFileDescriptor()
+{
+    int ends[2];
+    TEST_ASSERT_EQUAL(0, pipe(ends));
+    OutputSink sink;
+    initOutputSink(&sink, ends[1], 16);
+
+    StringObj *string = asString("longer than the buffer");
+    writeValueLine(&sink, wrapNumber(7), NUMBER_FORMAT_FIXED);
+    writeValueLine(&sink, wrapObject((Obj *)string), NUMBER_FORMAT_FIXED);
+    TEST_ASSERT_EQUAL(0, sink.length);
+    writeOutput(&sink, "end", 3);
+    freeOutputSink(&sink);
+    close(ends[1]);
+
+    char written[64] = {0};
+    int length = 0;
+    int count;
+    while ((count = read(ends[0], written + length, sizeof(written) - 1 - length)) > 0)
+    {
+        length += count;
+    }
+    close(ends[0]);
+    TEST_ASSERT_EQUAL_STRING("7.000000\nlonger than the buffer\nend", written);
+    freeStringObj(string);
+}
+
+static char *reportedError;
+
+static void collectError(char *message)
+{
+    free(reportedError);
+    reportedError = message;
+}
+
+void testItShouldKeepAFailedWriteUntilTheLastFlush()
+{
+    // Every write to /dev/full fails.
+    int fileDescriptor = open("/dev/full", O_WRONLY);
+    TEST_ASSERT_TRUE(fileDescriptor >= 0);
+    OutputSink sink;
+    initOutputSink(&sink, fileDescriptor, 8);
+
+    writeOutput(&sink, "longer than the buffer", 22);
+    TEST_ASSERT_EQUAL(0, sink.length);
+    TEST_ASSERT_FALSE(flushOutput(&sink));
+
+    // The whole line goes out in one writev, which fails the same way.
+    OutputSink lineSink;
+    initOutputSink(&lineSink, fileDescriptor, 8);
+    StringObj *string = asString("longer than the buffer");
+    writeValueLine(&lineSink, wrapObject((Obj *)string), NUMBER_FORMAT_FIXED);
+    writeOutput(&lineSink, "ok", 2);
+    TEST_ASSERT_FALSE(flushOutput(&lineSink));
+
+    freeOutputSink(&lineSink);
+    freeOutputSink(&sink);
+    freeStringObj(string);
+    close(fileDescriptor);
+}
+
+void testItShouldReportOutputItCouldNotWrite()
+{
+    int fileDescriptor = open("/dev/full", O_WRONLY);
+    OutputSink sink;
+    initOutputSink(&sink, fileDescriptor, 8);
+
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("print 1; print 2;");
+    compile(&function, &tokens);
+
+    VirtualMachine vm;
+    initVirtualMachine(&vm);
+    vm.output = &sink;
+    vm.onStdErr = collectError;
+    reportedError = NULL;
+    prepareForCall(&vm, &function);
+    interpret(&vm);
+
+    TEST_ASSERT_EQUAL_STRING("Could not write output.", reportedError);
+
+    free(reportedError);
+    freeVirtualMachine(&vm);
+    freeFunctionObj(&function);
+    freeOutputSink(&sink);
+    close(fileDescriptor);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testItShouldHandPrintsOnInOneFlush);
+    RUN_TEST(testItShouldFlushWhenTheBufferFillsUp);
+    RUN_TEST(testItShouldWriteToAFileDescriptor);
+    RUN_TEST(testItShouldKeepAFailedWriteUntilTheLastFlush);
+    RUN_TEST(testItShouldReportOutputItCouldNotWrite);
+    return UNITY_END();
+}
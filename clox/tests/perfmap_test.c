@@ -0,0 +1,97 @@
+#include "unity.h"
+#include "perfmap.h"
+#include "compiler.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static PerfMap perfMap;
+static char perfMapPath[64];
+static char jitdumpPath[64];
+
+static void ignoreOutput(char *line)
+{
+    free(line);
+}
+
+static char *readFile(const char *path, long *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+    char *contents = calloc(*size + 1, 1);
+    fread(contents, 1, *size, file);
+    fclose(file);
+    return contents;
+}
+
+void setUp()
+{
+    snprintf(perfMapPath, sizeof(perfMapPath), "/tmp/perf-%d.map", (int)getpid());
+    snprintf(jitdumpPath, sizeof(jitdumpPath), "/tmp/jit-%d.dump", (int)getpid());
+    remove(perfMapPath);
+    remove(jitdumpPath);
+}
+
+void tearDown()
+{
+    remove(perfMapPath);
+    remove(jitdumpPath);
+}
+
+void testItShouldNameTheCodeTheJitWrites()
+{
+    bool isOpen = openPerfMap(&perfMap, "/tmp");
+#ifndef PERF_MAP_AVAILABLE
+    TEST_ASSERT_FALSE(isOpen);
+    return;
+#endif
+    TEST_ASSERT_TRUE(isOpen);
+
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("func sum(n) { var total = 0; while (0 < n) { total = total + n; n = n - 1; } return total; } print sum(9 * 9);");
+    compile(&function, &tokens);
+
+    VirtualMachine vm;
+    initVirtualMachine(&vm);
+    vm.onStdOut = ignoreOutput;
+    vm.useJit = true;
+    vm.hotLoopThreshold = 3;
+    vm.hotTraceThreshold = 3;
+    vm.perfMap = &perfMap;
+    prepareForCall(&vm, &function);
+    interpret(&vm);
+    closePerfMap(&perfMap);
+
+    long size;
+    char *map = readFile(perfMapPath, &size);
+    TEST_ASSERT_NOT_NULL(map);
+    TEST_ASSERT_NOT_NULL(strstr(map, " lox:sum\n"));
+    TEST_ASSERT_NOT_NULL(strstr(map, " lox:sum:trace@"));
+    free(map);
+
+    char *jitdump = readFile(jitdumpPath, &size);
+    TEST_ASSERT_NOT_NULL(jitdump);
+    TEST_ASSERT_EQUAL_HEX32(0x4A695444, *(uint32_t *)jitdump);
+    // The first code load record follows the 40 byte header, its name its 56 byte start.
+    TEST_ASSERT_EQUAL(0, *(uint32_t *)(jitdump + 40));
+    TEST_ASSERT_EQUAL_STRING("lox:sum", jitdump + 40 + 56);
+    free(jitdump);
+
+    freeVirtualMachine(&vm);
+    freeFunctionObj(&function);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testItShouldNameTheCodeTheJitWrites);
+    return UNITY_END();
+}
@@ -0,0 +1,214 @@
+#include "unity.h"
+#include "profiler.h"
+#include "compiler.h"
+#include "vm.h"
+#include "functionobj.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static VirtualMachine vm;
+static SamplingProfiler profiler;
+static char *lines[100];
+static int lineCount;
+
+static void collectLine(char *line)
+{
+    lines[lineCount++] = line;
+}
+
+static void ignoreOutput(char *line)
+{
+    free(line);
+}
+
+void setUp()
+{
+    initVirtualMachine(&vm);
+    initSamplingProfiler(&profiler, &vm, 16);
+    lineCount = 0;
+}
+
+void tearDown()
+{
+    freeSamplingProfiler(&profiler);
+    freeVirtualMachine(&vm);
+    for (int i = 0; i < lineCount; i++)
+    {
+        free(lines[i]);
+    }
+}
+
+void testItShouldFoldTheSampledCallStacks()
+{
+    Instruction code[4];
+    FunctionObj script;
+    FunctionObj fib;
+    initFunctionObj(&script);
+    initFunctionObj(&fib);
+    fib.name = asString("fib");
+    script.decoded = code;
+    script.decodedCount = 4;
+    fib.decoded = code;
+    fib.decodedCount = 4;
+
+    CallFrame frames[3];
+    frames[0].function = &script;
+    frames[0].ip = &code[1];
+    frames[1].function = &fib;
+    frames[1].ip = &code[2];
+    frames[2].function = &fib;
+    frames[2].ip = &code[3];
+    vm.frames = frames;
+
+    vm.fp = 2;
+    sampleCallStack(&profiler);
+    sampleCallStack(&profiler);
+    vm.fp = 1;
+    sampleCallStack(&profiler);
+    vm.frames = NULL;
+    vm.fp = -1;
+
+    writeFoldedStacks(&profiler, collectLine);
+    TEST_ASSERT_EQUAL(2, lineCount);
+    TEST_ASSERT_EQUAL_STRING("script;fib 1\n", lines[0]);
+    TEST_ASSERT_EQUAL_STRING("script;fib;fib 2\n", lines[1]);
+
+    reportSamplingProfile(&profiler, collectLine);
+    TEST_ASSERT_EQUAL_STRING("3 samples at 0 a second, 0 dropped\n", lines[2]);
+    // Recursing does not count fib twice towards its total.
+    TEST_ASSERT_NOT_NULL(strstr(lines[6], "fib "));
+    TEST_ASSERT_NOT_NULL(strstr(lines[6], " 3 100.00%"));
+    TEST_ASSERT_NOT_NULL(strstr(lines[9], "fib "));
+    TEST_ASSERT_NOT_NULL(strstr(lines[9], "3      -          2"));
+
+    fib.decoded = NULL;
+    script.decoded = NULL;
+    freeFunctionObj(&fib);
+    freeFunctionObj(&script);
+}
+
+void testItShouldDropSamplesWhenTheBufferIsFull()
+{
+    FunctionObj script;
+    initFunctionObj(&script);
+    CallFrame frame;
+    frame.function = &script;
+    frame.ip = NULL;
+    vm.frames = &frame;
+    vm.fp = 0;
+
+    for (int i = 0; i < 20; i++)
+    {
+        sampleCallStack(&profiler);
+    }
+    TEST_ASSERT_EQUAL(16, atomic_load(&profiler.head));
+    TEST_ASSERT_EQUAL(4, atomic_load(&profiler.dropped));
+
+    discardSamples(&profiler);
+    sampleCallStack(&profiler);
+    TEST_ASSERT_EQUAL(17, atomic_load(&profiler.head));
+
+    vm.frames = NULL;
+    vm.fp = -1;
+    freeFunctionObj(&script);
+}
+
+void testItShouldWriteTheFoldedStacksToAFile()
+{
+    FunctionObj script;
+    initFunctionObj(&script);
+    CallFrame frame;
+    frame.function = &script;
+    frame.ip = NULL;
+    vm.frames = &frame;
+    vm.fp = 0;
+    sampleCallStack(&profiler);
+    sampleCallStack(&profiler);
+    vm.frames = NULL;
+    vm.fp = -1;
+
+    char path[] = "/tmp/clox_folded_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    TEST_ASSERT_TRUE(writeFoldedStacksToFile(&profiler, path));
+
+    FILE *file = fopen(path, "r");
+    char contents[64] = "";
+    fgets(contents, sizeof(contents), file);
+    fclose(file);
+    remove(path);
+    TEST_ASSERT_EQUAL_STRING("script 2\n", contents);
+
+    TEST_ASSERT_FALSE(writeFoldedStacksToFile(&profiler, "/nonexistent/folded"));
+    freeFunctionObj(&script);
+}
+
+void testItShouldWriteTheReportToAFile()
+{
+    FunctionObj script;
+    initFunctionObj(&script);
+    CallFrame frame;
+    frame.function = &script;
+    frame.ip = NULL;
+    vm.frames = &frame;
+    vm.fp = 0;
+    sampleCallStack(&profiler);
+    vm.frames = NULL;
+    vm.fp = -1;
+
+    char path[] = "/tmp/clox_report_XXXXXX";
+    int fd = mkstemp(path);
+    TEST_ASSERT_TRUE(fd >= 0);
+    close(fd);
+    TEST_ASSERT_TRUE(writeSamplingProfileToFile(&profiler, path));
+
+    FILE *file = fopen(path, "r");
+    char contents[64] = "";
+    fgets(contents, sizeof(contents), file);
+    fclose(file);
+    remove(path);
+    TEST_ASSERT_EQUAL(0, strncmp(contents, "1 samples at ", strlen("1 samples at ")));
+
+    freeFunctionObj(&script);
+}
+
+void testItShouldSampleARunningScript()
+{
+#ifdef SAMPLING_PROFILER_AVAILABLE
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("func fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); } print fib(9 * 3);");
+    compile(&function, &tokens);
+    vm.onStdOut = ignoreOutput;
+
+    freeSamplingProfiler(&profiler);
+    initSamplingProfiler(&profiler, &vm, 4096);
+    TEST_ASSERT_TRUE(startSamplingProfiler(&profiler, 1000));
+    TEST_ASSERT_FALSE(startSamplingProfiler(&profiler, 1000));
+    prepareForCall(&vm, &function);
+    interpret(&vm);
+    stopSamplingProfiler(&profiler);
+
+    TEST_ASSERT_TRUE(atomic_load(&profiler.head) > 0);
+    writeFoldedStacks(&profiler, collectLine);
+    TEST_ASSERT_EQUAL(0, strncmp(lines[0], "script;fib", strlen("script;fib")));
+
+    freeFunctionObj(&function);
+#else
+    TEST_ASSERT_FALSE(startSamplingProfiler(&profiler, 1000));
+#endif
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testItShouldFoldTheSampledCallStacks);
+    RUN_TEST(testItShouldDropSamplesWhenTheBufferIsFull);
+    RUN_TEST(testItShouldWriteTheFoldedStacksToAFile);
+    RUN_TEST(testItShouldWriteTheReportToAFile);
+    RUN_TEST(testItShouldSampleARunningScript);
+    return UNITY_END();
+}
@@ -1,5 +1,7 @@
 #include "unity.h"
 #include "scanner.h"
+#include <stdio.h>
+#include <stdlib.h>
 
 void setUp() {}
 
@@ -21,6 +23,16 @@ void testItShouldParsePrintExpression()
     TEST_ASSERT_EQUAL(TOKEN_SEMICOLON, tokenArray.tokens[2].type);
 }
 
+void testItShouldStopAtTrailingWhitespace()
+{
+    const char *sourceCode = "print 1;\n";
+    TokenArray tokenArray = parseTokens(sourceCode);
+    TEST_ASSERT_EQUAL(3, tokenArray.count);
+
+    TEST_ASSERT_EQUAL_STRING(";", tokenArray.tokens[2].lexeme);
+    TEST_ASSERT_EQUAL(TOKEN_SEMICOLON, tokenArray.tokens[2].type);
+}
+
 void testItShouldParseAddition()
 {
     const char *sourceCode = "print 1 + 2;";
@@ -141,13 +153,46 @@ void testItShouldBeAbleToDoOr()
     TEST_ASSERT_EQUAL_STRING(";", semicolon.lexeme);
 }
 
+void testItShouldWorkOutTheValueOfNumbers()
+{
+    const char *sourceCode = "print 1234 + 0.05 + 12345678901234567890.5;";
+    TokenArray tokenArray = parseTokens(sourceCode);
+    TEST_ASSERT_EQUAL(7, tokenArray.count);
+
+    TEST_ASSERT_EQUAL_STRING("1234", tokenArray.tokens[1].lexeme);
+    TEST_ASSERT_TRUE(tokenArray.tokens[1].number == 1234);
+    TEST_ASSERT_EQUAL_STRING("0.05", tokenArray.tokens[3].lexeme);
+    TEST_ASSERT_TRUE(tokenArray.tokens[3].number == 0.05);
+    // Too many digits for the fast path.
+    TEST_ASSERT_TRUE(tokenArray.tokens[5].number == 12345678901234567890.5);
+}
+
+void testItShouldReadNumbersTheWayStrtodDoes()
+{
+    srand(50);
+    char sourceCode[64];
+    for (int i = 0; i < 10000; i++)
+    {
+        snprintf(sourceCode, sizeof(sourceCode), "%d.%0*d", rand() % 100000, rand() % 12 + 1, rand());
+        TokenArray tokenArray = parseTokens(sourceCode);
+        TEST_ASSERT_EQUAL(1, tokenArray.count);
+        TEST_ASSERT_TRUE_MESSAGE(tokenArray.tokens[0].number == strtod(sourceCode, NULL), sourceCode);
+
+        free((char *)tokenArray.tokens[0].lexeme);
+        free(tokenArray.tokens);
+    }
+}
+
 int main(void)
 {
     UNITY_BEGIN();
     RUN_TEST(testItShouldParsePrintExpression);
+    RUN_TEST(testItShouldStopAtTrailingWhitespace);
     RUN_TEST(testItShouldParseAddition);
     RUN_TEST(testItShouldBeAbleToParseLessThanOrEquals);
     RUN_TEST(testItShouldBeAbleToParseLessThan);
     RUN_TEST(testItShouldBeAbleToDoOr);
+    RUN_TEST(testItShouldWorkOutTheValueOfNumbers);
+    RUN_TEST(testItShouldReadNumbersTheWayStrtodDoes);
     return UNITY_END();
 }
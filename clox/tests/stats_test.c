@@ -0,0 +1,86 @@
+#include "unity.h"
+#include "stats.h"
+#include "compiler.h"
+#include "vm.h"
+#include "functionobj.h"
+#include <stdlib.h>
+#include <string.h>
+
+static char *metrics;
+
+static void ignoreOutput(char *line)
+{
+    free(line);
+}
+
+void setUp()
+{
+    metrics = NULL;
+}
+
+void tearDown()
+{
+    free(metrics);
+}
+
+void testItShouldFormatStatsAsOpenMetrics()
+{
+    VmStats stats;
+    initVmStats(&stats);
+    stats.instructions[OP_ADD] = 12;
+    stats.calls = 3;
+    stats.maxFrameDepth = 2;
+
+    metrics = formatOpenMetrics(&stats);
+
+    TEST_ASSERT_NOT_NULL(strstr(metrics, "# TYPE clox_instructions counter\n"));
+    TEST_ASSERT_NOT_NULL(strstr(metrics, "clox_instructions_total{opcode=\"OP_ADD\"} 12\n"));
+    TEST_ASSERT_NULL(strstr(metrics, "opcode=\"OP_SUB\""));
+    TEST_ASSERT_NOT_NULL(strstr(metrics, "clox_calls_total 3\n"));
+    TEST_ASSERT_NOT_NULL(strstr(metrics, "# TYPE clox_max_frame_depth gauge\n"));
+    TEST_ASSERT_NOT_NULL(strstr(metrics, "clox_max_frame_depth 2\n"));
+    TEST_ASSERT_NOT_NULL(strstr(metrics, "clox_object_allocations_total{scope=\"process\",type=\"string\"} "));
+    TEST_ASSERT_EQUAL_STRING("# EOF\n", metrics + strlen(metrics) - strlen("# EOF\n"));
+}
+
+void testItShouldCountWhatTheVmDoesWhenBuiltWithStats()
+{
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("func fib(n) { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); } print fib(5); print \"a\" + \"b\";");
+    compile(&function, &tokens);
+
+    VirtualMachine vm;
+    initVirtualMachine(&vm);
+    vm.onStdOut = ignoreOutput;
+    uint64_t stringsBefore = getObjectStats()->allocations[ObjString];
+    prepareForCall(&vm, &function);
+    interpret(&vm);
+    VmStats *stats = &vm.stats;
+
+#ifdef VM_STATS
+    // The script, then fib(5) and the 14 calls it makes.
+    TEST_ASSERT_EQUAL(16, stats->calls);
+    TEST_ASSERT_EQUAL(6, stats->maxFrameDepth);
+    TEST_ASSERT_EQUAL(15, stats->instructions[OP_CALL_DIRECT]);
+    TEST_ASSERT_EQUAL(2, stats->instructions[OP_PRINT]);
+    TEST_ASSERT_TRUE(stats->maxStackDepth > 0);
+    // Both literals and their concatenation.
+    TEST_ASSERT_EQUAL(3, getObjectStats()->allocations[ObjString] - stringsBefore);
+#else
+    TEST_ASSERT_EQUAL(0, stats->calls);
+    TEST_ASSERT_EQUAL(0, stats->instructions[OP_PRINT]);
+    TEST_ASSERT_EQUAL(stringsBefore, getObjectStats()->allocations[ObjString]);
+#endif
+
+    freeVirtualMachine(&vm);
+    freeFunctionObj(&function);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testItShouldFormatStatsAsOpenMetrics);
+    RUN_TEST(testItShouldCountWhatTheVmDoesWhenBuiltWithStats);
+    return UNITY_END();
+}
@@ -0,0 +1,61 @@
+#include "unity.h"
+#include "textbuffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+static char *lines[4];
+static int lineCount;
+
+void setUp()
+{
+    lineCount = 0;
+}
+
+void tearDown()
+{
+    for (int i = 0; i < lineCount; i++)
+    {
+        free(lines[i]);
+    }
+}
+
+static void collectLine(char *line)
+{
+    lines[lineCount++] = line;
+}
+
+void testItShouldAppendFormattedTextPastItsCapacity()
+{
+    TextBuffer text;
+    initTextBuffer(&text);
+    TEST_ASSERT_NULL(text.chars);
+
+    for (int i = 0; i < 100; i++)
+    {
+        appendText(&text, "%d,", i % 10);
+    }
+
+    TEST_ASSERT_EQUAL(200, text.length);
+    TEST_ASSERT_EQUAL(200, strlen(text.chars));
+    TEST_ASSERT_EQUAL_STRING_LEN("0,1,2,", text.chars, 6);
+    TEST_ASSERT_EQUAL_STRING("8,9,", text.chars + 196);
+    free(text.chars);
+}
+
+void testItShouldReportEachLineToTheCallback()
+{
+    reportLine(collectLine, "%s %d\n", "calls", 3);
+    reportLine(collectLine, "");
+
+    TEST_ASSERT_EQUAL(2, lineCount);
+    TEST_ASSERT_EQUAL_STRING("calls 3\n", lines[0]);
+    TEST_ASSERT_EQUAL_STRING("", lines[1]);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testItShouldAppendFormattedTextPastItsCapacity);
+    RUN_TEST(testItShouldReportEachLineToTheCallback);
+    return UNITY_END();
+}
@@ -8,6 +8,8 @@
 #include "value.h"
 #include "cloxstring.h"
 #include "functionobj.h"
+#include "jit.h"
+#include <string.h>
 
 static char *test_messages[100];
 uint32_t test_messages_size = 0;
@@ -18,12 +20,23 @@ static void logWhenDisassemble(char *message)
     test_messages_size++;
 }
 
+// Every test runs twice: once purely interpreted, then with functions made hot almost
+// straight away so they are optimized and compiled to machine code wherever possible.
+static bool useJitEngine = false;
+
 Interpreter testObject;
 void setUp()
 {
     initInterpreter(&testObject);
     test_messages_size = 0;
     testObject.onStdOut = logWhenDisassemble;
+    testObject.vm.useJit = useJitEngine;
+    if (useJitEngine)
+    {
+        testObject.vm.hotCallThreshold = 2;
+        testObject.vm.hotLoopThreshold = 1;
+        testObject.vm.hotTraceThreshold = 1;
+    }
 }
 
 void tearDown()
@@ -42,7 +55,7 @@ void testItShouldRunBasicAddition()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("8.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("8", test_messages[0]);
 }
 
 void testItShouldDoComplexAdditionAndMultiplication()
@@ -52,7 +65,7 @@ void testItShouldDoComplexAdditionAndMultiplication()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("64.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("64", test_messages[0]);
 }
 
 void testItShouldDoComplexAdditionAndMultiplicationAndDivision()
@@ -61,7 +74,7 @@ void testItShouldDoComplexAdditionAndMultiplicationAndDivision()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("34.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("34", test_messages[0]);
 }
 
 void testItShouldPopTrueOntoTopOfStack()
@@ -116,7 +129,7 @@ void testItShouldPrintSimpleExpression()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("5.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("5", test_messages[0]);
 }
 
 void testItShouldDoSimpleAssignmentAndPrint()
@@ -126,7 +139,7 @@ void testItShouldDoSimpleAssignmentAndPrint()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("1.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("1", test_messages[0]);
 }
 
 void testItShouldDoSimpleAdditionWithAssignment()
@@ -136,7 +149,7 @@ void testItShouldDoSimpleAdditionWithAssignment()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("4.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("4", test_messages[0]);
 }
 
 void testItShouldDoAssignmentWithDecl()
@@ -146,7 +159,7 @@ void testItShouldDoAssignmentWithDecl()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("1.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("1", test_messages[0]);
 }
 
 void testItShouldDoComplexExpressionInDecl()
@@ -156,7 +169,7 @@ void testItShouldDoComplexExpressionInDecl()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("13.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("13", test_messages[0]);
 }
 
 void testIsShouldRunWithinABlock()
@@ -165,7 +178,7 @@ void testIsShouldRunWithinABlock()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("3.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("3", test_messages[0]);
 }
 
 void testItShouldRunTwoBlocksAndPrintCorrectValues()
@@ -175,8 +188,8 @@ void testItShouldRunTwoBlocksAndPrintCorrectValues()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(2, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("6.000000", test_messages[0]);
-    TEST_ASSERT_EQUAL_STRING("5.000000", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("6", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("5", test_messages[1]);
 }
 
 void testItShouldBeAbleToReadFromGlobalScope()
@@ -186,7 +199,7 @@ void testItShouldBeAbleToReadFromGlobalScope()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("5.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("5", test_messages[0]);
 }
 
 void testItShouldBeAbleToGoIntoIfConditional()
@@ -196,8 +209,8 @@ void testItShouldBeAbleToGoIntoIfConditional()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(2, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("5.000000", test_messages[0]);
-    TEST_ASSERT_EQUAL_STRING("3.000000", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("5", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("3", test_messages[1]);
 }
 
 void testItShouldBeAbleToNotGoIntoIfConditional()
@@ -207,7 +220,7 @@ void testItShouldBeAbleToNotGoIntoIfConditional()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("3.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("3", test_messages[0]);
 }
 
 void testItShouldBeAbleToGoThroughWhileLoop()
@@ -217,9 +230,9 @@ void testItShouldBeAbleToGoThroughWhileLoop()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(3, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("0.000000", test_messages[0]);
-    TEST_ASSERT_EQUAL_STRING("1.000000", test_messages[1]);
-    TEST_ASSERT_EQUAL_STRING("2.000000", test_messages[2]);
+    TEST_ASSERT_EQUAL_STRING("0", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("1", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("2", test_messages[2]);
 }
 
 void testItShouldBeAbleToGoThroughForLoop()
@@ -229,9 +242,30 @@ void testItShouldBeAbleToGoThroughForLoop()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(3, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("0.000000", test_messages[0]);
-    TEST_ASSERT_EQUAL_STRING("1.000000", test_messages[1]);
-    TEST_ASSERT_EQUAL_STRING("2.000000", test_messages[2]);
+    TEST_ASSERT_EQUAL_STRING("0", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("1", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("2", test_messages[2]);
+}
+
+void testItShouldNotEnterWhileLoopWhenConditionStartsFalse()
+{
+    const char *sourceCode = "{var a = 3; while (a < 3) {print a; a = a + 1;} print a;}";
+    runInterpreter(&testObject, sourceCode);
+
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("3", test_messages[0]);
+}
+
+void testItShouldReleaseForLoopVariableAfterLoop()
+{
+    const char *sourceCode = "{var a = 7; for (var i = 0; i < 2; i = i + 1;){ print i;} var b = 5; print a; print b;}";
+    runInterpreter(&testObject, sourceCode);
+
+    TEST_ASSERT_EQUAL(4, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("0", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("1", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("7", test_messages[2]);
+    TEST_ASSERT_EQUAL_STRING("5", test_messages[3]);
 }
 
 void testItShouldBeAbleToDefineAndUseFunction()
@@ -240,7 +274,7 @@ void testItShouldBeAbleToDefineAndUseFunction()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("5.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("5", test_messages[0]);
 }
 
 void testItShouldRunWithFunctionArgumentNoReturnValue()
@@ -249,7 +283,7 @@ void testItShouldRunWithFunctionArgumentNoReturnValue()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("5.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("5", test_messages[0]);
 }
 
 void testItShouldRunWithFunctionArgumentWithReturnValue()
@@ -258,7 +292,7 @@ void testItShouldRunWithFunctionArgumentWithReturnValue()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("6.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("6", test_messages[0]);
 }
 
 void testItShouldReturnNilWhenNoReturnGiven()
@@ -267,7 +301,7 @@ void testItShouldReturnNilWhenNoReturnGiven()
     runInterpreter(&testObject, sourceCode);
 
     TEST_ASSERT_EQUAL(2, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("5.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("5", test_messages[0]);
     TEST_ASSERT_EQUAL_STRING("nil", test_messages[1]);
 }
 
@@ -277,7 +311,7 @@ void testItShouldBeAbleToDoMultiLevelFunctionCalls()
 
     runInterpreter(&testObject, sourceCode);
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("5.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("5", test_messages[0]);
 }
 
 void testItShouldDoMultiArgFunctionCalls()
@@ -285,7 +319,7 @@ void testItShouldDoMultiArgFunctionCalls()
     const char *sourceCode = "{ func foo(a, b, c) { print a + b + c;} foo(1, 2, 3); }";
     runInterpreter(&testObject, sourceCode);
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("6.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("6", test_messages[0]);
 }
 
 void testItShouldBeAbleToDoFunctionCallsWithinExpression()
@@ -293,7 +327,7 @@ void testItShouldBeAbleToDoFunctionCallsWithinExpression()
     const char *sourceCode = "{ func foo(a) {return a + 1;} var c = foo(1) + foo(2) + foo(3); print c; }";
     runInterpreter(&testObject, sourceCode);
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("9.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("9", test_messages[0]);
 }
 
 void testItShouldHaveTwoReturnsInFunction()
@@ -301,7 +335,7 @@ void testItShouldHaveTwoReturnsInFunction()
     const char *sourceCode = "{func foo(a) { if (a <= 1) {return a;} return a + 1;} var c = foo(2); print c;}";
     runInterpreter(&testObject, sourceCode);
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("3.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("3", test_messages[0]);
 }
 
 void testItShouldGoToBaseCase()
@@ -309,7 +343,7 @@ void testItShouldGoToBaseCase()
     const char *sourceCode = "{func foo(a) { if (a <= 1) {return a;} return a + 1;} var c = foo(1); print c;}";
     runInterpreter(&testObject, sourceCode);
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("1.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("1", test_messages[0]);
 }
 
 void testItShouldBeAbleToDoOrStatement()
@@ -320,6 +354,55 @@ void testItShouldBeAbleToDoOrStatement()
     TEST_ASSERT_EQUAL_STRING("true", test_messages[0]);
 }
 
+void testItShouldBeAbleToDoAndStatement()
+{
+    const char *sourceCode = "{ var a = true && false; print a;}";
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("false", test_messages[0]);
+}
+
+void testItShouldEvaluateRightSideOfOrWhenLeftIsFalse()
+{
+    const char *sourceCode = "{ var a = false || true; print a;}";
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("true", test_messages[0]);
+}
+
+void testItShouldNotCallRightSideOfOrWhenLeftIsTrue()
+{
+    const char *sourceCode = "{ func foo() { print 5; return false; } var a = true || foo(); print a;}";
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("true", test_messages[0]);
+}
+
+void testItShouldNotCallRightSideOfAndWhenLeftIsFalse()
+{
+    const char *sourceCode = "{ func foo() { print 5; return true; } var a = false && foo(); print a;}";
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("false", test_messages[0]);
+}
+
+void testItShouldCallRightSideOfAndWhenLeftIsTrue()
+{
+    const char *sourceCode = "{ func foo() { print 5; return true; } var a = true and foo(); print a;}";
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(2, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("5", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("true", test_messages[1]);
+}
+
+void testItShouldBindAndTighterThanOr()
+{
+    const char *sourceCode = "{ var a = true || false && false; print a;}";
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("true", test_messages[0]);
+}
+
 void testItShouldBeAbleToDoLessThanOrEqualsTo()
 {
     const char *sourceCode = "{ var a = 2 <= 5; print a;}";
@@ -349,7 +432,7 @@ void testItShouldBeAbleToDoInlineExpressionInFuncCall()
     const char *sourceCode = "{func foo(n) { return n;} print foo(5 - 3);}";
     runInterpreter(&testObject, sourceCode);
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("2.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("2", test_messages[0]);
 }
 
 void testItShouldDoSimpleRecursionBaseCase()
@@ -357,7 +440,7 @@ void testItShouldDoSimpleRecursionBaseCase()
     const char *sourceCode = "{func foo(n) { if (n <= 1) {return 1;} return n - 1; } print foo(1);}";
     runInterpreter(&testObject, sourceCode);
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("1.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("1", test_messages[0]);
 }
 
 void testItShouldDoSimpleRecursion()
@@ -365,7 +448,302 @@ void testItShouldDoSimpleRecursion()
     const char *sourceCode = "{func foo(n) { if (n <= 1) {return 1;} return foo(n - 1); } print foo(2);}";
     runInterpreter(&testObject, sourceCode);
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("1.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("1", test_messages[0]);
+}
+
+void testItShouldReportArityMismatchWhenTheCallRuns()
+{
+    // The compiler falls back to a regular call, which checks the argument count.
+    const char *sourceCode = "{ func foo(a, b) { print a; } foo(4); print 3; }";
+    testObject.onStdErr = logWhenDisassemble;
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("Expected 2 arguments but got 1.", test_messages[0]);
+}
+
+void testItShouldRecurseInTailPositionPastCallFrameLimit()
+{
+    const char *sourceCode = "{func sum(n, acc) { if (n <= 0) {return acc;} return sum(n - 1, acc + n); } print sum(9 * 9 * 9, 0);}";
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("266085", test_messages[0]);
+}
+
+void testItShouldTailCallIntoAnotherFunction()
+{
+    const char *sourceCode = "{func bar(a, b, c) { return a + b + c; } func foo(n) { return bar(n, n, 1); } print foo(4) + 1;}";
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("10", test_messages[0]);
+}
+
+void testItShouldUseLongConstants()
+{
+    char sourceCode[1024] = "print 0";
+    for (int i = 0; i < 300; i++)
+    {
+        strcat(sourceCode, "+1");
+    }
+    strcat(sourceCode, ";");
+
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("300", test_messages[0]);
+}
+
+void testItShouldJumpOverBodiesLongerThanShortJumpDistance()
+{
+    const char *statement = "print 1;";
+    int numStatements = 14000;
+    char *sourceCode = malloc(strlen(statement) * numStatements + 128);
+    strcpy(sourceCode, "{var a = 0; while (a < 2) { a = a + 1; if (false) {");
+    char *end = sourceCode + strlen(sourceCode);
+    for (int i = 0; i < numStatements; i++)
+    {
+        strcpy(end, statement);
+        end = end + strlen(statement);
+    }
+    strcpy(end, "}} print a;}");
+
+    runInterpreter(&testObject, sourceCode);
+    free(sourceCode);
+
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("2", test_messages[0]);
+}
+
+void testItShouldRecursePastInitialStackCapacity()
+{
+    const char *sourceCode = "{func count(n) { if (n <= 0) {return 0;} return 1 + count(n - 1); } print count(9 * 9 * 9);}";
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("729", test_messages[0]);
+}
+
+void testItShouldRunMoreThanTwoHundredFiftySixLocals()
+{
+    char sourceCode[8192] = "{";
+    for (int i = 0; i < 300; i++)
+    {
+        char declaration[16];
+        snprintf(declaration, sizeof(declaration), "var a%d = 1;", i);
+        strcat(sourceCode, declaration);
+    }
+    strcat(sourceCode, "print a0 + a299;}");
+
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("2", test_messages[0]);
+}
+
+void testItShouldReportStackOverflowPastMaxCallFrames()
+{
+    const char *sourceCode = "{func forever(n) { return 1 + forever(n); } print forever(1); print 2;}";
+    testObject.vm.maxCallFrames = 64;
+    testObject.onStdErr = logWhenDisassemble;
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("Stack overflow.", test_messages[0]);
+}
+
+void testItShouldReportStackOverflowPastMaxStackSlots()
+{
+    const char *sourceCode = "{func forever(n) { return 1 + forever(n); } print forever(1); print 2;}";
+    testObject.vm.maxStackSlots = 1024;
+    testObject.onStdErr = logWhenDisassemble;
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("Stack overflow.", test_messages[0]);
+}
+
+void testItShouldDecodeFunctionOnFirstCall()
+{
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("{var a = 1; while (a < 3) { a = a + 1; } print a;}");
+    compile(&function, &tokens);
+    TEST_ASSERT_NULL(function.decoded);
+
+    testObject.vm.onStdOut = logWhenDisassemble;
+    prepareForCall(&testObject.vm, &function);
+    TEST_ASSERT_NOT_NULL(function.decoded);
+
+    // OP_VAR_DECL, OP_CONSTANT, OP_VAR_ASSIGN, then the jump into the loop condition
+    Instruction *entryJump = &function.decoded[3];
+    TEST_ASSERT_EQUAL(OP_JUMP, entryJump->opCode);
+    TEST_ASSERT_EQUAL(OP_VAR_EXPRESSION, entryJump->as.target->opCode);
+    TEST_ASSERT_EQUAL(OP_LOOP_IF_TRUE, entryJump->as.target[3].opCode);
+    TEST_ASSERT_EQUAL_PTR(entryJump + 1, entryJump->as.target[3].as.target);
+
+    interpret(&testObject.vm);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("3", test_messages[0]);
+    freeFunctionObj(&function);
+}
+
+void testItShouldRunWithMultiDigitAndDecimalNumbers()
+{
+    runInterpreter(&testObject, "print 12.5 * 20 + 0.25;");
+
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("250.25", test_messages[0]);
+}
+
+void testItShouldPopExpressionStatementsInADeepFunction()
+{
+    runInterpreter(&testObject, "func same(n) { return n; } func deep(n) { if (n < 1) { return 0; } -n; -n + 1; -n * 2; 1; 2 * 3; same(n); -n; 4 - 5; same(n) + 1; 6; -n / 2; same(-n); 7; 8 + 9; -n; return deep(n - 1) + 1; } print deep(300);");
+
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("300", test_messages[0]);
+}
+
+void testItShouldPrintShortestNumbersByDefault()
+{
+    runInterpreter(&testObject, "print 8; print 1 / 4; print 1 / 3;");
+
+    TEST_ASSERT_EQUAL(3, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("8", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0.25", test_messages[1]);
+    TEST_ASSERT_EQUAL_STRING("0.3333333333333333", test_messages[2]);
+}
+
+void testItShouldPrintFixedNumbersWhenAskedTo()
+{
+    testObject.vm.numberFormat = NUMBER_FORMAT_FIXED;
+    runInterpreter(&testObject, "print 8; print 1 / 4;");
+
+    TEST_ASSERT_EQUAL(2, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("8.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("0.250000", test_messages[1]);
+}
+
+void testItShouldSwapCallHandlersWhenDebugging()
+{
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("func add(a, b) { return a + b; } print add(1, 2);");
+    compile(&function, &tokens);
+    FunctionObj *add = unwrapFunctionObj(getConstantAt(function.bytecode, 0));
+
+    testObject.vm.onStdOut = logWhenDisassemble;
+    setDebugMode(&testObject.vm, true);
+    prepareForCall(&testObject.vm, &function);
+    // Everything the script can call is decoded with the debug handlers before it runs.
+    TEST_ASSERT_NOT_NULL(add->decoded);
+    int call = 0;
+    while (!(function.decoded[call].opCode == OP_CALL_DIRECT || function.decoded[call].opCode == OP_CALL))
+    {
+        call++;
+    }
+    InstructionHandler debugCall = function.decoded[call].handler;
+    InstructionHandler print = function.decoded[call + 1].handler;
+    interpret(&testObject.vm);
+
+    VirtualMachine vm;
+    initVirtualMachine(&vm);
+    vm.onStdOut = logWhenDisassemble;
+    prepareForCall(&vm, &function);
+    TEST_ASSERT_TRUE(function.decoded[call].handler != debugCall);
+    TEST_ASSERT_TRUE(function.decoded[call + 1].handler == print);
+    interpret(&vm);
+
+    TEST_ASSERT_EQUAL(2, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("3", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("3", test_messages[1]);
+    freeVirtualMachine(&vm);
+    freeFunctionObj(&function);
+}
+
+void testItShouldMoveIntoOptimizedCodeInTheMiddleOfALoop()
+{
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("{var i = 0; var sum = 0; while (i < 9) { i = i + 1; sum = sum + i; } print sum;}");
+    compile(&function, &tokens);
+
+    testObject.vm.onStdOut = logWhenDisassemble;
+    testObject.vm.hotLoopThreshold = 3;
+    prepareForCall(&testObject.vm, &function);
+    interpret(&testObject.vm);
+
+    TEST_ASSERT_TRUE(function.isOptimized);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("45", test_messages[0]);
+    freeFunctionObj(&function);
+}
+
+void testItShouldOptimizeARecursiveFunctionWhileItIsRunning()
+{
+    const char *sourceCode = "{func count(n) { if (n <= 0) {return 0;} return 1 + count(n - 1); } print count(9 * 9);}";
+    testObject.vm.hotCallThreshold = 5;
+    runInterpreter(&testObject, sourceCode);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("81", test_messages[0]);
+}
+
+void testItShouldCompileHotFunctionToNativeCode()
+{
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("{var i = 0; var sum = 0; while (i < 9) { i = i + 1; sum = sum + i; } print sum;}");
+    compile(&function, &tokens);
+
+    testObject.vm.onStdOut = logWhenDisassemble;
+    testObject.vm.useJit = true;
+    testObject.vm.hotLoopThreshold = 3;
+    prepareForCall(&testObject.vm, &function);
+    interpret(&testObject.vm);
+
+#ifdef JIT_AVAILABLE
+    TEST_ASSERT_NOT_NULL(function.native);
+#else
+    TEST_ASSERT_NULL(function.native);
+#endif
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("45", test_messages[0]);
+    freeFunctionObj(&function);
+}
+
+void testItShouldRunAHotLoopThroughATrace()
+{
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("{var i = 0; var sum = 0; while (i < 9 * 9) { i = i + 1; sum = sum + i; } print sum;}");
+    compile(&function, &tokens);
+
+    testObject.vm.onStdOut = logWhenDisassemble;
+    testObject.vm.hotLoopThreshold = 2;
+    testObject.vm.hotTraceThreshold = 2;
+    prepareForCall(&testObject.vm, &function);
+    interpret(&testObject.vm);
+
+    TEST_ASSERT_EQUAL(1, function.traceCount);
+    TEST_ASSERT_NOT_NULL(function.traces[0].instructions);
+    TEST_ASSERT_EQUAL(1, function.traces[0].entryCount);
+    TEST_ASSERT_EQUAL(0, function.traces[0].guardExitCount);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("3321", test_messages[0]);
+    freeFunctionObj(&function);
+}
+
+void testItShouldLeaveATraceWhenABranchGoesTheOtherWay()
+{
+    FunctionObj function;
+    initFunctionObj(&function);
+    TokenArrayIterator tokens = tokenize("{var i = 0; var sum = 0; while (i < 9) { i = i + 1; if (i < 5) { sum = sum + 1; } if (5 <= i) { sum = sum + 9; } } print sum;}");
+    compile(&function, &tokens);
+
+    testObject.vm.onStdOut = logWhenDisassemble;
+    testObject.vm.hotLoopThreshold = 1;
+    testObject.vm.hotTraceThreshold = 1;
+    prepareForCall(&testObject.vm, &function);
+    interpret(&testObject.vm);
+
+    TEST_ASSERT_EQUAL(1, function.traceCount);
+    TEST_ASSERT_TRUE(function.traces[0].guardExitCount > 0);
+    TEST_ASSERT_EQUAL(1, test_messages_size);
+    TEST_ASSERT_EQUAL_STRING("49", test_messages[0]);
+    freeFunctionObj(&function);
 }
 
 void testItShouldDoFibNumbers()
@@ -374,12 +752,11 @@ void testItShouldDoFibNumbers()
     testObject.debugMode = true;
     runInterpreter(&testObject, sourceCode);
     TEST_ASSERT_EQUAL(1, test_messages_size);
-    TEST_ASSERT_EQUAL_STRING("34.000000", test_messages[0]);
+    TEST_ASSERT_EQUAL_STRING("34", test_messages[0]);
 }
 
-int main(void)
+static void runAllTests()
 {
-    UNITY_BEGIN();
     RUN_TEST(testItShouldRunBasicAddition);
     RUN_TEST(testItShouldDoComplexAdditionAndMultiplication);
     RUN_TEST(testItShouldDoComplexAdditionAndMultiplicationAndDivision);
@@ -400,6 +777,8 @@ int main(void)
     RUN_TEST(testItShouldBeAbleToNotGoIntoIfConditional);
     RUN_TEST(testItShouldBeAbleToGoThroughWhileLoop);
     RUN_TEST(testItShouldBeAbleToGoThroughForLoop);
+    RUN_TEST(testItShouldNotEnterWhileLoopWhenConditionStartsFalse);
+    RUN_TEST(testItShouldReleaseForLoopVariableAfterLoop);
     RUN_TEST(testItShouldBeAbleToDefineAndUseFunction);
     RUN_TEST(testItShouldRunWithFunctionArgumentNoReturnValue);
     RUN_TEST(testItShouldRunWithFunctionArgumentWithReturnValue);
@@ -410,12 +789,47 @@ int main(void)
     RUN_TEST(testItShouldHaveTwoReturnsInFunction);
     RUN_TEST(testItShouldGoToBaseCase);
     RUN_TEST(testItShouldBeAbleToDoOrStatement);
+    RUN_TEST(testItShouldBeAbleToDoAndStatement);
+    RUN_TEST(testItShouldEvaluateRightSideOfOrWhenLeftIsFalse);
+    RUN_TEST(testItShouldNotCallRightSideOfOrWhenLeftIsTrue);
+    RUN_TEST(testItShouldNotCallRightSideOfAndWhenLeftIsFalse);
+    RUN_TEST(testItShouldCallRightSideOfAndWhenLeftIsTrue);
+    RUN_TEST(testItShouldBindAndTighterThanOr);
     RUN_TEST(testItShouldBeAbleToDoLessThanOrEqualsTo);
     RUN_TEST(testItShouldBeAbleToDoLessThanOrEqualsToSameNum);
     RUN_TEST(testItShouldBeAbleToDoLessThanOrEqualsToWhereLeftIsGreater);
     RUN_TEST(testItShouldBeAbleToDoInlineExpressionInFuncCall);
     RUN_TEST(testItShouldDoSimpleRecursionBaseCase);
     RUN_TEST(testItShouldDoSimpleRecursion);
+    RUN_TEST(testItShouldReportArityMismatchWhenTheCallRuns);
+    RUN_TEST(testItShouldRecurseInTailPositionPastCallFrameLimit);
+    RUN_TEST(testItShouldTailCallIntoAnotherFunction);
+    RUN_TEST(testItShouldUseLongConstants);
+    RUN_TEST(testItShouldJumpOverBodiesLongerThanShortJumpDistance);
+    RUN_TEST(testItShouldRecursePastInitialStackCapacity);
+    RUN_TEST(testItShouldRunMoreThanTwoHundredFiftySixLocals);
+    RUN_TEST(testItShouldReportStackOverflowPastMaxCallFrames);
+    RUN_TEST(testItShouldReportStackOverflowPastMaxStackSlots);
+    RUN_TEST(testItShouldDecodeFunctionOnFirstCall);
+    RUN_TEST(testItShouldSwapCallHandlersWhenDebugging);
+    RUN_TEST(testItShouldPrintShortestNumbersByDefault);
+    RUN_TEST(testItShouldPrintFixedNumbersWhenAskedTo);
+    RUN_TEST(testItShouldPopExpressionStatementsInADeepFunction);
+    RUN_TEST(testItShouldRunWithMultiDigitAndDecimalNumbers);
+    RUN_TEST(testItShouldMoveIntoOptimizedCodeInTheMiddleOfALoop);
+    RUN_TEST(testItShouldOptimizeARecursiveFunctionWhileItIsRunning);
+    RUN_TEST(testItShouldCompileHotFunctionToNativeCode);
+    RUN_TEST(testItShouldRunAHotLoopThroughATrace);
+    RUN_TEST(testItShouldLeaveATraceWhenABranchGoesTheOtherWay);
     RUN_TEST(testItShouldDoFibNumbers);
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    useJitEngine = false;
+    runAllTests();
+    useJitEngine = true;
+    runAllTests();
     return UNITY_END();
 }
\ No newline at end of file
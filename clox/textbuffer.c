@@ -0,0 +1,49 @@
+#include "textbuffer.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+
+void initTextBuffer(TextBuffer *text)
+{
+    text->chars = NULL;
+    text->length = 0;
+    text->capacity = 0;
+}
+
+void appendText(TextBuffer *text, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+
+    if (text->capacity < text->length + length + 1)
+    {
+        int oldCapacity = text->capacity;
+        while (text->capacity < text->length + length + 1)
+        {
+            text->capacity = GROW_CAPACITY(text->capacity);
+        }
+        text->chars = GROW_ARRAY(char, text->chars, oldCapacity, text->capacity);
+    }
+
+    va_start(arguments, format);
+    vsnprintf(text->chars + text->length, length + 1, format, arguments);
+    va_end(arguments);
+    text->length += length;
+}
+
+void reportLine(void (*callback)(char *line), const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+
+    char *line = malloc(sizeof(char) * length + 1);
+    va_start(arguments, format);
+    vsnprintf(line, length + 1, format, arguments);
+    va_end(arguments);
+    callback(line);
+}
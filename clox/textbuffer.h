@@ -0,0 +1,20 @@
+#ifndef TEXT_BUFFER_HEADER
+#define TEXT_BUFFER_HEADER
+
+// Text built up a printf at a time, for output that is returned whole in one malloc'd
+// string. chars stays NULL until something is appended.
+typedef struct TextBuffer
+{
+    char *chars;
+    int length;
+    int capacity;
+} TextBuffer;
+
+void initTextBuffer(TextBuffer *);
+void appendText(TextBuffer *, const char *format, ...);
+
+// Formats one line into a malloc'd string and hands it to callback, which frees it. The
+// reports that send their output a line at a time all go through this.
+void reportLine(void (*callback)(char *line), const char *format, ...);
+
+#endif
@@ -7,6 +7,8 @@
 #include <string.h>
 #include "cloxstring.h"
 #include <stdlib.h>
+#include "stats.h"
+#include "probes.h"
 
 void initValueArray(ValueArray *valueArray)
 {
@@ -155,10 +157,52 @@ Value add(Value leftValue, Value rightValue)
         concat->type.type = ObjString;
         concat->length = length;
         concat->chars = concatenated;
+        COUNT_OBJECT_ALLOCATION(ObjString, sizeof(StringObj) + length + 1);
+        PROBE_OBJECT_ALLOC(ObjString, sizeof(StringObj) + length + 1);
 
         freeStringObj(right);
         freeStringObj(left);
 
         return wrapObject((Obj*)concat);
     }
-}
\ No newline at end of file
+}
+int formatValueInto(Value value, NumberFormat format, char *buffer, int size)
+{
+    if (isNumber(value) && format == NUMBER_FORMAT_SHORTEST)
+    {
+        char number[NUMBER_BUFFER_SIZE];
+        formatNumber(unwrapNumber(value), number);
+        return snprintf(buffer, size, "%s", number);
+    }
+    else if (isNumber(value))
+    {
+        return snprintf(buffer, size, "%f", unwrapNumber(value));
+    }
+    else if (isBool(value))
+    {
+        return snprintf(buffer, size, "%s", unwrapBool(value) ? "true" : "false");
+    }
+    else if (isStringObj(value))
+    {
+        StringObj *unwrapped = (StringObj *)unwrapObject(value);
+        return snprintf(buffer, size, "%s", unwrapped->chars);
+    }
+    else if (isNil(value))
+    {
+        return snprintf(buffer, size, "%s", "nil");
+    }
+    return -1;
+}
+
+char *formatValue(Value value, NumberFormat format)
+{
+    int length = formatValueInto(value, format, NULL, 0);
+    if (length < 0)
+    {
+        return NULL;
+    }
+
+    char *line = malloc(sizeof(char) * length + 1);
+    formatValueInto(value, format, line, length + 1);
+    return line;
+}
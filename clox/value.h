@@ -3,6 +3,7 @@
 
 #include "stdint.h"
 #include <stdbool.h>
+#include "numberformat.h"
 #include <math.h>
 #include "object.h"
 
@@ -55,4 +56,11 @@ Value add(Value, Value);
 
 Value negate(Value);
 
+// Text print shows for a value, in a malloc'd string the caller frees. NULL for values
+// print has no text for. Numbers are written in the given format.
+char *formatValue(Value, NumberFormat);
+// The same text written into buffer, truncated to size like snprintf. Returns its full
+// length, or -1 for values print has no text for.
+int formatValueInto(Value, NumberFormat, char *buffer, int size);
+
 #endif
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "vm.h"
 #include "value.h"
 #include "chunk.h"
+#include <stdatomic.h>
 #include <stdint.h>
 #include "cloxstring.h"
 #include <stdlib.h>
@@ -8,10 +9,28 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "disassembler.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "jit.h"
+#include "probes.h"
+
+#ifdef GUARDED_STACK
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 static void stdOutPrinter(char *toPrint)
 {
-    printf(toPrint);
+    printf("%s\n", toPrint);
+    free(toPrint);
+}
+
+static void stdErrPrinter(char *message)
+{
+    fprintf(stderr, "%s\n", message);
+    free(message);
 }
 
 static CallFrame *getNextFrame(VirtualMachine *vm)
@@ -25,527 +44,1571 @@ static CallFrame *getCurrentFrame(VirtualMachine *vm)
     return &vm->frames[vm->fp];
 }
 
-static uint8_t *getCurrentIp(VirtualMachine *vm)
-{
-    CallFrame *currentFrame = getCurrentFrame(vm);
-    return currentFrame->ip;
-}
-
-static Value getCurrentFrameConstantAt(VirtualMachine *vm, int index)
+static void countCall(VirtualMachine *, FunctionObj *);
+static void countBackEdge(VirtualMachine *, Instruction *);
+static InstructionHandler getHandlerFor(OpCode);
+static InstructionHandler *getHandlerTable(bool isDebug);
+static void threadReachableFunctions(VirtualMachine *, FunctionObj *);
+
+#ifdef VM_STATS
+#define COUNT_STAT(vm, counter) ((vm)->stats.counter++)
+#define COUNT_INSTRUCTION(vm, instruction) ((vm)->stats.instructions[(instruction)->opCode]++)
+#else
+#define COUNT_STAT(vm, counter) ((void)0)
+#define COUNT_INSTRUCTION(vm, instruction) ((void)0)
+#endif
+
+// Operators leave their result in the slot of their left operand rather than popping it
+// and pushing the result back.
+static void replaceTop(VirtualMachine *vm, Value value)
 {
-    CallFrame *currentFrame = getCurrentFrame(vm);
-    Value constant = getConstantAt(currentFrame->function->bytecode, index);
-    return constant;
+    vm->stackTop[-1] = value;
 }
 
 void initVirtualMachine(VirtualMachine *vm)
 {
     vm->onStdOut = stdOutPrinter;
+    vm->onStdErr = stdErrPrinter;
     vm->fp = -1;
+    setDebugMode(vm, false);
+
+    vm->stack = NULL;
+    vm->stackTop = NULL;
+    vm->stackCapacity = 0;
+    vm->maxStackSlots = _DEFAULT_MAX_STACK_SLOTS_;
+
+    vm->frames = NULL;
+    vm->frameCapacity = 0;
+    vm->maxCallFrames = _DEFAULT_MAX_CALL_FRAMES_;
+
+    vm->hotCallThreshold = _DEFAULT_HOT_CALL_THRESHOLD_;
+    vm->hotLoopThreshold = _DEFAULT_HOT_LOOP_THRESHOLD_;
+    vm->hotTraceThreshold = _DEFAULT_HOT_TRACE_THRESHOLD_;
+    vm->useJit = true;
+    vm->profile = NULL;
+    vm->perfMap = NULL;
+    vm->recorder = NULL;
+    vm->output = NULL;
+    vm->numberFormat = NUMBER_FORMAT_SHORTEST;
+    initVmStats(&vm->stats);
+#ifdef VM_STATS
+    // Machine code runs without counting instructions.
+    vm->useJit = false;
+#endif
 
     initHashMap(&vm->global);
+}
+
+static void releaseStack(VirtualMachine *);
+
+void freeVirtualMachine(VirtualMachine *vm)
+{
+    releaseStack(vm);
+    FREE_ARRAY(CallFrame, vm->frames, vm->frameCapacity);
+    freeHashMap(&vm->global);
+    initVirtualMachine(vm);
+}
 
-    for (int i = 0; i < _NUM_CALL_FRAMES_; i++)
+static int growCapacityTo(int capacity, int needed, int limit)
+{
+    while (capacity < needed)
     {
-        vm->frames[i].ip = NULL;
-        vm->frames[i].function = NULL;
-        vm->frames[i].sp = NULL;
+        capacity = GROW_CAPACITY(capacity);
     }
+    return capacity > limit ? limit : capacity;
 }
 
-static void interpretConstant(VirtualMachine *vm)
+#ifdef GUARDED_STACK
+// The stack is mapped once at its full size, with an inaccessible page straight after
+// it. The kernel only backs the pages that are touched, and a push past the end faults
+// on the guard page instead of needing a bounds check.
+static size_t getGuardedStackSize(VirtualMachine *vm)
 {
-    CallFrame *currentFrame = getCurrentFrame(vm);
-    int constantIndex = *(currentFrame->ip + 1);
-    Value constant = getCurrentFrameConstantAt(vm, constantIndex);
-    push(vm, constant);
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t stackSize = sizeof(Value) * vm->maxStackSlots;
+    return (stackSize + pageSize - 1) / pageSize * pageSize;
+}
+
+static void mapGuardedStack(VirtualMachine *vm)
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t stackSize = getGuardedStackSize(vm);
+
+    uint8_t *region = mmap(NULL, stackSize + pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED || mprotect(region + stackSize, pageSize, PROT_NONE) != 0)
+    {
+        exit(1);
+    }
 
-    currentFrame->ip = currentFrame->ip + getByteLengthFor(OP_CONSTANT);
+    vm->stack = (Value *)region;
+    vm->stackCapacity = stackSize / sizeof(Value);
 }
 
-static void interpretNegate(VirtualMachine *vm)
+static bool reserveStack(VirtualMachine *vm, int slotsNeeded)
 {
-    Value value = pop(vm);
-    push(vm, negate(value));
+    if (vm->stack == NULL)
+    {
+        mapGuardedStack(vm);
+    }
+    return true;
+}
+
+static void releaseStack(VirtualMachine *vm)
+{
+    if (vm->stack != NULL)
+    {
+        munmap(vm->stack, sizeof(Value) * vm->stackCapacity + sysconf(_SC_PAGESIZE));
+    }
+}
+
+static VirtualMachine *guardedVm = NULL;
+static sigjmp_buf stackOverflowJump;
+static struct sigaction previousSegvAction;
+
+static bool isInGuardPage(VirtualMachine *vm, uint8_t *address)
+{
+    uint8_t *guardPage = (uint8_t *)&vm->stack[vm->stackCapacity];
+    return address >= guardPage && address < guardPage + sysconf(_SC_PAGESIZE);
+}
+
+static void onSegmentationFault(int signalNumber, siginfo_t *info, void *context)
+{
+    if (guardedVm != NULL && isInGuardPage(guardedVm, info->si_addr))
+    {
+        siglongjmp(stackOverflowJump, 1);
+    }
+
+    // Not a stack overflow. Put the old handler back so the faulting instruction
+    // reruns and fails the way it would have without us.
+    sigaction(SIGSEGV, &previousSegvAction, NULL);
+}
+
+static void installStackGuard(VirtualMachine *vm)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = onSegmentationFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+
+    sigaction(SIGSEGV, &action, &previousSegvAction);
+    guardedVm = vm;
+}
+
+static void removeStackGuard()
+{
+    sigaction(SIGSEGV, &previousSegvAction, NULL);
+    guardedVm = NULL;
+}
+#else
+static void growStack(VirtualMachine *vm, int slotsNeeded)
+{
+    int oldCapacity = vm->stackCapacity;
+    int newCapacity = growCapacityTo(oldCapacity, slotsNeeded, vm->maxStackSlots);
+
+    Value *grown = GROW_ARRAY(Value, NULL, 0, newCapacity);
+    if (oldCapacity > 0)
+    {
+        memcpy(grown, vm->stack, sizeof(Value) * oldCapacity);
+    }
+    for (int i = 0; i <= vm->fp; i++)
+    {
+        vm->frames[i].sp = grown + (vm->frames[i].sp - vm->stack);
+    }
+    vm->stackTop = grown + (vm->stackTop - vm->stack);
+    FREE_ARRAY(Value, vm->stack, oldCapacity);
+
+    vm->stack = grown;
+    vm->stackCapacity = newCapacity;
+}
+
+static bool reserveStack(VirtualMachine *vm, int slotsNeeded)
+{
+    if (slotsNeeded > vm->maxStackSlots)
+    {
+        return false;
+    }
+    if (slotsNeeded > vm->stackCapacity)
+    {
+        growStack(vm, slotsNeeded);
+    }
+    return true;
+}
+
+static void releaseStack(VirtualMachine *vm)
+{
+    FREE_ARRAY(Value, vm->stack, vm->stackCapacity);
+}
+#endif
+
+// The sampling profiler's timer signal can read the frames at any point. Filling a new
+// array and only freeing the old one once the new one is in place means the signal
+// sees one or the other, never memory realloc is halfway through moving.
+static void growFrames(VirtualMachine *vm, int framesNeeded)
+{
+    int oldCapacity = vm->frameCapacity;
+    int newCapacity = growCapacityTo(oldCapacity, framesNeeded, vm->maxCallFrames);
+
+    CallFrame *oldFrames = vm->frames;
+    CallFrame *grown = GROW_ARRAY(CallFrame, NULL, 0, newCapacity);
+    if (oldCapacity > 0)
+    {
+        memcpy(grown, oldFrames, sizeof(CallFrame) * oldCapacity);
+    }
+
+    atomic_signal_fence(memory_order_seq_cst);
+    vm->frames = grown;
+    vm->frameCapacity = newCapacity;
+    atomic_signal_fence(memory_order_seq_cst);
+
+    FREE_ARRAY(CallFrame, oldFrames, oldCapacity);
+}
+
+// The one overflow check a call makes. Everything the new frame can push was counted
+// by the compiler, so push() itself never has to check for room.
+static bool reserveCall(VirtualMachine *vm, int framesNeeded, int slotsNeeded)
+{
+    if (framesNeeded > vm->maxCallFrames)
+    {
+        return false;
+    }
+
+    if (framesNeeded > vm->frameCapacity)
+    {
+        growFrames(vm, framesNeeded);
+    }
+
+#ifdef VM_STATS
+    if (framesNeeded > vm->stats.maxFrameDepth)
+    {
+        vm->stats.maxFrameDepth = framesNeeded;
+    }
+    if (slotsNeeded > vm->stats.maxStackDepth)
+    {
+        vm->stats.maxStackDepth = slotsNeeded;
+    }
+#endif
+    return reserveStack(vm, slotsNeeded);
+}
+
+static void reportError(VirtualMachine *vm, const char *message)
+{
+    if (vm->output != NULL)
+    {
+        flushOutput(vm->output);
+    }
+    if (vm->onStdErr != NULL)
+    {
+        char *line = malloc(sizeof(char) * strlen(message) + 1);
+        strcpy(line, message);
+        vm->onStdErr(line);
+    }
+}
+
+// Abandons the running program: unwinds to the script's frame and parks it on the
+// script's closing OP_RETURN, so interpret() finishes as though the script had ended.
+static void haltWithError(VirtualMachine *vm, const char *message)
+{
+    reportError(vm, message);
+
+    vm->fp = 0;
+    CallFrame *scriptFrame = getCurrentFrame(vm);
+    FunctionObj *script = scriptFrame->function;
+    scriptFrame->ip = &script->decoded[script->decodedCount - 1];
+}
+
+static int getStackIndexOf(VirtualMachine *vm, Value *slot)
+{
+    return slot - vm->stack;
+}
+
+static void stepPast(VirtualMachine *vm, Instruction *instruction)
+{
+    getCurrentFrame(vm)->ip = instruction + 1;
+}
+
+static void interpretConstant(VirtualMachine *vm, Instruction *instruction)
+{
+    push(vm, instruction->as.constant);
+    stepPast(vm, instruction);
+}
+
+static void interpretNegate(VirtualMachine *vm, Instruction *instruction)
+{
+    Value value = peek(vm);
+    replaceTop(vm, negate(value));
 
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + getByteLengthFor(OP_NEGATE);
+    stepPast(vm, instruction);
 }
 
-static void interpretAdd(VirtualMachine *vm)
+static void interpretAdd(VirtualMachine *vm, Instruction *instruction)
 {
     Value rightValue = pop(vm);
-    Value leftValue = pop(vm);
+    Value leftValue = peek(vm);
 
     Value result = add(leftValue, rightValue);
-    push(vm, result);
+    replaceTop(vm, result);
 
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + getByteLengthFor(OP_ADD);
+    stepPast(vm, instruction);
 }
 
-static void interpretMultiplication(VirtualMachine *vm)
+static void interpretMultiplication(VirtualMachine *vm, Instruction *instruction)
 {
     Value rightValue = pop(vm);
-    Value leftValue = pop(vm);
+    Value leftValue = peek(vm);
 
     double right = unwrapNumber(rightValue);
     double left = unwrapNumber(leftValue);
 
     Value result = wrapNumber(left * right);
-    push(vm, result);
+    replaceTop(vm, result);
 
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + getByteLengthFor(OP_MULT);
+    stepPast(vm, instruction);
 }
 
-static void interpretDivision(VirtualMachine *vm)
+static void interpretDivision(VirtualMachine *vm, Instruction *instruction)
 {
     Value rightValue = pop(vm);
-    Value leftValue = pop(vm);
+    Value leftValue = peek(vm);
 
     double right = unwrapNumber(rightValue);
     double left = unwrapNumber(leftValue);
     Value result = wrapNumber(left / right);
-    push(vm, result);
+    replaceTop(vm, result);
 
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + getByteLengthFor(OP_DIV);
+    stepPast(vm, instruction);
 }
 
-static void interpretSubtraction(VirtualMachine *vm)
+static void interpretSubtraction(VirtualMachine *vm, Instruction *instruction)
 {
     Value rightValue = pop(vm);
-    Value leftValue = pop(vm);
+    Value leftValue = peek(vm);
 
     double right = unwrapNumber(rightValue);
     double left = unwrapNumber(leftValue);
     Value result = wrapNumber(left - right);
-    push(vm, result);
+    replaceTop(vm, result);
 
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + getByteLengthFor(OP_SUB);
+    stepPast(vm, instruction);
 }
 
-static void interpretTrue(VirtualMachine *vm)
+static void interpretTrue(VirtualMachine *vm, Instruction *instruction)
 {
     Value boolean = wrapBool(true);
     push(vm, boolean);
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + getByteLengthFor(OP_TRUE);
+    stepPast(vm, instruction);
 }
 
-static void interpretFalse(VirtualMachine *vm)
+static void interpretFalse(VirtualMachine *vm, Instruction *instruction)
 {
     Value boolean = wrapBool(false);
     push(vm, boolean);
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + getByteLengthFor(OP_FALSE);
+    stepPast(vm, instruction);
 }
 
-static void interpretEquals(VirtualMachine *vm)
+static void interpretEquals(VirtualMachine *vm, Instruction *instruction)
 {
     Value right = pop(vm);
-    Value left = pop(vm);
+    Value left = peek(vm);
     Value result = wrapBool(equals(left, right));
-    push(vm, result);
+    replaceTop(vm, result);
 
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + getByteLengthFor(OP_EQUAL);
+    stepPast(vm, instruction);
 }
 
-static void interpretLessThan(VirtualMachine *vm)
+static void interpretLessThan(VirtualMachine *vm, Instruction *instruction)
 {
     Value rightValue = pop(vm);
-    Value leftValue = pop(vm);
+    Value leftValue = peek(vm);
 
     double right = unwrapNumber(rightValue);
     double left = unwrapNumber(leftValue);
     Value result = wrapBool(left < right);
-    push(vm, result);
+    replaceTop(vm, result);
 
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + getByteLengthFor(OP_LESS_THAN);
+    stepPast(vm, instruction);
 }
 
-static void interpretString(VirtualMachine *vm)
+static void interpretString(VirtualMachine *vm, Instruction *instruction)
 {
-    char *chars = (char *)(vm->frames[vm->fp].ip + 1);
-
-    Value string = wrapString(chars);
-    StringObj *underlying = (StringObj *)unwrapObject(string);
-
+    Value string = wrapString(instruction->as.chars);
     push(vm, string);
 
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + underlying->length + 2;
+    stepPast(vm, instruction);
 }
 
-static void interpretPrint(VirtualMachine *vm)
+static void interpretPrint(VirtualMachine *vm, Instruction *instruction)
 {
-    char *line = NULL;
+    Value value = pop(vm);
 
-    Value expression = pop(vm);
-    if (isNumber(expression))
-    {
-        int length = snprintf(NULL, 0, "%f", unwrapNumber(expression));
-        line = malloc(sizeof(char) * length + 1);
-        snprintf(line, length + 1, "%f", unwrapNumber(expression));
-        line[length] = '\0';
-    }
-    else if (isBool(expression))
-    {
-        bool asBool = unwrapBool(expression);
-        int length = snprintf(NULL, 0, "%s", asBool ? "true" : "false");
-        line = malloc(sizeof(char) * length + 1);
-        snprintf(line, length + 1, "%s", asBool ? "true" : "false");
-        line[length] = '\0';
-    }
-    else if (isStringObj(expression))
+    if (vm->output != NULL)
     {
-        StringObj *unwrapped = (StringObj *)unwrapObject(expression);
-        int length = snprintf(NULL, 0, "%s", unwrapped->chars);
-        line = malloc(sizeof(char) * length + 1);
-        snprintf(line, length + 1, "%s", unwrapped->chars);
+        writeValueLine(vm->output, value, vm->numberFormat);
     }
-    else if (isNil(expression))
+    else if (vm->onStdOut != NULL)
     {
-        int length = snprintf(NULL, 0, "%s", "nil");
-        line = malloc(sizeof(char) * length + 1);
-        snprintf(line, length + 1, "%s", "nil");
-        line[length] = '\0';
+        vm->onStdOut(formatValue(value, vm->numberFormat));
     }
+    stepPast(vm, instruction);
+}
 
-    if (vm->onStdOut != NULL)
-    {
-        vm->onStdOut(line);
-    }
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + 1;
+static void interpretVarDecl(VirtualMachine *vm, Instruction *instruction)
+{
+    push(vm, nil());
+    stepPast(vm, instruction);
 }
 
-static void interpretVarDecl(VirtualMachine *vm)
+static void interpretVarAssign(VirtualMachine *vm, Instruction *instruction)
 {
     CallFrame *currentFrame = getCurrentFrame(vm);
-    push(vm, nil());
-    currentFrame->ip = currentFrame->ip + getByteLengthFor(OP_VAR_DECL);
+    currentFrame->sp[instruction->as.slot] = pop(vm);
+
+    stepPast(vm, instruction);
 }
 
-static void interpretVarAssign(VirtualMachine *vm)
+static void interpretVarExpression(VirtualMachine *vm, Instruction *instruction)
 {
     CallFrame *currentFrame = getCurrentFrame(vm);
+    Value value = currentFrame->sp[instruction->as.slot];
+    push(vm, value);
+
+    stepPast(vm, instruction);
+}
+
+static void interpretGlobalVarDecl(VirtualMachine *vm, Instruction *instruction)
+{
+    COUNT_STAT(vm, globalWrites);
+    hashMapPut(&vm->global, instruction->as.name, nil());
+    stepPast(vm, instruction);
+}
 
-    uint8_t offset = *(currentFrame->ip + 1);
-    currentFrame->sp[offset] = pop(vm);
+static void interpretGlobalVarAssign(VirtualMachine *vm, Instruction *instruction)
+{
+    COUNT_STAT(vm, globalWrites);
+    hashMapPut(&vm->global, instruction->as.name, pop(vm));
+    stepPast(vm, instruction);
+}
+
+static void interpretGlobalExpression(VirtualMachine *vm, Instruction *instruction)
+{
+    COUNT_STAT(vm, globalReads);
+    // A missing global reads as nil, so only a tracer asking for misses pays to tell them apart.
+    if (PROBE_ENABLED(global__miss) && !hashMapContains(&vm->global, instruction->as.name))
+    {
+        PROBE_GLOBAL_MISS(instruction->as.name->chars);
+    }
+    push(vm, hashMapGet(&vm->global, instruction->as.name));
+    stepPast(vm, instruction);
+}
 
-    currentFrame->ip = currentFrame->ip + 2;
+static void interpretPop(VirtualMachine *vm, Instruction *instruction)
+{
+    pop(vm);
+    stepPast(vm, instruction);
 }
 
-static void interpretVarExpression(VirtualMachine *vm)
+static void jumpIf(VirtualMachine *vm, Instruction *instruction, bool shouldJump)
 {
     CallFrame *currentFrame = getCurrentFrame(vm);
+    currentFrame->ip = shouldJump ? instruction->as.target : instruction + 1;
+}
 
-    uint8_t offset = *(currentFrame->ip + 1);
-    Value value = currentFrame->sp[offset];
-    push(vm, value);
+static void interpretJumpIfFalse(VirtualMachine *vm, Instruction *instruction)
+{
+    bool unwrapped = unwrapBool(pop(vm));
+    jumpIf(vm, instruction, !unwrapped);
+}
+
+static void interpretJumpIfFalsePeek(VirtualMachine *vm, Instruction *instruction)
+{
+    bool unwrapped = unwrapBool(peek(vm));
+    jumpIf(vm, instruction, !unwrapped);
+}
 
-    currentFrame->ip = currentFrame->ip + 2;
+static void interpretJumpIfTruePeek(VirtualMachine *vm, Instruction *instruction)
+{
+    bool unwrapped = unwrapBool(peek(vm));
+    jumpIf(vm, instruction, unwrapped);
+}
+
+static void interpretJump(VirtualMachine *vm, Instruction *instruction)
+{
+    jumpIf(vm, instruction, true);
+}
+
+static void interpretLoopIfTrue(VirtualMachine *vm, Instruction *instruction)
+{
+    bool unwrapped = unwrapBool(pop(vm));
+    jumpIf(vm, instruction, unwrapped);
+
+    if (unwrapped)
+    {
+        countBackEdge(vm, instruction);
+    }
+}
+
+static void interpretLocalAddConstant(VirtualMachine *vm, Instruction *instruction)
+{
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    Value local = currentFrame->sp[instruction->as.local.slot];
+    push(vm, add(local, instruction->as.local.constant));
+
+    stepPast(vm, instruction);
 }
 
-static void interpretGlobalVarDecl(VirtualMachine *vm)
+static void interpretLocalIncrement(VirtualMachine *vm, Instruction *instruction)
 {
-    int constantIndex = *(vm->frames[vm->fp].ip + 1);
-    Value constant = getCurrentFrameConstantAt(vm, constantIndex);
-    StringObj *asString = (StringObj *)unwrapObject(constant);
-    hashMapPut(&vm->global, asString, nil());
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    Value *local = &currentFrame->sp[instruction->as.local.slot];
+    *local = add(*local, instruction->as.local.constant);
 
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + 2;
+    stepPast(vm, instruction);
 }
 
-static void interpretGlobalVarAssign(VirtualMachine *vm)
+static bool isLocalLessThanConstant(VirtualMachine *vm, Instruction *instruction)
 {
-    int constantIndex = *(vm->frames[vm->fp].ip + 1);
-    Value constant = getCurrentFrameConstantAt(vm, constantIndex);
-    StringObj *asString = (StringObj *)unwrapObject(constant);
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    double left = unwrapNumber(currentFrame->sp[instruction->as.local.slot]);
+    double right = unwrapNumber(instruction->as.local.constant);
+    return left < right;
+}
 
-    hashMapPut(&vm->global, asString, pop(vm));
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + 2;
+static void interpretLocalLessThanConstant(VirtualMachine *vm, Instruction *instruction)
+{
+    push(vm, wrapBool(isLocalLessThanConstant(vm, instruction)));
+    stepPast(vm, instruction);
 }
 
-static void interpretGlobalExpression(VirtualMachine *vm)
+static void interpretLoopIfLocalLessThanConstant(VirtualMachine *vm, Instruction *instruction)
 {
-    int constantIndex = *(vm->frames[vm->fp].ip + 1);
-    Value constant = getCurrentFrameConstantAt(vm, constantIndex);
-    StringObj *asString = (StringObj *)unwrapObject(constant);
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    bool shouldLoop = isLocalLessThanConstant(vm, instruction);
+    currentFrame->ip = shouldLoop ? instruction->as.local.target : instruction + 1;
+
+    if (shouldLoop)
+    {
+        countBackEdge(vm, instruction);
+    }
+}
 
-    push(vm, hashMapGet(&vm->global, asString));
+// Trace handlers. A guard that fails leaves ip on the instruction it was recorded from,
+// with the stack the way that instruction expects it, and the interpreter carries on.
+static void interpretGuardBranch(VirtualMachine *vm, Instruction *instruction)
+{
+    Instruction *branch = instruction->exit;
+    getHandlerFor(branch->opCode)(vm, branch);
 
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + 2;
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    if (currentFrame->ip == instruction->as.target)
+    {
+        currentFrame->ip = instruction + 1;
+    }
 }
 
-static void interpretPop(VirtualMachine *vm)
+static void interpretGuardNumberAdd(VirtualMachine *vm, Instruction *instruction)
 {
+    Value rightValue = vm->stackTop[-1];
+    Value leftValue = vm->stackTop[-2];
+    if (!isNumber(leftValue) || !isNumber(rightValue))
+    {
+        getCurrentFrame(vm)->ip = instruction->exit;
+        return;
+    }
+
     pop(vm);
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + 1;
+    replaceTop(vm, wrapNumber(unwrapNumber(leftValue) + unwrapNumber(rightValue)));
+    stepPast(vm, instruction);
+}
+
+static void interpretGuardNumberLocalAddConstant(VirtualMachine *vm, Instruction *instruction)
+{
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    Value local = currentFrame->sp[instruction->as.local.slot];
+    if (!isNumber(local))
+    {
+        currentFrame->ip = instruction->exit;
+        return;
+    }
+
+    push(vm, wrapNumber(unwrapNumber(local) + unwrapNumber(instruction->as.local.constant)));
+    stepPast(vm, instruction);
 }
 
-static void interpretJumpIfFalse(VirtualMachine *vm)
+static void interpretGuardNumberLocalIncrement(VirtualMachine *vm, Instruction *instruction)
 {
-    Value expression = pop(vm);
-    bool unwrapped = unwrapBool(expression);
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    Value *local = &currentFrame->sp[instruction->as.local.slot];
+    if (!isNumber(*local))
+    {
+        currentFrame->ip = instruction->exit;
+        return;
+    }
+
+    *local = wrapNumber(unwrapNumber(*local) + unwrapNumber(instruction->as.local.constant));
+    stepPast(vm, instruction);
+}
 
-    if (!unwrapped)
+// Ends every trace: tests the loop condition the way the back-edge would, and either goes
+// round the trace again or leaves it for the instruction after the loop.
+static void interpretTraceLoop(VirtualMachine *vm, Instruction *instruction)
+{
+    Instruction *backEdge = instruction->exit;
+    bool shouldLoop;
+    if (backEdge->opCode == OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT)
     {
-        uint8_t msb = *(vm->frames[vm->fp].ip + 1);
-        uint8_t lsb = *(vm->frames[vm->fp].ip + 2);
-        uint16_t jumpLocation = (msb << 8) | lsb;
-        vm->frames[vm->fp].ip = &vm->frames[vm->fp].function->bytecode->code[jumpLocation];
+        shouldLoop = isLocalLessThanConstant(vm, backEdge);
     }
     else
     {
-        vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + 3;
+        shouldLoop = unwrapBool(pop(vm));
     }
+
+    getCurrentFrame(vm)->ip = shouldLoop ? instruction->as.target : backEdge + 1;
 }
 
-static void interpretLoop(VirtualMachine *vm)
+static const char *getFunctionName(FunctionObj *function)
 {
-    uint8_t jumpOffset = *(vm->frames[vm->fp].ip + 1);
-    vm->frames[vm->fp].ip = vm->frames[vm->fp].ip - (jumpOffset);
+    return function->name == NULL ? "script" : function->name->chars;
 }
 
-static void interpretJump(VirtualMachine *vm)
+static void disassembleFunction(FunctionObj *function)
 {
-    uint8_t msb = *(vm->frames[vm->fp].ip + 1);
-    uint8_t lsb = *(vm->frames[vm->fp].ip + 2);
-    uint16_t jumpLocation = (msb << 8) | lsb;
+    DisassemblyOutput output;
+    initDisassemblyToFile(&output, stdout, DISASSEMBLY_TEXT);
+    writeDisassembly(&output, function->bytecode, getFunctionName(function));
+}
 
-    vm->frames[vm->fp].ip = &vm->frames[vm->fp].function->bytecode->code[jumpLocation];
+static void enterFunction(VirtualMachine *vm, FunctionObj *function)
+{
+    countCall(vm, function);
 }
 
-static void stdSysOut(char *message)
+static void enterFunctionAndDisassemble(VirtualMachine *vm, FunctionObj *function)
 {
-    printf(message);
-    free(message);
+    disassembleFunction(function);
+    countCall(vm, function);
+}
+
+void setDebugMode(VirtualMachine *vm, bool isEnabled)
+{
+    vm->debugMode = isEnabled;
+    vm->handlers = getHandlerTable(isEnabled);
+    vm->enterFunction = isEnabled ? enterFunctionAndDisassemble : enterFunction;
 }
 
 CallFrame *prepareForCall(VirtualMachine *vm, FunctionObj *functionObj)
 {
+    int spIndex = vm->fp == -1 ? 0 : getStackIndexOf(vm, vm->stackTop);
+    if (!reserveCall(vm, vm->fp + 2, spIndex + functionObj->maxStackDepth))
+    {
+        // Nothing has run yet, so there is no frame to unwind to.
+        reportError(vm, "Stack overflow.");
+        return NULL;
+    }
+
+    threadReachableFunctions(vm, functionObj);
     vm->fp++;
     CallFrame *newFrame = getCurrentFrame(vm);
     newFrame->function = functionObj;
-    newFrame->ip = functionObj->bytecode->code;
-    newFrame->currentStackIndex = 0;
-    newFrame->sp = &vm->stack[vm->currentStackIndex + 1];
+    newFrame->ip = getDecodedCode(functionObj);
+    newFrame->sp = &vm->stack[spIndex];
+    newFrame->returnOffset = 0;
+    vm->stackTop = newFrame->sp;
+    COUNT_STAT(vm, calls);
+    PROBE_FUNCTION_ENTRY(getFunctionName(functionObj), vm->fp + 1, functionObj->arity);
+    vm->enterFunction(vm, functionObj);
+
+    return newFrame;
+}
 
-    if (vm->debugMode)
+static void pushCallFrame(VirtualMachine *vm, FunctionObj *toRun, int argumentCount, int returnOffset)
+{
+    int spIndex = getStackIndexOf(vm, vm->stackTop - argumentCount);
+    if (!reserveCall(vm, vm->fp + 2, spIndex + argumentCount + toRun->maxStackDepth))
     {
-        disassembleChunk(functionObj->bytecode, functionObj->name->chars, stdSysOut);
+        haltWithError(vm, "Stack overflow.");
+        return;
     }
 
-    return newFrame;
+    CallFrame *nextFrame = getNextFrame(vm);
+    nextFrame->function = toRun;
+    nextFrame->sp = &vm->stack[spIndex];
+    nextFrame->ip = getDecodedCode(toRun);
+    nextFrame->returnOffset = returnOffset;
+
+    vm->fp++;
+    COUNT_STAT(vm, calls);
+    PROBE_FUNCTION_ENTRY(getFunctionName(toRun), vm->fp + 1, argumentCount);
+    countCall(vm, toRun);
+}
+
+// Only calls the compiler could not check need this, the direct calls are always right.
+static bool hasRightArgumentCount(VirtualMachine *vm, FunctionObj *toRun, int argumentCount)
+{
+    if (argumentCount == toRun->arity)
+    {
+        return true;
+    }
+
+    char message[128];
+    snprintf(message, sizeof(message), "Expected %d arguments but got %d.", toRun->arity, argumentCount);
+    haltWithError(vm, message);
+    return false;
 }
 
-static void interpretCall(VirtualMachine *vm)
+static void interpretCall(VirtualMachine *vm, Instruction *instruction)
 {
-    uint8_t *ip = getCurrentIp(vm);
-    uint8_t argumentCount = *(ip + 1);
+    int argumentCount = instruction->as.argumentCount;
+    stepPast(vm, instruction);
 
-    CallFrame *currentFrame = getCurrentFrame(vm);
-    currentFrame->ip = currentFrame->ip + 2;
-    Value *startOfFunctionCall = &currentFrame->sp[currentFrame->currentStackIndex - argumentCount - 1];
+    Value *startOfFunctionCall = vm->stackTop - argumentCount - 1;
 
     FunctionObj *toRun = unwrapFunctionObj(*startOfFunctionCall);
+    if (hasRightArgumentCount(vm, toRun, argumentCount))
+    {
+        pushCallFrame(vm, toRun, argumentCount, 1);
+    }
+}
 
-    CallFrame *nextFrame = getNextFrame(vm);
-    nextFrame->currentStackIndex = argumentCount;
-    nextFrame->function = toRun;
-    nextFrame->sp = startOfFunctionCall + 1;
-    nextFrame->ip = toRun->bytecode->code;
+// The compiler has already checked the argument count against the callee's arity.
+static void interpretCallDirect(VirtualMachine *vm, Instruction *instruction)
+{
+    stepPast(vm, instruction);
+
+    FunctionObj *toRun = instruction->as.callee;
+    pushCallFrame(vm, toRun, toRun->arity, 0);
+}
+
+// Reuses the current call frame for a call in tail position. The arguments are moved
+// down to the start of the frame's stack window, and the frame's returnOffset stays the
+// same, so returning from toRun returns straight to the caller.
+static void replaceCallFrame(VirtualMachine *vm, FunctionObj *toRun, int argumentCount)
+{
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    int spIndex = getStackIndexOf(vm, currentFrame->sp);
+    if (!reserveCall(vm, vm->fp + 1, spIndex + argumentCount + toRun->maxStackDepth))
+    {
+        haltWithError(vm, "Stack overflow.");
+        return;
+    }
+
+    // To a tracer the function being replaced returns and toRun is entered at its depth.
+    PROBE_FUNCTION_RETURN(getFunctionName(currentFrame->function), vm->fp + 1);
+    Value *arguments = vm->stackTop - argumentCount;
+    memmove(currentFrame->sp, arguments, sizeof(Value) * argumentCount);
+
+    vm->stackTop = currentFrame->sp + argumentCount;
+    currentFrame->function = toRun;
+    currentFrame->ip = getDecodedCode(toRun);
+    COUNT_STAT(vm, tailCalls);
+    PROBE_FUNCTION_ENTRY(getFunctionName(toRun), vm->fp + 1, argumentCount);
+    countCall(vm, toRun);
+}
 
-    if (vm->debugMode)
+static void interpretTailCall(VirtualMachine *vm, Instruction *instruction)
+{
+    int argumentCount = instruction->as.argumentCount;
+    FunctionObj *toRun = unwrapFunctionObj(vm->stackTop[-argumentCount - 1]);
+    if (hasRightArgumentCount(vm, toRun, argumentCount))
     {
-        disassembleChunk(toRun->bytecode, toRun->name->chars, stdSysOut);
+        replaceCallFrame(vm, toRun, argumentCount);
     }
+}
 
-    vm->fp++;
+static void interpretTailCallDirect(VirtualMachine *vm, Instruction *instruction)
+{
+    FunctionObj *toRun = instruction->as.callee;
+    replaceCallFrame(vm, toRun, toRun->arity);
 }
 
-static bool hasReturnValue(CallFrame *frame)
+static bool hasReturnValue(VirtualMachine *vm, CallFrame *frame)
 {
     int numFunctionArgs = frame->function->arity;
-    return frame->currentStackIndex == numFunctionArgs + 1;
+    return vm->stackTop - frame->sp == numFunctionArgs + 1;
 }
 
-static void interpretReturn(VirtualMachine *vm)
+static void interpretReturn(VirtualMachine *vm, Instruction *instruction)
 {
     CallFrame *currentFrame = getCurrentFrame(vm);
     Value returnValue = nil();
 
-    if (hasReturnValue(currentFrame))
+    if (hasReturnValue(vm, currentFrame))
     {
         returnValue = pop(vm);
     }
 
+    PROBE_FUNCTION_RETURN(getFunctionName(currentFrame->function), vm->fp + 1);
     vm->fp--;
-    CallFrame *prevFrame = getCurrentFrame(vm);
-
-    int offset = currentFrame->function->arity + 1;
-
-    prevFrame->currentStackIndex = prevFrame->currentStackIndex - offset;
+    vm->stackTop = currentFrame->sp - currentFrame->returnOffset;
     push(vm, returnValue);
 
     currentFrame->function = NULL;
-    currentFrame->currentStackIndex = 0;
     currentFrame->ip = NULL;
     currentFrame->sp = NULL;
 }
 
-static void interpretOr(VirtualMachine *vm)
+static void interpretOr(VirtualMachine *vm, Instruction *instruction)
 {
-    CallFrame *currentFrame = getCurrentFrame(vm);
-
     Value right = pop(vm);
-    Value left = pop(vm);
+    Value left = peek(vm);
 
     bool rightBool = unwrapBool(right);
     bool leftBool = unwrapBool(left);
 
     bool resultBool = leftBool || rightBool;
     Value result = wrapBool(resultBool);
-    push(vm, result);
+    replaceTop(vm, result);
 
-    currentFrame->ip = currentFrame->ip + 1;
+    stepPast(vm, instruction);
 }
 
-static void interpretLessThanOrEquals(VirtualMachine *vm)
+static void interpretLessThanOrEquals(VirtualMachine *vm, Instruction *instruction)
 {
-    CallFrame *currentFrame = getCurrentFrame(vm);
-
     Value right = pop(vm);
-    Value left = pop(vm);
+    Value left = peek(vm);
 
     double rightNum = unwrapNumber(right);
     double leftNum = unwrapNumber(left);
 
     Value result = wrapBool(leftNum <= rightNum);
-    push(vm, result);
+    replaceTop(vm, result);
 
-    currentFrame->ip = currentFrame->ip + 1;
+    stepPast(vm, instruction);
 }
 
-static bool isAtEndOfBytecode(VirtualMachine *vm)
+static void interpretInvalid(VirtualMachine *vm, Instruction *instruction)
 {
-    OpCode opCode = *(vm->frames[vm->fp].ip);
-    return OP_RETURN == opCode && vm->fp == 0;
+    printf("Invalid op code.");
+    stepPast(vm, instruction);
 }
 
-void interpret(VirtualMachine *vm)
+// Short and wide forms of an instruction share a handler, the decoder has already
+// widened their operands.
+static InstructionHandler handlers[] = {
+    [OP_RETURN] = interpretReturn,
+    [OP_CONSTANT] = interpretConstant,
+    [OP_NEGATE] = interpretNegate,
+    [OP_ADD] = interpretAdd,
+    [OP_MULT] = interpretMultiplication,
+    [OP_DIV] = interpretDivision,
+    [OP_SUB] = interpretSubtraction,
+    [OP_TRUE] = interpretTrue,
+    [OP_FALSE] = interpretFalse,
+    [OP_EQUAL] = interpretEquals,
+    [OP_STRING] = interpretString,
+    [OP_PRINT] = interpretPrint,
+    [OP_VAR_DECL] = interpretVarDecl,
+    [OP_VAR_ASSIGN] = interpretVarAssign,
+    [OP_VAR_EXPRESSION] = interpretVarExpression,
+    [OP_STACK_PEEK] = interpretInvalid,
+    [OP_POP] = interpretPop,
+    [OP_VAR_GLOBAL_DECL] = interpretGlobalVarDecl,
+    [OP_VAR_GLOBAL_ASSIGN] = interpretGlobalVarAssign,
+    [OP_VAR_GLOBAL_EXPRESSION] = interpretGlobalExpression,
+    [OP_JUMP_IF_FALSE] = interpretJumpIfFalse,
+    [OP_JUMP] = interpretJump,
+    [OP_LOOP] = interpretJump,
+    [OP_LESS_THAN] = interpretLessThan,
+    [OP_LESS_THAN_EQUALS] = interpretLessThanOrEquals,
+    [OP_CALL] = interpretCall,
+    [OP_OR] = interpretOr,
+    [OP_JUMP_IF_FALSE_PEEK] = interpretJumpIfFalsePeek,
+    [OP_JUMP_IF_TRUE_PEEK] = interpretJumpIfTruePeek,
+    [OP_LOOP_IF_TRUE] = interpretLoopIfTrue,
+    [OP_CALL_DIRECT] = interpretCallDirect,
+    [OP_TAIL_CALL] = interpretTailCall,
+    [OP_TAIL_CALL_DIRECT] = interpretTailCallDirect,
+    [OP_CONSTANT_LONG] = interpretConstant,
+    [OP_VAR_ASSIGN_LONG] = interpretVarAssign,
+    [OP_VAR_EXPRESSION_LONG] = interpretVarExpression,
+    [OP_VAR_GLOBAL_DECL_LONG] = interpretGlobalVarDecl,
+    [OP_VAR_GLOBAL_ASSIGN_LONG] = interpretGlobalVarAssign,
+    [OP_VAR_GLOBAL_EXPRESSION_LONG] = interpretGlobalExpression,
+    [OP_JUMP_LONG] = interpretJump,
+    [OP_JUMP_IF_FALSE_LONG] = interpretJumpIfFalse,
+    [OP_JUMP_IF_FALSE_PEEK_LONG] = interpretJumpIfFalsePeek,
+    [OP_JUMP_IF_TRUE_PEEK_LONG] = interpretJumpIfTruePeek,
+    [OP_LOOP_IF_TRUE_LONG] = interpretLoopIfTrue,
+    [OP_CALL_DIRECT_LONG] = interpretCallDirect,
+    [OP_TAIL_CALL_DIRECT_LONG] = interpretTailCallDirect,
+    [OP_LOCAL_ADD_CONSTANT] = interpretLocalAddConstant,
+    [OP_LOCAL_INCREMENT] = interpretLocalIncrement,
+    [OP_LOCAL_LESS_THAN_CONSTANT] = interpretLocalLessThanConstant,
+    [OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT] = interpretLoopIfLocalLessThanConstant,
+    [OP_GUARD_BRANCH] = interpretGuardBranch,
+    [OP_GUARD_NUMBER_ADD] = interpretGuardNumberAdd,
+    [OP_GUARD_NUMBER_LOCAL_ADD_CONSTANT] = interpretGuardNumberLocalAddConstant,
+    [OP_GUARD_NUMBER_LOCAL_INCREMENT] = interpretGuardNumberLocalIncrement,
+    [OP_TRACE_LOOP] = interpretTraceLoop,
+};
+
+static InstructionHandler getHandlerFor(OpCode opCode)
 {
-    while (!isAtEndOfBytecode(vm))
+    InstructionHandler handler = handlers[opCode];
+    return handler == NULL ? interpretInvalid : handler;
+}
+
+// Runs a call's usual handler, then shows the function it went into. A call that failed
+// leaves ip somewhere other than the start of a function.
+static void interpretCallAndDisassemble(VirtualMachine *vm, Instruction *instruction)
+{
+    getHandlerFor(instruction->opCode)(vm, instruction);
+
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    if (vm->fp >= 0 && currentFrame->ip == currentFrame->function->decoded)
     {
-        OpCode opCode = *(vm->frames[vm->fp].ip);
-        switch (opCode)
-        {
-        case OP_CONSTANT:
-            interpretConstant(vm);
-            break;
-        case OP_NEGATE:
-            interpretNegate(vm);
-            break;
-        case OP_ADD:
-            interpretAdd(vm);
-            break;
-        case OP_MULT:
-            interpretMultiplication(vm);
-            break;
-        case OP_DIV:
-            interpretDivision(vm);
-            break;
-        case OP_SUB:
-            interpretSubtraction(vm);
-            break;
-        case OP_LESS_THAN:
-            interpretLessThan(vm);
-            break;
-        case OP_TRUE:
-            interpretTrue(vm);
-            break;
-        case OP_FALSE:
-            interpretFalse(vm);
-            break;
-        case OP_EQUAL:
-            interpretEquals(vm);
-            break;
-        case OP_STRING:
-            interpretString(vm);
-            break;
-        case OP_PRINT:
-            interpretPrint(vm);
-            break;
-        case OP_VAR_DECL:
-            interpretVarDecl(vm);
-            break;
-        case OP_VAR_ASSIGN:
-            interpretVarAssign(vm);
-            break;
-        case OP_VAR_EXPRESSION:
-            interpretVarExpression(vm);
-            break;
-        case OP_VAR_GLOBAL_DECL:
-            interpretGlobalVarDecl(vm);
-            break;
-        case OP_VAR_GLOBAL_ASSIGN:
-            interpretGlobalVarAssign(vm);
-            break;
-        case OP_VAR_GLOBAL_EXPRESSION:
-            interpretGlobalExpression(vm);
-            break;
-        case OP_POP:
-            interpretPop(vm);
-            break;
-        case OP_JUMP_IF_FALSE:
-            interpretJumpIfFalse(vm);
-            break;
-        case OP_LOOP:
-            interpretLoop(vm);
-            break;
-        case OP_JUMP:
-            interpretJump(vm);
-            break;
-        case OP_CALL:
-            interpretCall(vm);
-            break;
-        case OP_RETURN:
-            interpretReturn(vm);
-            break;
-        case OP_OR:
-            interpretOr(vm);
-            break;
-        case OP_LESS_THAN_EQUALS:
-            interpretLessThanOrEquals(vm);
-            break;
-        default:
-            printf("Invalid op code.");
+        disassembleFunction(currentFrame->function);
+    }
+}
+
+// The handlers used while debugging. Only the calls differ, so that the handlers used
+// otherwise never have to ask whether the VM is debugging.
+static InstructionHandler debugHandlers[OP_CODE_COUNT];
+
+static InstructionHandler *getHandlerTable(bool isDebug)
+{
+    if (!isDebug)
+    {
+        return handlers;
+    }
+
+    if (debugHandlers[OP_RETURN] == NULL)
+    {
+        for (int i = 0; i < OP_CODE_COUNT; i++)
+        {
+            debugHandlers[i] = isCallOpCode(i) ? interpretCallAndDisassemble : getHandlerFor(i);
+        }
+    }
+    return debugHandlers;
+}
+
+static InstructionHandler getHandlerIn(InstructionHandler *table, OpCode opCode)
+{
+    return table == handlers ? getHandlerFor(opCode) : table[opCode];
+}
+
+static bool isLongForm(OpCode opCode)
+{
+    return opCode >= OP_CONSTANT_LONG && opCode <= OP_TAIL_CALL_DIRECT_LONG;
+}
+
+static uint32_t readConstantIndex(Chunk *bytecode, int offset)
+{
+    OpCode opCode = bytecode->code[offset];
+    return isLongForm(opCode) ? readLong(bytecode, offset + 1) : bytecode->code[offset + 1];
+}
+
+static uint32_t readJumpDistance(Chunk *bytecode, int offset)
+{
+    OpCode opCode = bytecode->code[offset];
+    return isLongForm(opCode) ? readLong(bytecode, offset + 1) : readShort(bytecode, offset + 1);
+}
+
+static bool isBackwardJump(OpCode opCode)
+{
+    return opCode == OP_LOOP || opCode == OP_LOOP_IF_TRUE || opCode == OP_LOOP_IF_TRUE_LONG;
+}
+
+// Bytecode offset the jump at offset lands on.
+static int getJumpDestination(Chunk *bytecode, int offset)
+{
+    OpCode opCode = bytecode->code[offset];
+    if (opCode == OP_LOOP)
+    {
+        return offset - bytecode->code[offset + 1];
+    }
+
+    int end = offset + getInstructionLength(bytecode, offset);
+    uint32_t distance = readJumpDistance(bytecode, offset);
+    return isBackwardJump(opCode) ? end - distance : end + distance;
+}
+
+static void decodeOperand(Chunk *bytecode, int offset, Instruction *instruction, int *decodedIndexAt, Instruction *decoded)
+{
+    OpCode opCode = instruction->opCode;
+    if (opCode == OP_CONSTANT || opCode == OP_CONSTANT_LONG)
+    {
+        instruction->as.constant = getConstantAt(bytecode, readConstantIndex(bytecode, offset));
+    }
+    else if (opCode == OP_VAR_GLOBAL_DECL || opCode == OP_VAR_GLOBAL_ASSIGN || opCode == OP_VAR_GLOBAL_EXPRESSION || opCode == OP_VAR_GLOBAL_DECL_LONG || opCode == OP_VAR_GLOBAL_ASSIGN_LONG || opCode == OP_VAR_GLOBAL_EXPRESSION_LONG)
+    {
+        instruction->as.name = (StringObj *)unwrapObject(getConstantAt(bytecode, readConstantIndex(bytecode, offset)));
+    }
+    else if (opCode == OP_CALL_DIRECT || opCode == OP_TAIL_CALL_DIRECT || opCode == OP_CALL_DIRECT_LONG || opCode == OP_TAIL_CALL_DIRECT_LONG)
+    {
+        instruction->as.callee = unwrapFunctionObj(getConstantAt(bytecode, readConstantIndex(bytecode, offset)));
+    }
+    else if (opCode == OP_VAR_ASSIGN || opCode == OP_VAR_EXPRESSION)
+    {
+        instruction->as.slot = bytecode->code[offset + 1];
+    }
+    else if (opCode == OP_VAR_ASSIGN_LONG || opCode == OP_VAR_EXPRESSION_LONG)
+    {
+        instruction->as.slot = readShort(bytecode, offset + 1);
+    }
+    else if (opCode == OP_CALL || opCode == OP_TAIL_CALL)
+    {
+        instruction->as.argumentCount = bytecode->code[offset + 1];
+    }
+    else if (opCode == OP_STRING)
+    {
+        instruction->as.chars = (char *)&bytecode->code[offset + 1];
+    }
+    else if (isJumpOpCode(opCode))
+    {
+        instruction->as.target = &decoded[decodedIndexAt[getJumpDestination(bytecode, offset)]];
+    }
+}
+
+// Translates a function's bytecode into one Instruction per bytecode instruction. The
+// first pass numbers the instructions so that the second can point jumps straight at
+// the Instruction they land on.
+static void decodeFunction(FunctionObj *function, InstructionHandler *table)
+{
+    Chunk *bytecode = function->bytecode;
+    int *decodedIndexAt = malloc(sizeof(int) * (bytecode->count + 1));
+
+    int decodedCount = 0;
+    for (int offset = 0; offset < bytecode->count; offset += getInstructionLength(bytecode, offset))
+    {
+        decodedIndexAt[offset] = decodedCount;
+        decodedCount++;
+    }
+    decodedIndexAt[bytecode->count] = decodedCount;
+
+    Instruction *decoded = GROW_ARRAY(Instruction, NULL, 0, decodedCount);
+    for (int offset = 0; offset < bytecode->count; offset += getInstructionLength(bytecode, offset))
+    {
+        Instruction *instruction = &decoded[decodedIndexAt[offset]];
+        instruction->opCode = bytecode->code[offset];
+        instruction->handler = getHandlerIn(table, instruction->opCode);
+        instruction->exit = NULL;
+        decodeOperand(bytecode, offset, instruction, decodedIndexAt, decoded);
+    }
+
+    free(decodedIndexAt);
+    function->decoded = decoded;
+    function->decodedCount = decodedCount;
+    function->threadedWith = table;
+}
+
+// Native code has the handlers it calls built in, so a compiled function keeps them.
+static void rethreadFunction(FunctionObj *function, InstructionHandler *table)
+{
+    if (function->native != NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < function->decodedCount; i++)
+    {
+        function->decoded[i].handler = getHandlerIn(table, function->decoded[i].opCode);
+    }
+    function->threadedWith = table;
+}
+
+// Makes every function reachable from the one about to run use the VM's handlers. Functions
+// are only decoded lazily with the usual handlers, so while debugging they are decoded here.
+static void threadReachableFunctions(VirtualMachine *vm, FunctionObj *entry)
+{
+    int count = 1;
+    int capacity = 8;
+    FunctionObj **reachable = GROW_ARRAY(FunctionObj *, NULL, 0, capacity);
+    reachable[0] = entry;
+
+    for (int i = 0; i < count; i++)
+    {
+        FunctionObj *function = reachable[i];
+        if (function->decoded == NULL && vm->handlers != handlers)
+        {
+            decodeFunction(function, vm->handlers);
+        }
+        else if (function->decoded != NULL && function->threadedWith != vm->handlers)
+        {
+            rethreadFunction(function, vm->handlers);
+        }
+
+        ValueArray *constants = &function->bytecode->constants;
+        for (uint32_t j = 0; j < constants->count; j++)
+        {
+            Value constant = getValueAt(constants, j);
+            if (!isFunctionObj(constant))
+            {
+                continue;
+            }
+
+            // Recursive functions hold themselves as a constant.
+            FunctionObj *callee = unwrapFunctionObj(constant);
+            bool isSeen = false;
+            for (int k = 0; k < count && !isSeen; k++)
+            {
+                isSeen = reachable[k] == callee;
+            }
+            if (!isSeen)
+            {
+                if (count == capacity)
+                {
+                    reachable = GROW_ARRAY(FunctionObj *, reachable, capacity, GROW_CAPACITY(capacity));
+                    capacity = GROW_CAPACITY(capacity);
+                }
+                reachable[count++] = callee;
+            }
+        }
+    }
+
+    FREE_ARRAY(FunctionObj *, reachable, capacity);
+}
+
+Instruction *getDecodedCode(FunctionObj *function)
+{
+    if (function->decoded == NULL)
+    {
+        decodeFunction(function, handlers);
+    }
+    return function->decoded;
+}
+
+static void enterNativeCode(VirtualMachine *vm, Instruction *instruction)
+{
+    FunctionObj *function = getCurrentFrame(vm)->function;
+    runNativeCode(function->native, vm, instruction - function->decoded);
+}
+
+// Traces are named after the function and the index of the back-edge they loop on.
+static void nameNativeCode(VirtualMachine *vm, FunctionObj *function, NativeCode *native, Instruction *backEdge)
+{
+    if (vm->perfMap == NULL || native == NULL)
+    {
+        return;
+    }
+
+    const char *name = getFunctionName(function);
+    char symbol[256];
+    if (backEdge == NULL)
+    {
+        snprintf(symbol, sizeof(symbol), "lox:%s", name);
+    }
+    else
+    {
+        snprintf(symbol, sizeof(symbol), "lox:%s:trace@%d", name, (int)(backEdge - function->decoded));
+    }
+    recordNativeCode(vm->perfMap, symbol, native);
+}
+
+// Native code is entered through the handlers, so interpret() needs no check of its own.
+// OP_RETURN keeps its handler, interpret() has to see it to know when the script is done.
+static void compileToNativeCode(VirtualMachine *vm, FunctionObj *function)
+{
+    function->native = compileToNative(function->decoded, function->decodedCount);
+    if (function->native == NULL)
+    {
+        return;
+    }
+    nameNativeCode(vm, function, function->native, NULL);
+
+    for (int i = 0; i < function->decodedCount; i++)
+    {
+        if (function->decoded[i].opCode != OP_RETURN)
+        {
+            function->decoded[i].handler = enterNativeCode;
+        }
+    }
+}
+
+// Swaps a hot function's instructions for an optimized copy. Frames already running the
+// function are moved across too, which is how a long loop in a function that is only
+// called once still gets the optimized code.
+static void tierUp(VirtualMachine *vm, FunctionObj *function)
+{
+    Instruction *decoded = function->decoded;
+    int *newIndexOf = malloc(sizeof(int) * function->decodedCount);
+
+    int optimizedCount;
+    Instruction *optimized = optimizeInstructions(decoded, function->decodedCount, &optimizedCount, newIndexOf);
+    for (int i = 0; i < optimizedCount; i++)
+    {
+        optimized[i].handler = getHandlerIn(function->threadedWith, optimized[i].opCode);
+    }
+
+    for (int i = 0; i <= vm->fp; i++)
+    {
+        if (vm->frames[i].function == function)
+        {
+            vm->frames[i].ip = &optimized[newIndexOf[vm->frames[i].ip - decoded]];
+        }
+    }
+
+    free(newIndexOf);
+    FREE_ARRAY(Instruction, decoded, function->decodedCount);
+    function->decoded = optimized;
+    function->decodedCount = optimizedCount;
+    function->isOptimized = true;
+
+    if (vm->useJit && vm->recorder == NULL)
+    {
+        compileToNativeCode(vm, function);
+    }
+}
+
+static void countCall(VirtualMachine *vm, FunctionObj *function)
+{
+    if (function->isOptimized || vm->profile != NULL)
+    {
+        return;
+    }
+
+    function->callCount++;
+    if (function->callCount >= vm->hotCallThreshold)
+    {
+        tierUp(vm, function);
+    }
+}
+
+#define MAX_TRACE_LENGTH 256
+// A trace is dropped once it has run this often and most runs ended on a guard.
+#define MIN_TRACE_ENTRIES_TO_DISABLE 16
+
+static bool isBackEdge(OpCode opCode)
+{
+    return opCode == OP_LOOP || opCode == OP_LOOP_IF_TRUE || opCode == OP_LOOP_IF_TRUE_LONG || opCode == OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT;
+}
+
+static bool isUnconditionalJump(OpCode opCode)
+{
+    return opCode == OP_JUMP || opCode == OP_JUMP_LONG;
+}
+
+static bool isBranch(OpCode opCode)
+{
+    return isJumpOpCode(opCode) && !isUnconditionalJump(opCode) && !isBackEdge(opCode);
+}
+
+static Trace *findTrace(FunctionObj *function, Instruction *backEdge)
+{
+    for (int i = 0; i < function->traceCount; i++)
+    {
+        if (function->traces[i].backEdge == backEdge)
+        {
+            return &function->traces[i];
+        }
+    }
+    return NULL;
+}
+
+static Trace *addTrace(FunctionObj *function, Instruction *backEdge)
+{
+    if (function->traceCount == function->traceCapacity)
+    {
+        int oldCapacity = function->traceCapacity;
+        function->traceCapacity = GROW_CAPACITY(oldCapacity);
+        function->traces = GROW_ARRAY(Trace, function->traces, oldCapacity, function->traceCapacity);
+    }
+
+    Trace *trace = &function->traces[function->traceCount];
+    function->traceCount++;
+    trace->backEdge = backEdge;
+    trace->instructions = NULL;
+    trace->count = 0;
+    trace->native = NULL;
+    trace->entryCount = 0;
+    trace->guardExitCount = 0;
+    trace->isDisabled = false;
+    return trace;
+}
+
+// Chooses the trace form of an instruction from the values it is about to run on.
+static void specializeForTrace(VirtualMachine *vm, Instruction *traced)
+{
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    OpCode opCode = traced->opCode;
+    if (opCode == OP_ADD && isNumber(vm->stackTop[-1]) && isNumber(vm->stackTop[-2]))
+    {
+        traced->opCode = OP_GUARD_NUMBER_ADD;
+    }
+    else if (opCode == OP_LOCAL_ADD_CONSTANT && isNumber(currentFrame->sp[traced->as.local.slot]) && isNumber(traced->as.local.constant))
+    {
+        traced->opCode = OP_GUARD_NUMBER_LOCAL_ADD_CONSTANT;
+    }
+    else if (opCode == OP_LOCAL_INCREMENT && isNumber(currentFrame->sp[traced->as.local.slot]) && isNumber(traced->as.local.constant))
+    {
+        traced->opCode = OP_GUARD_NUMBER_LOCAL_INCREMENT;
+    }
+    else if (isBranch(opCode))
+    {
+        traced->opCode = OP_GUARD_BRANCH;
+    }
+    traced->handler = getHandlerFor(traced->opCode);
+}
+
+// Runs one iteration of the loop, from the back-edge's target, keeping a copy of every
+// instruction it goes through. Unconditional jumps are followed rather than kept. Calls,
+// returns and inner loops give up on the trace. Recording stops in front of the back-edge,
+// which the interpreter then runs with the trace in place.
+static void recordTrace(VirtualMachine *vm, Instruction *backEdge)
+{
+    FunctionObj *function = getCurrentFrame(vm)->function;
+    Trace *trace = addTrace(function, backEdge);
+    Instruction *recorded = GROW_ARRAY(Instruction, NULL, 0, MAX_TRACE_LENGTH);
+    int count = 0;
+
+    while (count < MAX_TRACE_LENGTH)
+    {
+        Instruction *instruction = getCurrentFrame(vm)->ip;
+        OpCode opCode = instruction->opCode;
+        if (instruction == backEdge)
+        {
+            recorded[count] = *instruction;
+            recorded[count].opCode = OP_TRACE_LOOP;
+            recorded[count].handler = interpretTraceLoop;
+            recorded[count].exit = instruction;
+            count++;
+
+            recorded = GROW_ARRAY(Instruction, recorded, MAX_TRACE_LENGTH, count);
+            recorded[count - 1].as.target = recorded;
+            trace->instructions = recorded;
+            trace->count = count;
+            if (vm->useJit && vm->recorder == NULL)
+            {
+                trace->native = compileToNative(recorded, count);
+                nameNativeCode(vm, function, trace->native, backEdge);
+            }
+            return;
+        }
+        else if (isCallOpCode(opCode) || opCode == OP_RETURN || isBackEdge(opCode))
+        {
             break;
         }
+
+        Instruction *traced = &recorded[count];
+        *traced = *instruction;
+        traced->exit = instruction;
+        specializeForTrace(vm, traced);
+
+        getHandlerFor(opCode)(vm, instruction);
+        if (isBranch(opCode))
+        {
+            traced->as.target = getCurrentFrame(vm)->ip;
+        }
+        if (!isUnconditionalJump(opCode))
+        {
+            count++;
+        }
+    }
+
+    FREE_ARRAY(Instruction, recorded, MAX_TRACE_LENGTH);
+}
+
+static inline void recordFlightOf(VirtualMachine *vm, Instruction *instruction, Instruction *origin, int flags)
+{
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    FunctionObj *function = currentFrame->function;
+    int tag = vm->stackTop > currentFrame->sp ? vm->stackTop[-1].type : FLIGHT_EMPTY_STACK;
+    if (function->isOptimized)
+    {
+        tag |= FLIGHT_OPTIMIZED;
+    }
+    recordFlight(vm->recorder, function, instruction->opCode, origin - function->decoded, tag | flags);
+}
+
+static void runTraceInstructions(VirtualMachine *vm, CallFrame *currentFrame, Instruction *first, Instruction *end)
+{
+    while (currentFrame->ip >= first && currentFrame->ip < end)
+    {
+        COUNT_INSTRUCTION(vm, currentFrame->ip);
+        currentFrame->ip->handler(vm, currentFrame->ip);
+    }
+}
+
+// Trace instructions are recorded as the function instruction they were copied from.
+static void runRecordedTraceInstructions(VirtualMachine *vm, CallFrame *currentFrame, Instruction *first, Instruction *end)
+{
+    while (currentFrame->ip >= first && currentFrame->ip < end)
+    {
+        recordFlightOf(vm, currentFrame->ip, currentFrame->ip->exit, FLIGHT_IN_TRACE);
+        COUNT_INSTRUCTION(vm, currentFrame->ip);
+        currentFrame->ip->handler(vm, currentFrame->ip);
+    }
+}
+
+// Runs the trace from the loop's first instruction until the loop ends or a guard fails.
+// Either way ip is back in the function's own instructions afterwards.
+static void runTrace(VirtualMachine *vm, Trace *trace)
+{
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    Instruction *first = trace->instructions;
+    Instruction *end = first + trace->count;
+
+    trace->entryCount++;
+    currentFrame->ip = first;
+    if (trace->native != NULL)
+    {
+        runNativeCode(trace->native, vm, 0);
+    }
+    if (vm->recorder != NULL)
+    {
+        runRecordedTraceInstructions(vm, currentFrame, first, end);
+    }
+    else
+    {
+        runTraceInstructions(vm, currentFrame, first, end);
+    }
+
+    if (currentFrame->ip != trace->backEdge + 1)
+    {
+        trace->guardExitCount++;
+        if (trace->entryCount >= MIN_TRACE_ENTRIES_TO_DISABLE && trace->guardExitCount * 2 > trace->entryCount)
+        {
+            trace->isDisabled = true;
+        }
+    }
+}
+
+// Unoptimized functions count back-edges towards being optimized. Optimized ones keep
+// counting until their loops are hot enough to trace, then run the traces.
+static void countBackEdge(VirtualMachine *vm, Instruction *backEdge)
+{
+    FunctionObj *function = getCurrentFrame(vm)->function;
+    if (vm->profile != NULL)
+    {
+        return;
+    }
+
+    if (!function->isOptimized)
+    {
+        function->backEdgeCount++;
+        if (function->backEdgeCount >= vm->hotLoopThreshold)
+        {
+            tierUp(vm, function);
+        }
+        return;
+    }
+
+    Trace *trace = findTrace(function, backEdge);
+    if (trace != NULL)
+    {
+        if (trace->instructions != NULL && !trace->isDisabled)
+        {
+            runTrace(vm, trace);
+        }
+        return;
+    }
+
+    function->backEdgeCount++;
+    if (function->backEdgeCount >= vm->hotLoopThreshold + vm->hotTraceThreshold)
+    {
+        recordTrace(vm, backEdge);
+    }
+}
+
+static bool isAtEndOfBytecode(VirtualMachine *vm)
+{
+    OpCode opCode = vm->frames[vm->fp].ip->opCode;
+    return OP_RETURN == opCode && vm->fp == 0;
+}
+
+// Instructions with an immediate constant work on it, local reads on the local, and the
+// rest on the top of the stack.
+static int getOperandShape(VirtualMachine *vm, Instruction *instruction)
+{
+    OpCode opCode = instruction->opCode;
+    CallFrame *currentFrame = getCurrentFrame(vm);
+    if (opCode == OP_CONSTANT || opCode == OP_CONSTANT_LONG)
+    {
+        return instruction->as.constant.type;
+    }
+    else if (opCode == OP_LOCAL_ADD_CONSTANT || opCode == OP_LOCAL_INCREMENT || opCode == OP_LOCAL_LESS_THAN_CONSTANT || opCode == OP_LOOP_IF_LOCAL_LESS_THAN_CONSTANT)
+    {
+        return currentFrame->sp[instruction->as.local.slot].type;
+    }
+    else if (opCode == OP_VAR_EXPRESSION || opCode == OP_VAR_EXPRESSION_LONG)
+    {
+        return currentFrame->sp[instruction->as.slot].type;
+    }
+    return vm->stackTop > currentFrame->sp ? vm->stackTop[-1].type : OPERAND_NONE;
+}
+
+static void runProfiled(VirtualMachine *vm)
+{
+    breakInstructionSequence(vm->profile);
+    while (!isAtEndOfBytecode(vm))
+    {
+        Instruction *instruction = vm->frames[vm->fp].ip;
+        recordInstruction(vm->profile, instruction, getOperandShape(vm, instruction));
+        if (vm->recorder != NULL)
+        {
+            recordFlightOf(vm, instruction, instruction, 0);
+        }
+        COUNT_INSTRUCTION(vm, instruction);
+        instruction->handler(vm, instruction);
+    }
+}
+
+// Its own loop, so the interpreter's stays free of the check. Recording still costs
+// about 40% on fib(30) with the JIT off, mostly the record written per instruction.
+static void runRecorded(VirtualMachine *vm)
+{
+    while (!isAtEndOfBytecode(vm))
+    {
+        Instruction *instruction = vm->frames[vm->fp].ip;
+        recordFlightOf(vm, instruction, instruction, 0);
+        COUNT_INSTRUCTION(vm, instruction);
+        instruction->handler(vm, instruction);
+    }
+}
+
+void interpret(VirtualMachine *vm)
+{
+#ifdef GUARDED_STACK
+    installStackGuard(vm);
+    if (sigsetjmp(stackOverflowJump, 1) != 0)
+    {
+        haltWithError(vm, "Stack overflow.");
+    }
+#endif
+
+    if (vm->profile != NULL)
+    {
+        runProfiled(vm);
+    }
+    else if (vm->recorder != NULL)
+    {
+        runRecorded(vm);
+    }
+    while (!isAtEndOfBytecode(vm))
+    {
+        Instruction *instruction = vm->frames[vm->fp].ip;
+        COUNT_INSTRUCTION(vm, instruction);
+        instruction->handler(vm, instruction);
     }
     if (isAtEndOfBytecode(vm))
     {
+        // The script's OP_RETURN never runs its handler, so its return is told here.
+        PROBE_FUNCTION_RETURN(getFunctionName(vm->frames[vm->fp].function), vm->fp + 1);
         vm->frames[vm->fp].ip = vm->frames[vm->fp].ip + 1;
     }
+    if (vm->output != NULL && !flushOutput(vm->output))
+    {
+        reportError(vm, "Could not write output.");
+    }
+
+#ifdef GUARDED_STACK
+    removeStackGuard();
+#endif
 }
 
 Value peek(VirtualMachine *vm)
 {
-    CallFrame *currentFrame = getCurrentFrame(vm);
-    int stackPeekIndex = currentFrame->currentStackIndex - 1;
-    Value popped = currentFrame->sp[stackPeekIndex];
-    return popped;
+    return vm->stackTop[-1];
 }
 
 void push(VirtualMachine *vm, Value value)
 {
-    CallFrame *currentFrame = getCurrentFrame(vm);
-    currentFrame->sp[currentFrame->currentStackIndex] = value;
-
-    currentFrame->currentStackIndex++;
-    vm->currentStackIndex++;
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
 Value pop(VirtualMachine *vm)
 {
-    CallFrame *currentFrame = getCurrentFrame(vm);
-    int stackPeekIndex = currentFrame->currentStackIndex - 1;
-    Value popped = currentFrame->sp[stackPeekIndex];
-    currentFrame->currentStackIndex--;
-    return popped;
-}
\ No newline at end of file
+    vm->stackTop--;
+    return *vm->stackTop;
+}
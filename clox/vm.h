@@ -8,40 +8,100 @@
 #include <stdlib.h>
 #include "value.h"
 #include "functionobj.h"
+#include "opcodeprofile.h"
+#include "perfmap.h"
+#include "flightrecorder.h"
+#include "outputsink.h"
+#include "stats.h"
 
-#define _NUM_CALL_FRAMES_ 256
+// Building with CLOX_GUARDED_STACK on Linux maps the value stack at its full size with a
+// guard page after it, so overflowing it is caught by the MMU rather than checked per call.
+#if defined(CLOX_GUARDED_STACK) && defined(__linux__)
+#define GUARDED_STACK
+#endif
+
+#define _DEFAULT_MAX_STACK_SLOTS_ (1024 * 1024)
+#define _DEFAULT_MAX_CALL_FRAMES_ (64 * 1024)
+#define _DEFAULT_HOT_CALL_THRESHOLD_ 1000
+#define _DEFAULT_HOT_LOOP_THRESHOLD_ 1000
+#define _DEFAULT_HOT_TRACE_THRESHOLD_ 1000
 
 typedef struct CallFrame
 {
     FunctionObj *function;
-    uint8_t *ip;
+    Instruction *ip;
     // This is the start of the usable stack. 
     Value *sp;
 
-    int currentStackIndex;
+    // How far below sp the return value goes: 1 when the callee itself sits under its
+    // arguments, 0 when it was called directly.
+    int returnOffset;
 } CallFrame;
 
 typedef struct VirtualMachine
 {
-    Value stack[256];
+    // The stack and frames grow when a call needs more room than they have. Growing
+    // the stack moves it, so every live frame's sp is rebased onto the new block.
+    Value *stack;
+    // One past the top value, shared by every frame.
+    Value *stackTop;
+    int stackCapacity;
+    int maxStackSlots;
+    // Gets each printed line in a malloc'd string it frees, unless output is set.
     void (*onStdOut)(char *);
+    void (*onStdErr)(char *);
+    // When set, print appends to it without allocating. It is flushed when interpret()
+    // finishes, which reports an error if any of it could not be written, and before an
+    // error is reported.
+    OutputSink *output;
+    // How print writes numbers. NUMBER_FORMAT_FIXED brings back the old %f output for
+    // anything that depends on it.
+    NumberFormat numberFormat;
     HashMap global;
 
-    CallFrame frames[_NUM_CALL_FRAMES_];
+    CallFrame *frames;
+    int frameCapacity;
+    int maxCallFrames;
     int fp;
-    bool debugMode;
 
-    int currentStackIndex;
+    // Calls or loop back-edges a function takes before its instructions are optimized.
+    int hotCallThreshold;
+    int hotLoopThreshold;
+    // Further back-edges an optimized function takes before its loops are traced.
+    int hotTraceThreshold;
+    // Optimized functions are also compiled to machine code where the JIT is available.
+    bool useJit;
+    // Set through setDebugMode(), which swaps the handlers the VM threads instructions with
+    // and what prepareForCall() does as the function it sets up starts.
+    bool debugMode;
+    InstructionHandler *handlers;
+    void (*enterFunction)(struct VirtualMachine *, FunctionObj *);
+    // While set, every instruction run is recorded in it and functions are not tiered up,
+    // so the profile sees the instructions the compiler emitted.
+    OpcodeProfile *profile;
+    // When set, machine code the JIT writes is named after its function for perf.
+    PerfMap *perfMap;
+    // While set, every instruction run is written to it. Machine code runs without passing
+    // through the interpreter, so nothing is compiled to it while recording.
+    FlightRecorder *recorder;
+    // Only counted in builds with CLOX_STATS.
+    VmStats stats;
 } VirtualMachine;
 
 void initVirtualMachine(VirtualMachine *);
+void freeVirtualMachine(VirtualMachine *);
 void interpret(VirtualMachine *);
+// Takes effect for the functions reachable from the next prepareForCall().
+void setDebugMode(VirtualMachine *, bool isEnabled);
 
 // So given a function object, it should be able to set up a call stack for a function object?
 // So you are about to call a function, you need to 
 
 CallFrame* prepareForCall(VirtualMachine*, FunctionObj*);
 
+// Decodes the function's bytecode the first time it is asked for.
+Instruction *getDecodedCode(FunctionObj *);
+
 void push(VirtualMachine *, Value);
 Value peek(VirtualMachine *);
 Value pop(VirtualMachine *);